@@ -0,0 +1,140 @@
+/*
+ BasicServer, AuthServer, UserServer, and PushServer in one process
+
+ Each server's main runs on its own thread, as it would in a process
+ of its own, and opens its listener for external clients. Requests
+ from one server to another never leave the process: each server's
+ handlers are routed in-process under the address the others use
+ for it, so send_request hands them the request object directly.
+
+ The servers are started in dependency order, each once the one
+ before it is serving. Wait for a carriage return, then stop all four.
+ */
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include "AllInOne.h"
+#include "LocalRpcHttp.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+using web::http::http_request;
+
+#define SERVER_ENTRY_POINTS \
+  void handle_get (http_request message); \
+  void handle_post (http_request message); \
+  void handle_put (http_request message); \
+  void handle_delete (http_request message); \
+  int main (int argc, char const * argv[]);
+
+namespace basic_server { SERVER_ENTRY_POINTS }
+namespace auth_server { SERVER_ENTRY_POINTS }
+namespace user_server { SERVER_ENTRY_POINTS }
+namespace push_server { SERVER_ENTRY_POINTS }
+
+namespace {
+  std::mutex stop_lock {};
+  std::condition_variable stop_changed {};
+  bool stop_requested {false};
+  // Servers waiting in wait_for_stop, or whose main has returned
+  unsigned int servers_up {0};
+  // Whether the server on this thread is counted in servers_up
+  thread_local bool counted {false};
+
+  void server_up () {
+    if (counted)
+      return;
+    counted = true;
+    {
+      unique_lock<std::mutex> guard {stop_lock};
+      ++servers_up;
+    }
+    stop_changed.notify_all();
+  }
+
+  /*
+    Counts the server on this thread as up when its main ends, however
+    it ends, so that a server that returns early, without waiting for
+    the stop, does not leave the others waiting for it to start
+   */
+  struct main_ended {
+    ~main_ended () { server_up(); }
+  };
+
+  struct server {
+    string name;
+    string base_uri;
+    std::function<int (int, char const *[])> main;
+    http_handler get;
+    http_handler post;
+    http_handler put;
+    http_handler del;
+  };
+}
+
+void wait_for_stop () {
+  server_up();
+  unique_lock<std::mutex> guard {stop_lock};
+  stop_changed.wait (guard, [] { return stop_requested; });
+}
+
+int main (int argc, char const * argv[]) {
+  // In the order they are started: each calls only those before it
+  const vector<server> servers {
+    {"BasicServer", "http://localhost:34568/", &basic_server::main,
+     &basic_server::handle_get, &basic_server::handle_post,
+     &basic_server::handle_put, &basic_server::handle_delete},
+    {"AuthServer", "http://localhost:34570/", &auth_server::main,
+     &auth_server::handle_get, http_handler {},
+     &auth_server::handle_put, &auth_server::handle_delete},
+    {"PushServer", "http://localhost:34574/", &push_server::main,
+     http_handler {}, &push_server::handle_post, http_handler {}, http_handler {}},
+    {"UserServer", "http://localhost:34572/", &user_server::main,
+     &user_server::handle_get, &user_server::handle_post,
+     &user_server::handle_put, &user_server::handle_delete}};
+
+  for (const server& s : servers)
+    route_in_process(s.base_uri, s.get, s.post, s.put, s.del);
+
+  vector<std::thread> threads {};
+  for (const server& s : servers) {
+    cout << "AllInOne: Starting " << s.name << endl;
+    threads.emplace_back ([&s, argc, argv] () {
+      const main_ended guard {};
+      try {
+        s.main(argc, argv);
+      }
+      catch (const std::exception& e) {
+        cout << "AllInOne: " << s.name << " failed: " << e.what() << endl;
+      }
+    });
+    unique_lock<std::mutex> guard {stop_lock};
+    stop_changed.wait (guard, [&threads] { return servers_up >= threads.size(); });
+  }
+
+  cout << "Enter carriage return to stop all servers." << endl;
+  string line;
+  std::getline(std::cin, line);
+
+  {
+    unique_lock<std::mutex> guard {stop_lock};
+    stop_requested = true;
+  }
+  stop_changed.notify_all();
+  for (std::thread& t : threads)
+    t.join();
+  cout << "AllInOne closed" << endl;
+}
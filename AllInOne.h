@@ -0,0 +1,22 @@
+#ifndef AllInOne_h
+#define AllInOne_h
+
+/*
+  The allinone target builds BasicServer, AuthServer, UserServer,
+  and PushServer into one process, for hosts that run all four.
+  With ALL_IN_ONE defined, each server's code is in a namespace of
+  its own (basic_server, auth_server, user_server, push_server),
+  and its main runs on a thread started by AllInOne.cpp.
+
+  Every listener is still opened for external clients, but calls
+  from one server to another are handed straight to the target's
+  handlers; see route_in_process.
+ */
+
+#ifdef ALL_IN_ONE
+// Called by each server's main where it would wait for a carriage
+// return; returns once the whole process is to stop
+void wait_for_stop ();
+#endif
+
+#endif
@@ -2,7 +2,10 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -13,7 +16,17 @@
 #include <was/common.h>
 #include <was/table.h>
 
+#include "CredentialCache.h"
+#include "AllInOne.h"
+#include "LocalRpcHttp.h"
+#include "RateLimiter.h"
+#include "Router.h"
+#include "ServerConfig.h"
+#include "SessionToken.h"
 #include "TableCache.h"
+#include "TokenCache.h"
+#include "UseridFilter.h"
+#include "WorkerPool.h"
 #include "make_unique.h"
 
 #include "azure_keys.h"
@@ -22,6 +35,7 @@ using azure::storage::storage_exception;
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
+using azure::storage::query_comparison_operator;
 using azure::storage::entity_property;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
@@ -44,6 +58,7 @@ using std::vector;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
@@ -55,6 +70,11 @@ using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
+// In the all-in-one binary, each server's code is in a namespace of its own
+#ifdef ALL_IN_ONE
+namespace auth_server {
+#endif
+
 constexpr const char* def_url = "http://localhost:34570";
 
 const string auth_table_name {"AuthTable"};
@@ -66,12 +86,94 @@ const string data_table_name {"DataTable"};
 
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
+const string metrics_admin_op {"MetricsAdmin"};
+const string invalidate_user_admin_op {"InvalidateUserAdmin"};
+const string add_user_admin_op {"AddUserAdmin"};
+
+enum class auth_op { get_read_token, get_update_token, metrics_admin, invalidate_user_admin, add_user_admin, unknown };
+
+const route_table<auth_op> auth_routes {
+    {{get_read_token_op, auth_op::get_read_token},
+     {get_update_token_op, auth_op::get_update_token},
+     {metrics_admin_op, auth_op::metrics_admin},
+     {invalidate_user_admin_op, auth_op::invalidate_user_admin},
+     {add_user_admin_op, auth_op::add_user_admin}},
+    auth_op::unknown};
 
 /*
  Cache of opened tables
  */
 TableCache table_cache {};
 
+/*
+ Cache of AuthTable credentials, so that repeated sign-ons by the
+ same user need no storage I/O. AUTH_CREDENTIAL_TTL (seconds) bounds
+ how long a change made directly in AuthTable goes unnoticed.
+ */
+CredentialCache credential_cache {std::chrono::seconds {config_long("AUTH_CREDENTIAL_TTL", 60)},
+                                  static_cast<std::size_t>(config_long("AUTH_CREDENTIAL_CACHE_SIZE", 100000))};
+
+/*
+ Lifetime of every token issued
+ */
+constexpr std::chrono::seconds token_lifetime {24 * 60 * 60};
+
+/*
+ Signer of session tokens, which UserServer and BasicServer check
+ locally with the same key. SESSION_KEY must be set, to the same
+ value for all three servers; the server will not start without it.
+ */
+SessionSigner session_signer {config_required("SESSION_KEY")};
+
+/*
+ Lifetime of every session token issued, in seconds
+ */
+const long session_lifetime {config_long("SESSION_LIFETIME", 24 * 60 * 60)};
+
+/*
+ Tokens already signed, reused until AUTH_TOKEN_REUSE_FRACTION of
+ token_lifetime has passed, to keep HMAC signing off the hot path
+ during sign-on storms.
+ */
+TokenCache issued_tokens {config_double("AUTH_TOKEN_REUSE_FRACTION", 0.5),
+                          static_cast<std::size_t>(config_long("AUTH_TOKEN_CACHE_SIZE", 100000))};
+
+/*
+ Userids known not to exist, answered with NotFound without a
+ storage read. Misses are remembered for AUTH_NEGATIVE_TTL_MS.
+ If AUTH_BLOOM_BITS is set, a Bloom filter of all userids is
+ also built at startup; users must then be created through
+ AddUserAdmin so that the filter learns of them.
+ */
+UseridFilter userid_filter {std::chrono::milliseconds {config_long("AUTH_NEGATIVE_TTL_MS", 5000)},
+                            static_cast<std::size_t>(config_long("AUTH_NEGATIVE_CACHE_SIZE", 100000))};
+
+/*
+ Token buckets per userid and per client address, with rates in
+ requests per second. A client over its limit gets 429.
+ */
+RateLimiter user_limiter {static_cast<std::size_t>(config_long("AUTH_RATE_SLOTS", 65536)),
+                          config_double("AUTH_USER_RATE", 5),
+                          config_double("AUTH_USER_BURST", 10)};
+RateLimiter client_limiter {static_cast<std::size_t>(config_long("AUTH_RATE_SLOTS", 65536)),
+                            config_double("AUTH_CLIENT_RATE", 50),
+                            config_double("AUTH_CLIENT_BURST", 100)};
+
+/*
+ Proxies trusted to name the client in X-Forwarded-For, a
+ comma-separated list of addresses in AUTH_TRUSTED_PROXIES. The
+ header of any other sender is ignored. UserServer, which forwards
+ the address of its own client, is a proxy of AuthServer, so the
+ default trusts the loopback addresses.
+ */
+const vector<string> trusted_proxies {parse_address_list(config_string("AUTH_TRUSTED_PROXIES", "127.0.0.1,::1"))};
+
+/*
+ Workers that verify passwords and issue tokens, sized by
+ AUTH_VERIFY_THREADS and AUTH_VERIFY_QUEUE. Created in main.
+ */
+std::unique_ptr<WorkerPool> verify_pool {};
+
 /*
  Convert properties represented in Azure Storage type
  to prop_str_vals_t type.
@@ -149,13 +251,22 @@ unordered_map<string,string> get_json_body(http_request message) {
  For read and update:
  table_shared_access_policy::permissions::read |
  table_shared_access_policy::permissions::update
+ 
+ A token issued earlier for the same scope and permissions is
+ returned instead of signing a new one, while issued_tokens
+ considers it fresh enough.
  */
 pair<status_code,string> do_get_token (const cloud_table& data_table,
                                        const string& partition,
                                        const string& row,
                                        uint8_t permissions) {
     
-    utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_days(1)};
+    string cached_token {};
+    if (issued_tokens.lookup(partition, row, permissions, cached_token)) {
+        return make_pair(status_codes::OK, cached_token);
+    }
+    
+    utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_seconds(token_lifetime.count())};
     try {
         string limited_access_token {
             data_table.get_shared_access_signature(table_shared_access_policy {
@@ -172,6 +283,7 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
             //table.get_shared_access_signature(table_shared_access_policy {exptime, permissions})
         };
         cout << "Token " << limited_access_token << endl;
+        issued_tokens.insert(partition, row, permissions, limited_access_token, token_lifetime);
         return make_pair(status_codes::OK, limited_access_token);
     }
     catch (const storage_exception& e) {
@@ -181,14 +293,217 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
     }
 }
 
+/*
+ Credentials of userid from the entity properties of AuthTable
+
+ Returns NotFound if the entity has no Password, DataPartition, or
+ DataRow property.
+ */
+pair<status_code,user_credentials> to_credentials (const string& userid,
+                                                   const table_entity::properties_type& properties) {
+    auto password (properties.find(auth_table_password_prop));
+    auto partition (properties.find(auth_table_partition_prop));
+    auto row (properties.find(auth_table_row_prop));
+    if (password == properties.end() ||
+        partition == properties.end() ||
+        row == properties.end()) {
+        return make_pair(status_codes::NotFound, user_credentials {});
+    }
+    user_credentials creds {password->second.str(),
+                            partition->second.str(),
+                            row->second.str()};
+    credential_cache.insert(userid, creds);
+    return make_pair(status_codes::OK, creds);
+}
+
+/*
+ Read the credentials of userid from AuthTable
+ 
+ The entity is addressed directly by its keys, Userid/userid, so
+ the cost does not grow with the number of users. Credentials found
+ in credential_cache are returned without reading storage at all.
+ Otherwise the read completes on the task scheduler, so no thread
+ waits on storage. The returned task never throws.
+ 
+ Yields NotFound if userid has no entity, or has no Password,
+ DataPartition, or DataRow property.
+ */
+pplx::task<pair<status_code,user_credentials>> lookup_credentials (const string& userid) {
+    user_credentials cached {};
+    if (credential_cache.lookup(userid, cached)) {
+        return pplx::task_from_result(make_pair(status_codes::OK, cached));
+    }
+    try {
+        cloud_table table {table_cache.lookup_table(auth_table_name)};
+        table_operation retrieve_operation {table_operation::retrieve_entity(auth_table_userid_partition, userid)};
+        return table.execute_async(retrieve_operation)
+        .then([userid](pplx::task<table_result> t) -> pair<status_code,user_credentials>
+        {
+            try {
+                const table_result retrieve_result {t.get()};
+                if (retrieve_result.http_status_code() == status_codes::NotFound) {
+                    userid_filter.add_missing(userid);
+                    return make_pair(status_codes::NotFound, user_credentials {});
+                }
+                return to_credentials(userid, retrieve_result.entity().properties());
+            }
+            catch (const storage_exception& e) {
+                cout << "Azure Table Storage error: " << e.what() << endl;
+                cout << e.result().extended_error().message() << endl;
+                return make_pair(status_codes::InternalError, user_credentials {});
+            }
+            catch (const std::exception& e) {
+                cout << "Credential read failed: " << e.what() << endl;
+                return make_pair(status_codes::InternalError, user_credentials {});
+            }
+        });
+    }
+    catch (const storage_exception& e) {
+        cout << "Azure Table Storage error: " << e.what() << endl;
+        cout << e.result().extended_error().message() << endl;
+        return pplx::task_from_result(make_pair(status_codes::InternalError, user_credentials {}));
+    }
+    catch (const std::exception& e) {
+        cout << "Credential read failed: " << e.what() << endl;
+        return pplx::task_from_result(make_pair(status_codes::InternalError, user_credentials {}));
+    }
+}
+
+/*
+ Add every userid in AuthTable to userid_filter's Bloom filter
+ 
+ Only the keys of the Userid partition are requested.
+ */
+void load_known_userids () {
+    cloud_table table {table_cache.lookup_table(auth_table_name)};
+    table_query query {};
+    query.set_filter_string(table_query::generate_filter_condition("PartitionKey",
+                                                                   query_comparison_operator::equal,
+                                                                   auth_table_userid_partition));
+    query.set_select_columns(vector<string> {"RowKey"});
+    table_query_iterator end;
+    unsigned long count {0};
+    for (table_query_iterator it {table.execute_query(query)}; it != end; ++it) {
+        userid_filter.add_known(it->row_key());
+        ++count;
+    }
+    cout << "AuthServer: " << count << " userids loaded" << endl;
+}
+
+/*
+ Compare a supplied password with the stored verifier
+
+ The comparison takes the same time wherever the first difference
+ is, so response timing does not reveal a matching prefix.
+ */
+bool verify_password (const string& stored, const string& supplied) {
+    unsigned char diff {static_cast<unsigned char>(stored.size() != supplied.size())};
+    for (string::size_type i {0}; i < stored.size(); ++i) {
+        const char c {i < supplied.size() ? supplied[i] : '\0'};
+        diff |= static_cast<unsigned char>(stored[i] ^ c);
+    }
+    return diff == 0;
+}
+
+/*
+ Check the user's password against creds and reply with a token for
+ their data
+ 
+ The reply also carries a session token with the same scope, and
+ the user's DataPartition and DataRow.
+ 
+ Runs on a verify_pool worker, so that verification work cannot
+ starve the listener threads. The credentials are read before the
+ job is queued, so the workers do no storage I/O.
+ */
+void issue_token (http_request message,
+                  auth_op operation,
+                  const string& userid,
+                  const string& password,
+                  const user_credentials& creds) {
+    if (!verify_password(creds.password, password)) {
+        message.reply(status_codes::NotFound);
+        return;
+    }
+    
+    uint8_t permissions {table_shared_access_policy::permissions::read};
+    if (operation == auth_op::get_update_token) {
+        permissions |= table_shared_access_policy::permissions::update;
+    }
+    cloud_table data_table {table_cache.lookup_table(data_table_name)};
+    pair<status_code,string> token_pair {do_get_token(data_table,
+                                                      creds.data_partition,
+                                                      creds.data_row,
+                                                      permissions)};
+    if (token_pair.first != status_codes::OK) {
+        message.reply(token_pair.first);
+        return;
+    }
+    const session_claims claims {userid,
+                                 creds.data_partition,
+                                 creds.data_row,
+                                 session_now() + session_lifetime,
+                                 operation == auth_op::get_update_token};
+    string session {};
+    try {
+        session = session_signer.sign(claims);
+    }
+    catch (const std::invalid_argument& e) {
+        // A userid or key containing the separator gets no session token,
+        // and no reply that UserServer would record as a session
+        cout << "Session token not issued: " << e.what() << endl;
+        message.reply(status_codes::InternalError);
+        return;
+    }
+    value end_result {build_json_object(vector<pair<string,string>> {
+        make_pair("token",token_pair.second),
+        make_pair("session",session),
+        make_pair(auth_table_partition_prop,creds.data_partition),
+        make_pair(auth_table_row_prop,creds.data_row)})};
+    message.reply(status_codes::OK,end_result);
+}
+
+/*
+ Counters reported by GET MetricsAdmin
+ */
+value metrics () {
+    value result {value::object ()};
+    result["CredentialCacheHits"] = value::number(static_cast<uint64_t>(credential_cache.hit_count()));
+    result["CredentialCacheMisses"] = value::number(static_cast<uint64_t>(credential_cache.miss_count()));
+    result["CredentialCacheInvalidations"] = value::number(static_cast<uint64_t>(credential_cache.invalidation_count()));
+    result["CredentialCacheSize"] = value::number(static_cast<uint64_t>(credential_cache.size()));
+    result["TokenCacheHits"] = value::number(static_cast<uint64_t>(issued_tokens.hit_count()));
+    result["TokenCacheMisses"] = value::number(static_cast<uint64_t>(issued_tokens.miss_count()));
+    result["NegativeCacheHits"] = value::number(static_cast<uint64_t>(userid_filter.negative_hit_count()));
+    result["NegativeCacheSize"] = value::number(static_cast<uint64_t>(userid_filter.negative_size()));
+    result["BloomRejects"] = value::number(static_cast<uint64_t>(userid_filter.bloom_reject_count()));
+    result["RateAllowedByUser"] = value::number(static_cast<uint64_t>(user_limiter.allowed_count()));
+    result["RateThrottledByUser"] = value::number(static_cast<uint64_t>(user_limiter.throttled_count()));
+    result["RateAllowedByClient"] = value::number(static_cast<uint64_t>(client_limiter.allowed_count()));
+    result["RateThrottledByClient"] = value::number(static_cast<uint64_t>(client_limiter.throttled_count()));
+    result["VerifyQueueDepth"] = value::number(static_cast<uint64_t>(verify_pool->depth()));
+    result["VerifyQueuePeak"] = value::number(static_cast<uint64_t>(verify_pool->peak()));
+    result["VerifyQueueCapacity"] = value::number(static_cast<uint64_t>(verify_pool->max_depth()));
+    result["VerifyAccepted"] = value::number(static_cast<uint64_t>(verify_pool->accepted_count()));
+    result["VerifyRejected"] = value::number(static_cast<uint64_t>(verify_pool->rejected_count()));
+    result["VerifyCompleted"] = value::number(static_cast<uint64_t>(verify_pool->completed_count()));
+    return result;
+}
+
 /*
  Top-level routine for processing all HTTP GET requests.
  */
 void handle_get(http_request message) {
     
-    string path {uri::decode(message.relative_uri().path())};
+    const string path {message.relative_uri().path()};
     cout << endl << "**** AuthServer GET " << path << endl;
-    auto paths = uri::split_path(path);
+    const path_segments paths {path};
+    
+    if (auth_routes.lookup(paths[0]) == auth_op::metrics_admin) {
+        message.reply(status_codes::OK, metrics());
+        return;
+    }
+    
     unordered_map<string,string> json_body {get_json_body(message)};
 
     string password_str {json_body["Password"]}; 
@@ -218,114 +533,56 @@ void handle_get(http_request message) {
         }
     }
     
-    cout << "Found Password"<< endl;
-    cloud_table table {table_cache.lookup_table("AuthTable")};
-    cloud_table data_table {table_cache.lookup_table("DataTable")};
-    
-
-    table_query query{};
-    table_query_iterator end;
-    table_query_iterator iterator = table.execute_query(query);
-    bool found = false;
-    while(iterator!=end){
-        if(iterator->row_key()==paths[1]){
-            found = true;
-        }
-      iterator++;
+    const auth_op operation {auth_routes.lookup(paths[0])};
+    const string userid {paths.decoded(1)};
+    if (operation == auth_op::unknown) {
+        message.reply(status_codes::NotImplemented);
+        return;
     }
-    if(!found){
-        message.reply(status_codes::NotFound);
+    if (password_str.empty()) {
+        message.reply(status_codes::BadRequest);
+        return;
     }
     
-    if(paths[0]==get_read_token_op){
-        //cout << "Doing " << paths[0] << endl;
-        table_query query{};
-        table_query_iterator end;
-
-        table_query_iterator it = table.execute_query(query);
-        string DataP {};
-        string DataR {};
-        int counter{0};
-        //vector<value> token_vec;
-        while(it != end){
-            prop_str_vals_t keys {};
-            keys = get_string_properties(it->properties());
-            
-            auto key_it = keys.begin();
-            if(key_it->second == password_str){
-                counter++;            
-            }
-            if(key_it->first == auth_table_partition_prop){
-                DataP = key_it->second;
-                counter++;
-            }
-            if(key_it->first == auth_table_row_prop){
-                DataR = key_it->second;
-                counter++;
-
-            }
-            it++;
-        }
-        if(counter==3){
-            pair<status_code,string> token_pair {do_get_token(data_table,DataP,DataR,table_shared_access_policy::permissions::read)};
-            if(token_pair.first == status_codes::OK){
-                pair<string,string> result {make_pair("token",token_pair.second)};
-                value end_result {build_json_object(vector<pair<string,string>> {make_pair("token",token_pair.second)})};
-                message.reply(status_codes::OK,end_result);
-                return;
-            }
-        }
-        else if(counter<3){
-            message.reply(status_codes::NotFound);
-            return;
-        }            
+    if (throttle(message, client_limiter, client_key(message, trusted_proxies)) ||
+        throttle(message, user_limiter, userid)) {
+        return;
+    }
     
+    if (userid_filter.known_absent(userid)) {
+        message.reply(status_codes::NotFound);
+        return;
     }
-        
     
-    if(paths[0]==get_update_token_op){
-        table_query query{};
-        table_query_iterator end;
-
-        table_query_iterator it = table.execute_query(query);
-        string DataP {};
-        string DataR {};
-        int counter{0};
-        //vector<value> token_vec;
-        while(it != end){
-            prop_str_vals_t keys {};
-            keys = get_string_properties(it->properties());
-            auto key_it = keys.begin(); 
-            if(key_it->second == password_str){
-                ++counter;            
-            }
-            if(key_it->first == auth_table_partition_prop){
-                DataP = key_it->second;
-                ++counter;
+    // A single point read of Userid/userid, independent of AuthTable's size.
+    // Verification then runs on verify_pool, never on the listener thread.
+    lookup_credentials(userid)
+    .then([message, operation, userid, password_str](pair<status_code,user_credentials> creds)
+    {
+        if (creds.first != status_codes::OK) {
+            message.reply(creds.first);
+            return;
+        }
+        const bool queued {verify_pool->submit([message, operation, userid, password_str, creds] () {
+            try {
+                issue_token(message, operation, userid, password_str, creds.second);
             }
-            if(key_it->first == auth_table_row_prop){
-                DataR = key_it->second;
-                ++counter;
+            catch (const std::exception& e) {
+                cout << "Token not issued: " << e.what() << endl;
+                message.reply(status_codes::InternalError);
             }
-            it++;
-        }
-        if(counter==3){
-            pair<status_code,string> token_pair {do_get_token(data_table,DataP,DataR,table_shared_access_policy::permissions::read
-                                                                                    |table_shared_access_policy::permissions::update)};
-            if(token_pair.first == status_codes::OK){
-                pair<string,string> result {make_pair("token",token_pair.second)};
-                value end_result {build_json_object(vector<pair<string,string>> {make_pair("token",token_pair.second)})};
-                message.reply(status_codes::OK,end_result);
-                return;
+            catch (...) {
+                cout << "Token not issued" << endl;
+                message.reply(status_codes::InternalError);
             }
+        })};
+        if (!queued) {
+            cout << "Verification queue full, shedding request" << endl;
+            http_response response {status_codes::ServiceUnavailable};
+            response.headers().add("Retry-After", "1");
+            message.reply(response);
         }
-        else if(counter<3){
-            message.reply(status_codes::NotFound);
-            return;
-        }            
-    }
-    message.reply(status_codes::NotImplemented);
-    return;
+    });
 }
 
 /*
@@ -338,18 +595,80 @@ void handle_post(http_request message) {
 
 /*
  Top-level routine for processing all HTTP PUT requests.
+ 
+ AddUserAdmin/userid creates or replaces the AuthTable entity of
+ userid from a JSON body with Password, DataPartition, and DataRow,
+ and tells userid_filter that the user now exists.
  */
 void handle_put(http_request message) {
-    string path {uri::decode(message.relative_uri().path())};
+    const string path {message.relative_uri().path()};
     cout << endl << "**** PUT " << path << endl;
+    const path_segments paths {path};
+    
+    if (paths.size() < 2) {
+        message.reply(status_codes::BadRequest);
+        return;
+    }
+    if (auth_routes.lookup(paths[0]) != auth_op::add_user_admin) {
+        message.reply(status_codes::NotImplemented);
+        return;
+    }
+    
+    unordered_map<string,string> json_body {get_json_body(message)};
+    if (json_body[auth_table_password_prop].empty() ||
+        json_body[auth_table_partition_prop].empty() ||
+        json_body[auth_table_row_prop].empty()) {
+        message.reply(status_codes::BadRequest);
+        return;
+    }
+    
+    const string userid {paths.decoded(1)};
+    table_entity entity {auth_table_userid_partition, userid};
+    table_entity::properties_type& properties = entity.properties();
+    properties[auth_table_password_prop] = entity_property {json_body[auth_table_password_prop]};
+    properties[auth_table_partition_prop] = entity_property {json_body[auth_table_partition_prop]};
+    properties[auth_table_row_prop] = entity_property {json_body[auth_table_row_prop]};
+    try {
+        cloud_table table {table_cache.lookup_table(auth_table_name)};
+        table.execute(table_operation::insert_or_replace_entity(entity));
+    }
+    catch (const storage_exception& e) {
+        cout << "Azure Table Storage error: " << e.what() << endl;
+        cout << e.result().extended_error().message() << endl;
+        message.reply(status_codes::InternalError);
+        return;
+    }
+    userid_filter.add_known(userid);
+    credential_cache.invalidate(userid);
+    message.reply(status_codes::OK);
 }
 
 /*
  Top-level routine for processing all HTTP DELETE requests.
+ 
+ InvalidateUserAdmin/userid drops any cached credentials of userid,
+ so that a password change takes effect on the next sign-on, and
+ any negative entry, so that a newly created user is seen at once.
+ Invalidating a user that is not cached is not an error.
  */
 void handle_delete(http_request message) {
-    string path {uri::decode(message.relative_uri().path())};
+    const string path {message.relative_uri().path()};
     cout << endl << "**** DELETE " << path << endl;
+    const path_segments paths {path};
+    
+    if (paths.size() < 2) {
+        message.reply(status_codes::BadRequest);
+        return;
+    }
+    if (auth_routes.lookup(paths[0]) != auth_op::invalidate_user_admin) {
+        message.reply(status_codes::NotImplemented);
+        return;
+    }
+    // Also forget any negative entry, in case the user was just created
+    const string userid {paths.decoded(1)};
+    credential_cache.invalidate(userid);
+    userid_filter.add_known(userid);
+    message.reply(status_codes::OK);
 }
 
 /*
@@ -359,8 +678,8 @@ void handle_delete(http_request message) {
  which processes each request asynchronously.
  
  Note that, unlike BasicServer, AuthServer only
- installs the listeners for GET. Any other HTTP
- method will produce a Method Not Allowed (405)
+ installs the listeners for GET, PUT, and DELETE. Any other
+ HTTP method will produce a Method Not Allowed (405)
  response.
  
  If you want to support other methods, uncomment
@@ -373,19 +692,43 @@ int main (int argc, char const * argv[]) {
     cout << "AuthServer: Parsing connection string" << endl;
     table_cache.init (storage_connection_string);
     
+    const long bloom_bits {config_long("AUTH_BLOOM_BITS", 0)};
+    if (bloom_bits > 0) {
+        cout << "AuthServer: Loading userids into Bloom filter" << endl;
+        userid_filter.enable_bloom(static_cast<std::size_t>(bloom_bits));
+        load_known_userids();
+    }
+    
+    verify_pool = std::make_unique<WorkerPool>(
+        static_cast<std::size_t>(config_long("AUTH_VERIFY_THREADS", 4)),
+        static_cast<std::size_t>(config_long("AUTH_VERIFY_QUEUE", 256)));
+    
+    // Co-located servers may call this one over AUTH_RPC_SOCKET
+    std::unique_ptr<LocalRpcServer> rpc_server {open_local_rpc("AUTH_RPC_SOCKET",
+        http_rpc_handler(&handle_get, http_handler {}, &handle_put, &handle_delete))};
+    
     cout << "AuthServer: Opening listener" << endl;
     http_listener listener {def_url};
     listener.support(methods::GET, &handle_get);
     //listener.support(methods::POST, &handle_post);
-    //listener.support(methods::PUT, &handle_put);
-    //listener.support(methods::DEL, &handle_delete);
+    listener.support(methods::PUT, &handle_put);
+    listener.support(methods::DEL, &handle_delete);
     listener.open().wait(); // Wait for listener to complete starting
     
+#ifdef ALL_IN_ONE
+    wait_for_stop();
+#else
     cout << "Enter carriage return to stop AuthServer." << endl;
     string line;
     getline(std::cin, line);
+#endif
     
     // Shut it down
     listener.close().wait();
+    rpc_server.reset();
     cout << "AuthServer closed" << endl;
 }
+
+#ifdef ALL_IN_ONE
+} // namespace auth_server
+#endif
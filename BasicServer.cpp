@@ -23,7 +23,12 @@
 #include "TableCache.h"
 //#include "config.h"
 #include "make_unique.h"
+#include "AllInOne.h"
+#include "LocalRpcHttp.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "ServerUtils.h"
+#include "SessionToken.h"
 #include "azure_keys.h"
 
 using azure::storage::cloud_storage_account;
@@ -33,6 +38,8 @@ using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
 using azure::storage::table_query;
@@ -54,7 +61,9 @@ using std::vector;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::methods;
+using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
@@ -64,12 +73,44 @@ using web::http::experimental::listener::http_listener;
 
 using prop_vals_t = vector<pair<string,value>>;
 
+// In the all-in-one binary, each server's code is in a namespace of its own
+#ifdef ALL_IN_ONE
+namespace basic_server {
+#endif
+
 constexpr const char* def_url = "http://localhost:34568";
 
 const string create_table {"CreateTableAdmin"};
 const string delete_table {"DeleteTableAdmin"};
 const string update_entity {"UpdateEntityAdmin"};
 const string delete_entity {"DeleteEntityAdmin"};
+const string read_entity_auth {"ReadEntityAuth"};
+const string update_entity_auth {"UpdateEntityAuth"};
+const string replace_entity_auth {"ReplaceEntityAuth"};
+const string read_entity_session {"ReadEntitySession"};
+const string update_entity_session {"UpdateEntitySession"};
+const string scan_table {"ScanTableAdmin"};
+const string append_entities {"AppendEntitiesAdmin"};
+
+enum class basic_op {
+  create_table, delete_table, update_entity, delete_entity,
+  read_entity_auth, update_entity_auth, replace_entity_auth,
+  read_entity_session, update_entity_session, scan_table, append_entities, unknown
+};
+
+const route_table<basic_op> basic_routes {
+  {{create_table, basic_op::create_table},
+   {delete_table, basic_op::delete_table},
+   {update_entity, basic_op::update_entity},
+   {delete_entity, basic_op::delete_entity},
+   {read_entity_auth, basic_op::read_entity_auth},
+   {update_entity_auth, basic_op::update_entity_auth},
+   {replace_entity_auth, basic_op::replace_entity_auth},
+   {read_entity_session, basic_op::read_entity_session},
+   {update_entity_session, basic_op::update_entity_session},
+   {scan_table, basic_op::scan_table},
+   {append_entities, basic_op::append_entities}},
+  basic_op::unknown};
 
 
 /*
@@ -77,6 +118,16 @@ const string delete_entity {"DeleteEntityAdmin"};
  */
 TableCache table_cache{};
 
+/*
+  Checks the session tokens issued by AuthServer, with the same key
+ */
+SessionSigner session_signer {config_required("SESSION_KEY")};
+
+/*
+  The only table a session token grants access to
+ */
+const string session_table {"DataTable"};
+
 /*
   Convert properties represented in Azure Storage type
   to prop_vals_t type.
@@ -108,6 +159,32 @@ prop_vals_t get_properties (const table_entity::properties_type& properties, pro
   return values;
 }
 
+/*
+  The members of a JSON object as strings; a value that is not a
+  string is serialized. Empty if json is not an object.
+ */
+unordered_map<string,string> json_to_strings(const value& json) {
+  unordered_map<string,string> results {};
+  if (json.is_object()) {
+    for (const auto& v : json.as_object()) {
+      if (v.second.is_string()) {
+  results[v.first] = v.second.as_string();
+      }
+      else {
+  results[v.first] = v.second.serialize();
+      }
+    }
+  }
+  return results;
+}
+
+bool has_json_body(const http_request& message) {
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  return content_type != headers.end() &&
+    content_type->second == "application/json";
+}
+
 /*
   Given an HTTP message with a JSON body, return the JSON
   body as an unordered map of strings to strings.
@@ -117,12 +194,8 @@ prop_vals_t get_properties (const table_entity::properties_type& properties, pro
   as necessary.
  */
 unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
+  if ( ! has_json_body(message))
+    return unordered_map<string,string> {};
 
   value json{};
   message.extract_json(true)
@@ -132,18 +205,29 @@ unordered_map<string,string> get_json_body(http_request message) {
       return true;
     })
     .wait();
+  return json_to_strings(json);
+}
 
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-  results[v.first] = v.second.as_string();
+/*
+  As get_json_body, completing when the body has arrived instead of
+  waiting for it. A body that is not valid JSON yields an empty map,
+  so the returned task never throws.
+ */
+pplx::task<unordered_map<string,string>> get_json_body_async(http_request message) {
+  if ( ! has_json_body(message))
+    return pplx::task_from_result(unordered_map<string,string> {});
+
+  return message.extract_json(true)
+    .then([] (pplx::task<value> t)
+    {
+      try {
+        return json_to_strings(t.get());
       }
-      else {
-  results[v.first] = v.second.serialize();
+      catch (const std::exception& e) {
+        cout << "Unreadable JSON body: " << e.what() << endl;
+        return unordered_map<string,string> {};
       }
-    }
-  }
-  return results;
+    });
 }
 
 /*
@@ -153,9 +237,141 @@ unordered_map<string,string> get_json_body(http_request message) {
   operands specify the value(s) to be retrieved.
  */
 void handle_get(http_request message) { 
-  string path {uri::decode(message.relative_uri().path())};
+  const string path {message.relative_uri().path()};
   cout << endl << "**** GET " << path << endl;
-  auto paths = uri::split_path(path);
+  const path_segments paths {path};
+
+  /*
+    Read entity with authentication. The storage round trip
+    completes in a continuation, so the listener thread is released
+    as soon as the read is issued.
+
+    The entity's ETag is returned in the ETag header, for use as
+    If-Match in a later UpdateEntityAuth.
+   */
+  if (basic_routes.lookup(paths[0]) == basic_op::read_entity_auth) {
+    read_with_token_async(message, tables_endpoint)
+      .then([message] (pair<status_code,table_entity> result)
+      {
+        if (result.first == status_codes::OK) {
+          prop_vals_t values (get_properties(result.second.properties()));
+          http_response response {status_codes::OK};
+          response.headers().add("ETag", result.second.etag());
+          response.set_body(value::object(values));
+          message.reply(response);
+        }
+        else {
+          message.reply(result.first);
+        }
+      });
+    return;
+  }
+
+  /*
+    Read entity with a session token, given as "Authorization:
+    Bearer <token>". The entity read is the one named in the token,
+    so the path is only ReadEntitySession/DataTable.
+
+    If the request's If-None-Match is the entity's current ETag,
+    the reply is NotModified (304) with no body.
+   */
+  if (basic_routes.lookup(paths[0]) == basic_op::read_entity_session) {
+    session_claims claims {};
+    const status_code session_status {check_session(message, session_signer, false, claims)};
+    if (session_status != status_codes::OK) {
+      message.reply(session_status);
+      return;
+    }
+    if (paths.size() != 2 || paths.decoded(1) != session_table) {
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+    const http_headers& headers {message.headers()};
+    auto if_none_match (headers.find("If-None-Match"));
+    const string cached_etag {if_none_match == headers.end() ? string {} : if_none_match->second};
+    read_entity_async(table_cache.lookup_table(session_table), claims.partition, claims.row)
+      .then([message, cached_etag] (pair<status_code,table_entity> result)
+      {
+        if (result.first == status_codes::OK && ! cached_etag.empty() &&
+            result.second.etag() == cached_etag) {
+          http_response response {status_codes::NotModified};
+          response.headers().add("ETag", cached_etag);
+          message.reply(response);
+        }
+        else if (result.first == status_codes::OK) {
+          prop_vals_t values (get_properties(result.second.properties()));
+          http_response response {status_codes::OK};
+          response.headers().add("ETag", result.second.etag());
+          response.set_body(value::object(values));
+          message.reply(response);
+        }
+        else {
+          message.reply(result.first);
+        }
+      });
+    return;
+  }
+
+  /*
+    Scan one of several segments of a table, so that a reader can
+    scan all of them at once: ScanTableAdmin/table/segment/segments.
+    Segments divide partition keys by their first character, over
+    the printable ASCII range, so they are only as even as the keys
+    are spread over it. Entities are returned as by a whole-table
+    GET.
+   */
+  if (basic_routes.lookup(paths[0]) == basic_op::scan_table) {
+    if (paths.size() != 4) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    unsigned long segment {0};
+    unsigned long segments {0};
+    try {
+      segment = std::stoul(paths.decoded(2));
+      segments = std::stoul(paths.decoded(3));
+    }
+    catch (const std::exception&) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    if (segments == 0 || segments > 95 || segment >= segments) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    cloud_table table {table_cache.lookup_table(paths.decoded(1))};
+    if ( ! table.exists()) {
+      message.reply(status_codes::NotFound);
+      return;
+    }
+    const auto bound = [segments] (unsigned long s) {
+      return string(1, static_cast<char>(' ' + s * 95 / segments));
+    };
+    string filter {};
+    if (segment > 0)
+      filter = table_query::generate_filter_condition("PartitionKey",
+                 query_comparison_operator::greater_than_or_equal, bound(segment));
+    if (segment + 1 < segments) {
+      const string upper {table_query::generate_filter_condition("PartitionKey",
+                            query_comparison_operator::less_than, bound(segment + 1))};
+      filter = filter.empty() ? upper :
+        table_query::combine_filter_conditions(filter, query_logical_operator::op_and, upper);
+    }
+    table_query query {};
+    query.set_filter_string(filter);
+    table_query_iterator end;
+    vector<value> key_vec;
+    for (table_query_iterator it {table.execute_query(query)}; it != end; ++it) {
+      prop_vals_t keys {
+        make_pair("Partition",value::string(it->partition_key())),
+        make_pair("Row", value::string(it->row_key()))};
+      keys = get_properties(it->properties(), keys);
+      key_vec.push_back(value::object(keys));
+    }
+    message.reply(status_codes::OK, value::array(key_vec));
+    return;
+  }
+
   unordered_map<string,string> json_body {get_json_body (message)};
 
   // Need at least a table name
@@ -164,7 +380,7 @@ void handle_get(http_request message) {
     return;
   }
 
-  cloud_table table {table_cache.lookup_table(paths[1])};
+  cloud_table table {table_cache.lookup_table(paths.decoded(1))};
   if ( ! table.exists()) {
     message.reply(status_codes::NotFound);
     return;
@@ -220,13 +436,15 @@ void handle_get(http_request message) {
 
   //GET all entities from a specific partition
   //if (paths.size() == 3) {
-  if (paths[3].compare("*") == 0) {
+  const string partition {paths.decoded(2)};
+  const string row {paths.decoded(3)};
+  if (row == "*") {
     table_query query {};
     table_query_iterator end;
     table_query_iterator it = table.execute_query(query);
     vector<value> key_vec;
     while (it != end) {
-      if (it->partition_key().compare(paths[2]) == 0) {
+      if (it->partition_key() == partition) {
         cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
         prop_vals_t keys {
           make_pair("Partition",value::string(it->partition_key())),
@@ -242,8 +460,8 @@ void handle_get(http_request message) {
     
   
 
-  // GET specific entry: Partition == paths[1], Row == paths[2]
-  table_operation retrieve_operation {table_operation::retrieve_entity(paths[2], paths[3])};
+  // GET specific entry: Partition == paths[2], Row == paths[3]
+  table_operation retrieve_operation {table_operation::retrieve_entity(partition, row)};
   table_result retrieve_result {table.execute(retrieve_operation)};
   cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
   if (retrieve_result.http_status_code() == status_codes::NotFound) {
@@ -255,36 +473,6 @@ void handle_get(http_request message) {
   table_entity::properties_type properties {entity.properties()};
    
  
-    //GET Read Entity with Authentication
-    if (paths[0] == "ReadEntityAuth") {
-        
-        if(paths.size() < 4){       //checks if less than four parameters were provided
-            message.reply(status_codes::BadRequest);
-            return;
-        }
-        
-        else{
-            auto authentication = read_with_token(message,tables_endpoint); //returns status code and entity
-            if (authentication.first == status_codes::OK) { //if status code is ok, return the entity
-                
-                table_entity entity {authentication.second};
-                table_entity::properties_type properties {entity.properties()};
-                
-                message.reply(status_codes::OK);
-                return;
-            }
-            else{
-                message.reply(status_codes::NotFound); //if not, return NotFound
-            }
-        }
-        
-        
-    }
-    
-    
-    
-
-  
   // If the entity has any properties, return them as JSON
   prop_vals_t values (get_properties(properties));
   if (values.size() > 0)
@@ -299,20 +487,20 @@ void handle_get(http_request message) {
   Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
+  const string path {message.relative_uri().path()};
   cout << endl << "**** POST " << path << endl;
-  auto paths = uri::split_path(path);
+  const path_segments paths {path};
   // Need at least an operation and a table name
   if (paths.size() < 2) {
     message.reply(status_codes::BadRequest);
     return;
   }
 
-  string table_name {paths[1]};
+  string table_name {paths.decoded(1)};
   cloud_table table {table_cache.lookup_table(table_name)};
 
   // Create table (idempotent if table exists)
-  if (paths[0] == create_table) {
+  if (basic_routes.lookup(paths[0]) == basic_op::create_table) {
     cout << "Create " << table_name << endl;
     bool created {table.create_if_not_exists()};
     cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
@@ -330,87 +518,160 @@ void handle_post(http_request message) {
   Top-level routine for processing all HTTP PUT requests.
  */
 void handle_put(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
+  const string path {message.relative_uri().path()};
   cout << endl << "**** PUT " << path << endl;
-  auto paths = uri::split_path(path);
+  const path_segments paths {path};
+  const basic_op operation {basic_routes.lookup(paths[0])};
+
+  /*
+    Merge into the entity named by a session token, which must
+    grant update. As with UpdateEntityAuth, If-Match makes the write
+    conditional. A successful reply carries the entity's new ETag.
+   */
+  if (operation == basic_op::update_entity_session) {
+    session_claims claims {};
+    const status_code session_status {check_session(message, session_signer, true, claims)};
+    if (session_status != status_codes::OK) {
+      message.reply(session_status);
+      return;
+    }
+    if (paths.size() != 2 || paths.decoded(1) != session_table) {
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+    const http_headers& headers {message.headers()};
+    auto if_match (headers.find("If-Match"));
+    const string expected_etag {if_match == headers.end() ? string {} : if_match->second};
+    const cloud_table table {table_cache.lookup_table(session_table)};
+    get_json_body_async(message)
+      .then([table, claims, expected_etag] (unordered_map<string,string> props)
+      {
+        return write_entity_async(table, claims.partition, claims.row, props, expected_etag);
+      })
+      .then([message] (pair<status_code,string> result)
+      {
+        http_response response {result.first};
+        if ( ! result.second.empty())
+          response.headers().add("ETag", result.second);
+        message.reply(response);
+      });
+    return;
+  }
+
+  /*
+    Append to a property of several entities of one partition at
+    once: AppendEntitiesAdmin/table/partition/property, with a body
+    mapping each row to the text to append to it. The appends go in
+    entity-group transactions, so there may be at most
+    max_batch_size of them. The reply maps each row to the status
+    of its append, and the storage work completes in a task.
+   */
+  if (operation == basic_op::append_entities) {
+    unordered_map<string,string> appends {get_json_body(message)};
+    if (paths.size() != 4 || appends.empty() || appends.size() > max_batch_size) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    cloud_table table {table_cache.lookup_table(paths.decoded(1))};
+    if ( ! table.exists()) {
+      message.reply(status_codes::NotFound);
+      return;
+    }
+    const string partition {paths.decoded(2)};
+    const string property {paths.decoded(3)};
+    pplx::create_task([table, partition, property, appends] ()
+      {
+        return append_to_partition(table, partition, property, appends);
+      })
+      .then([message] (pplx::task<unordered_map<string,status_code>> t)
+      {
+        try {
+          value reply {value::object()};
+          for (const auto& r : t.get())
+            reply[r.first] = value::number(r.second);
+          message.reply(status_codes::OK, reply);
+        }
+        catch (const std::exception& e) {
+          cout << "AppendEntitiesAdmin failed: " << e.what() << endl;
+          message.reply(status_codes::InternalError);
+        }
+      });
+    return;
+  }
+
   // Need at least an operation, table name, partition, and row
   if (paths.size() < 4) {
     message.reply(status_codes::BadRequest);
     return;
   }
 
-  cloud_table table {table_cache.lookup_table(paths[1])};
+  /*
+    Update entity with authentication, replying in a continuation.
+    UpdateEntityAuth merges the properties, ReplaceEntityAuth replaces
+    the entity. If the request carries If-Match, the write fails with
+    PreconditionFailed (412) if the entity's ETag has changed.
+   */
+  if (operation == basic_op::update_entity_auth || operation == basic_op::replace_entity_auth) {
+    const http_headers& headers {message.headers()};
+    auto if_match (headers.find("If-Match"));
+    const string expected_etag {if_match == headers.end() ? string {} : if_match->second};
+    const bool replace {operation == basic_op::replace_entity_auth};
+    get_json_body_async(message)
+      .then([message, expected_etag, replace] (unordered_map<string,string> props)
+      {
+        return update_with_token_async(message, tables_endpoint, props, expected_etag, replace);
+      })
+      .then([message] (status_code status)
+      {
+        message.reply(status);
+      });
+    return;
+  }
+
+  cloud_table table {table_cache.lookup_table(paths.decoded(1))};
   if ( ! table.exists()) {
     message.reply(status_codes::NotFound);
     return;
   }
 
-  table_entity entity {paths[2], paths[3]};
+  table_entity entity {paths.decoded(2), paths.decoded(3)};
 
   // Update entity
-  if (paths[0] == update_entity) {
+  if (operation == basic_op::update_entity) {
     cout << "Update " << entity.partition_key() << " / " << entity.row_key() << endl;
     table_entity::properties_type& properties = entity.properties();
     for (const auto v : get_json_body(message)) {
       properties[v.first] = entity_property {v.second};
     }
 
-    table_operation operation {table_operation::insert_or_merge_entity(entity)};
-    table_result op_result {table.execute(operation)};
+    table_operation table_op {table_operation::insert_or_merge_entity(entity)};
+    table_result op_result {table.execute(table_op)};
     message.reply(status_codes::OK);
   }
   else {
     message.reply(status_codes::BadRequest);
   }
-    
-   
-    //Update Entity with Authentication
-    if (paths[0] == "UpdateEntityAuth") {
-        
-        if (paths.size() < 4){  //checks if message is valid
-            message.reply(status_codes::BadRequest);
-            return;
-        }
-        
-        auto properties = get_json_body(message); //retrieves JSON body in the message
-        auto updating = update_with_token(message, tables_endpoint, properties); //updates entity
-        
-        if (updating == status_codes::OK) { //returns OK if successful
-            message.reply(status_codes::OK);
-            return;
-        }
-        
-        else if (updating == status_codes::BadRequest){
-            message.reply(status_codes::BadRequest);
-            return;
-        }
-        
-        else if (updating == status_codes::Forbidden){
-            message.reply(status_codes::Forbidden);
-            return;
-        }
-    }
-    
 }
 
 /*
   Top-level routine for processing all HTTP DELETE requests.
  */
 void handle_delete(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
+  const string path {message.relative_uri().path()};
   cout << endl << "**** DELETE " << path << endl;
-  auto paths = uri::split_path(path);
+  const path_segments paths {path};
   // Need at least an operation and table name
   if (paths.size() < 2) {
   message.reply(status_codes::BadRequest);
   return;
   }
 
-  string table_name {paths[1]};
+  string table_name {paths.decoded(1)};
+  const basic_op operation {basic_routes.lookup(paths[0])};
   cloud_table table {table_cache.lookup_table(table_name)};
 
   // Delete table
-  if (paths[0] == delete_table) {
+  if (operation == basic_op::delete_table) {
     cout << "Delete " << table_name << endl;
     if ( ! table.exists()) {
       message.reply(status_codes::NotFound);
@@ -420,17 +681,17 @@ void handle_delete(http_request message) {
     message.reply(status_codes::OK);
   }
   // Delete entity
-  else if (paths[0] == delete_entity) {
+  else if (operation == basic_op::delete_entity) {
     // For delete entity, also need partition and row
     if (paths.size() < 4) {
   message.reply(status_codes::BadRequest);
   return;
     }
-    table_entity entity {paths[2], paths[3]};
+    table_entity entity {paths.decoded(2), paths.decoded(3)};
     cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
 
-    table_operation operation {table_operation::delete_entity(entity)};
-    table_result op_result {table.execute(operation)};
+    table_operation table_op {table_operation::delete_entity(entity)};
+    table_result op_result {table.execute(table_op)};
 
     int code {op_result.http_status_code()};
     if (code == status_codes::OK || 
@@ -456,6 +717,10 @@ int main (int argc, char const * argv[]) {
   cout << "Parsing connection string" << endl;
   table_cache.init (storage_connection_string);
 
+  // Co-located servers may call this one over BASIC_RPC_SOCKET
+  std::unique_ptr<LocalRpcServer> rpc_server {open_local_rpc("BASIC_RPC_SOCKET",
+    http_rpc_handler(&handle_get, &handle_post, &handle_put, &handle_delete))};
+
   cout << "Opening listener" << endl;
 
   http_listener listener {def_url};
@@ -465,11 +730,20 @@ int main (int argc, char const * argv[]) {
   listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
 
+#ifdef ALL_IN_ONE
+  wait_for_stop();
+#else
   cout << "Enter carriage return to stop server." << endl;
   string line;
   getline(std::cin, line);
+#endif
 
   // Shut it down
   listener.close().wait();
+  rpc_server.reset();
   cout << "Closed" << endl;
 }
+
+#ifdef ALL_IN_ONE
+} // namespace basic_server
+#endif
@@ -0,0 +1,29 @@
+#include "CredentialCache.h"
+
+#include <string>
+
+using std::string;
+
+/*
+  Copy the cached credentials of userid into creds
+
+  Returns false, counting a miss, if userid is not cached or its
+  entry has expired.
+ */
+bool CredentialCache::lookup (const string& userid, user_credentials& creds) {
+  if ( ! entries.find(userid, creds)) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  return true;
+}
+
+void CredentialCache::insert (const string& userid, const user_credentials& creds) {
+  entries.insert(userid, creds, ttl);
+}
+
+bool CredentialCache::invalidate (const string& userid) {
+  ++invalidations;
+  return entries.erase(userid);
+}
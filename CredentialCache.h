@@ -0,0 +1,57 @@
+#ifndef CredentialCache_h
+#define CredentialCache_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+#include "ShardedTtlCache.h"
+
+/*
+  Password and data coordinates of one user, as stored in AuthTable
+ */
+struct user_credentials {
+  std::string password;
+  std::string data_partition;
+  std::string data_row;
+};
+
+/*
+  Cache of AuthTable credentials, keyed by userid
+
+  Entries expire ttl after they are inserted, bounding how long a
+  password change made directly in AuthTable goes unnoticed;
+  invalidate() drops an entry immediately. The map is a
+  ShardedTtlCache, so that concurrent sign-ons for different users
+  rarely contend.
+ */
+class CredentialCache {
+private:
+  ShardedTtlCache<std::string,user_credentials> entries;
+  std::chrono::seconds ttl;
+  std::atomic<unsigned long> hits;
+  std::atomic<unsigned long> misses;
+  std::atomic<unsigned long> invalidations;
+
+public:
+  CredentialCache (std::chrono::seconds time_to_live, std::size_t max_entries) :
+    entries {max_entries},
+    ttl {time_to_live},
+    hits {0},
+    misses {0},
+    invalidations {0}
+    {};
+
+
+  bool lookup (const std::string& userid, user_credentials& creds);
+  void insert (const std::string& userid, const user_credentials& creds);
+  bool invalidate (const std::string& userid);
+
+  unsigned long hit_count () const { return hits; }
+  unsigned long miss_count () const { return misses; }
+  unsigned long invalidation_count () const { return invalidations; }
+  std::size_t size () { return entries.size(); }
+};
+
+#endif
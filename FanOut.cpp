@@ -0,0 +1,29 @@
+#include "FanOut.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using std::function;
+using std::size_t;
+using std::vector;
+
+void fan_out (size_t count, size_t limit, const function<void (size_t i)>& work) {
+  std::atomic<size_t> next {0};
+  const auto worker = [&next, count, &work] () {
+    for (size_t i {next++}; i < count; i = next++)
+      work(i);
+  };
+
+  const size_t workers {std::min(count, std::max<size_t>(limit, 1))};
+  vector<std::thread> helpers {};
+  helpers.reserve (workers > 0 ? workers - 1 : 0);
+  for (size_t w {1}; w < workers; ++w)
+    helpers.emplace_back (worker);
+  worker();
+  for (std::thread& h : helpers)
+    h.join();
+}
@@ -0,0 +1,22 @@
+#ifndef FanOut_h
+#define FanOut_h
+
+#include <cstddef>
+#include <functional>
+
+/*
+  Call work(i) for each i in [0, count), at most limit calls at once
+
+  The calling thread is one of the limit workers, and the others are
+  started for the call and joined before it returns, so a fan-out of
+  blocking requests takes about count / limit round trips instead of
+  count. Workers take the next index as they finish one, so a slow
+  recipient holds up only its own worker.
+
+  work must not throw, and must be safe to call from several threads
+  at once for different i.
+ */
+void fan_out (std::size_t count, std::size_t limit,
+              const std::function<void (std::size_t i)>& work);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef Fnv1a_h
+#define Fnv1a_h
+
+#include <cstdint>
+#include <string>
+
+/*
+  64-bit FNV-1a hash of s
+
+  Unlike std::hash, it is the same in every build and on every
+  host, and is unrelated to the hash an unordered_map uses, so it
+  can name data shared between servers and index structures kept
+  alongside a map.
+ */
+inline std::uint64_t fnv1a64 (const std::string& s) {
+  std::uint64_t h {14695981039346656037ull};
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+#endif
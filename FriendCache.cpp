@@ -0,0 +1,63 @@
+#include "FriendCache.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "Fnv1a.h"
+
+using std::string;
+using std::uint64_t;
+
+namespace {
+  /*
+    "version-hash", with a 64-bit FNV-1a hash, which unlike
+    std::hash is the same in every build
+   */
+  string list_etag (uint64_t version, const string& serialized) {
+    uint64_t hash {fnv1a64(serialized)};
+    static const char digits[] {"0123456789abcdef"};
+    string hex (16, '0');
+    for (int i {15}; i >= 0; --i, hash >>= 4)
+      hex[i] = digits[hash & 0xf];
+    return "\"" + std::to_string(version) + "-" + hex + "\"";
+  }
+}
+
+friend_snapshot_ptr FriendCache::lookup (const string& userid, bool& fresh) {
+  friend_snapshot_ptr snapshot {};
+  fresh = false;
+  if ( ! entries.find_any(userid, snapshot, fresh)) {
+    ++misses;
+    return friend_snapshot_ptr {};
+  }
+  if (fresh)
+    ++fresh_hits;
+  else
+    ++stale_hits;
+  return snapshot;
+}
+
+/*
+  The list is serialized here, outside the lock, once per change,
+  so that readers are served the string as is.
+ */
+friend_snapshot_ptr FriendCache::store (const string& userid, FriendSet friends, const string& etag) {
+  const string serialized {friends.serialize()};
+  const string list_tag {list_etag(friends.version(), serialized)};
+  friend_snapshot_ptr snapshot {std::make_shared<const friend_snapshot>(
+      friend_snapshot {std::move(friends), serialized, etag, list_tag})};
+  entries.insert(userid, snapshot, fresh_for);
+  return snapshot;
+}
+
+void FriendCache::confirm (const string& userid, const string& etag) {
+  entries.renew(userid, fresh_for, [&etag] (const friend_snapshot_ptr& snapshot) {
+    return snapshot->etag == etag;
+  });
+}
+
+void FriendCache::drop (const string& userid) {
+  entries.erase(userid);
+}
@@ -0,0 +1,73 @@
+#ifndef FriendCache_h
+#define FriendCache_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "FriendSet.h"
+#include "ShardedTtlCache.h"
+
+/*
+  A user's friend list as last read or written, with the ETag of
+  the DataTable entity it came from. Snapshots are immutable and
+  shared, so a lookup copies only a pointer.
+
+  list_etag identifies the list itself, by its version and a hash
+  of its serialized form, for clients of ReadFriendList. It changes
+  only when the list does, unlike etag, which changes with any
+  property of the entity, and it is the same whichever UserServer
+  computes it.
+ */
+struct friend_snapshot {
+  FriendSet friends;
+  std::string serialized;
+  std::string etag;
+  std::string list_etag;
+};
+
+using friend_snapshot_ptr = std::shared_ptr<const friend_snapshot>;
+
+/*
+  Friend lists of signed-on users, keyed by userid
+
+  An entry is fresh for fresh_for after it was last read, written,
+  or confirmed by storage; a fresh entry is used without asking
+  storage at all. A stale entry is revalidated by its ETag, and
+  confirmed with confirm() if it still matches. A ShardedTtlCache,
+  like CredentialCache, with at most max_entries users.
+ */
+class FriendCache {
+private:
+  // An entry expires when it needs revalidation, but is still held
+  ShardedTtlCache<std::string,friend_snapshot_ptr> entries;
+  std::chrono::milliseconds fresh_for;
+  std::atomic<unsigned long> fresh_hits;
+  std::atomic<unsigned long> stale_hits;
+  std::atomic<unsigned long> misses;
+
+public:
+  FriendCache (std::chrono::milliseconds fresh_time, std::size_t max_entries) :
+    entries {max_entries},
+    fresh_for {fresh_time},
+    fresh_hits {0},
+    stale_hits {0},
+    misses {0}
+    {};
+
+  // Null if userid has no entry; fresh is set if it needs no revalidation
+  friend_snapshot_ptr lookup (const std::string& userid, bool& fresh);
+  friend_snapshot_ptr store (const std::string& userid, FriendSet friends, const std::string& etag);
+  // Mark the entry of userid as just confirmed, if it still has etag
+  void confirm (const std::string& userid, const std::string& etag);
+  void drop (const std::string& userid);
+
+  unsigned long fresh_hit_count () const { return fresh_hits; }
+  unsigned long stale_hit_count () const { return stale_hits; }
+  unsigned long miss_count () const { return misses; }
+  std::size_t size () { return entries.size(); }
+};
+
+#endif
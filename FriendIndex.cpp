@@ -0,0 +1,214 @@
+#include "FriendIndex.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using std::lock_guard;
+using std::pair;
+using std::size_t;
+using std::vector;
+
+using node = FriendIndex::node;
+using node_list = FriendIndex::node_list;
+
+namespace {
+  // Gallop when the longer list is this many times the shorter
+  constexpr size_t gallop_ratio {32};
+
+  /*
+    First position at or after from in list whose node is not less
+    than x, probing 1, 2, 4, ... ahead before a binary search
+   */
+  size_t gallop (const node_list& list, size_t from, node x) {
+    size_t step {1};
+    size_t hi {from};
+    while (hi < list.size() && list[hi] < x) {
+      from = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    hi = std::min(hi, list.size());
+    return static_cast<size_t>(std::lower_bound(list.begin() + from, list.begin() + hi, x) - list.begin());
+  }
+}
+
+void intersect_sorted (const node_list& a, const node_list& b, node_list& out) {
+  const node_list& shorter (a.size() <= b.size() ? a : b);
+  const node_list& longer (a.size() <= b.size() ? b : a);
+  if (shorter.empty())
+    return;
+
+  if (shorter.size() * gallop_ratio < longer.size()) {
+    size_t j {0};
+    for (node x : shorter) {
+      j = gallop(longer, j, x);
+      if (j == longer.size())
+        return;
+      if (longer[j] == x)
+        out.push_back (x);
+    }
+    return;
+  }
+
+  // Each step writes a candidate and keeps it only if both lists have
+  // it, so the loop has no branch for the compiler to mispredict
+  size_t k {out.size()};
+  out.resize (k + shorter.size());
+  size_t i {0};
+  size_t j {0};
+  while (i < shorter.size() && j < longer.size()) {
+    const node x {shorter[i]};
+    const node y {longer[j]};
+    out[k] = x;
+    k += x == y;
+    i += x <= y;
+    j += y <= x;
+  }
+  out.resize (k);
+}
+
+/*
+  Called with lock held
+ */
+node FriendIndex::number_of (const friend_id& f) {
+  auto found (numbers.find(f));
+  if (found != numbers.end())
+    return found->second;
+  const node n {static_cast<node>(names.size())};
+  numbers.emplace (f, n);
+  names.push_back (f);
+  friends.push_back (node_list_ptr {});
+  updated.push_back (false);
+  return n;
+}
+
+/*
+  Called with lock held
+ */
+FriendIndex::node_list_ptr FriendIndex::numbered (const FriendSet& list) {
+  const vector<friend_id> members {list.sorted()};
+  std::shared_ptr<node_list> result {std::make_shared<node_list>()};
+  result->reserve (members.size());
+  for (const friend_id& f : members)
+    result->push_back (number_of(f));
+  std::sort (result->begin(), result->end());
+  return result;
+}
+
+FriendIndex::node_list_ptr FriendIndex::friends_of (const friend_id& user) const {
+  auto found (numbers.find(user));
+  return found == numbers.end() ? node_list_ptr {} : friends[found->second];
+}
+
+void FriendIndex::set (const friend_id& user, const FriendSet& list) {
+  lock_guard<std::mutex> guard {lock};
+  const node n {number_of(user)};
+  // Numbering the list may grow friends, so it is done first
+  node_list_ptr list_nodes {numbered(list)};
+  friends[n] = std::move(list_nodes);
+  updated[n] = true;
+  ++updates;
+}
+
+void FriendIndex::load (const friend_id& user, const FriendSet& list) {
+  lock_guard<std::mutex> guard {lock};
+  const node n {number_of(user)};
+  if ( ! updated[n]) {
+    node_list_ptr list_nodes {numbered(list)};
+    friends[n] = std::move(list_nodes);
+  }
+}
+
+vector<friend_id> FriendIndex::mutual (const friend_id& a, const friend_id& b) const {
+  ++queries;
+  node_list_ptr a_friends {};
+  node_list_ptr b_friends {};
+  {
+    lock_guard<std::mutex> guard {lock};
+    a_friends = friends_of(a);
+    b_friends = friends_of(b);
+  }
+  if ( ! a_friends || ! b_friends)
+    return vector<friend_id> {};
+
+  node_list both {};
+  intersect_sorted (*a_friends, *b_friends, both);
+  vector<friend_id> result {};
+  result.reserve (both.size());
+  {
+    lock_guard<std::mutex> guard {lock};
+    for (node n : both)
+      result.push_back (names[n]);
+  }
+  std::sort (result.begin(), result.end());
+  return result;
+}
+
+vector<pair<friend_id,size_t>> FriendIndex::suggest (const friend_id& user, size_t limit) const {
+  ++queries;
+  node self {0};
+  node_list_ptr direct {};
+  vector<node_list_ptr> second {};
+  {
+    lock_guard<std::mutex> guard {lock};
+    auto found (numbers.find(user));
+    if (found == numbers.end())
+      return vector<pair<friend_id,size_t>> {};
+    self = found->second;
+    direct = friends[self];
+    if ( ! direct)
+      return vector<pair<friend_id,size_t>> {};
+    second.reserve (direct->size());
+    for (node f : *direct) {
+      if (friends[f])
+        second.push_back (friends[f]);
+    }
+  }
+
+  // Every friend of a friend, once per friend it is reached through
+  size_t total {0};
+  for (const node_list_ptr& list : second)
+    total += list->size();
+  node_list reached {};
+  reached.reserve (total);
+  for (const node_list_ptr& list : second)
+    reached.insert (reached.end(), list->begin(), list->end());
+  std::sort (reached.begin(), reached.end());
+
+  vector<pair<node,size_t>> counts {};
+  for (size_t i {0}; i < reached.size(); ) {
+    size_t j {i + 1};
+    while (j < reached.size() && reached[j] == reached[i])
+      ++j;
+    if (reached[i] != self && ! std::binary_search(direct->begin(), direct->end(), reached[i]))
+      counts.emplace_back (reached[i], j - i);
+    i = j;
+  }
+
+  vector<pair<friend_id,size_t>> result {};
+  result.reserve (counts.size());
+  {
+    lock_guard<std::mutex> guard {lock};
+    for (const pair<node,size_t>& c : counts)
+      result.emplace_back (names[c.first], c.second);
+  }
+  const auto ranked = [] (const pair<friend_id,size_t>& x, const pair<friend_id,size_t>& y) {
+    return x.second > y.second || (x.second == y.second && x.first < y.first);
+  };
+  if (result.size() > limit) {
+    std::partial_sort (result.begin(), result.begin() + limit, result.end(), ranked);
+    result.resize (limit);
+  }
+  else {
+    std::sort (result.begin(), result.end(), ranked);
+  }
+  return result;
+}
+
+size_t FriendIndex::node_count () const {
+  lock_guard<std::mutex> guard {lock};
+  return names.size();
+}
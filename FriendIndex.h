@@ -0,0 +1,103 @@
+#ifndef FriendIndex_h
+#define FriendIndex_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FriendSet.h"
+
+/*
+  Adjacency index of every user's friend list, for mutual-friend
+  and friend-of-friend queries
+
+  Each user, named as in DataTable by partition and row, and each
+  friend, named by country and name, is a node with a dense number.
+  A node's friends are a sorted vector of node numbers, so mutual
+  friends are the intersection of two vectors, and friends of
+  friends are the merged vectors of a user's friends.
+
+  Friend vectors are immutable and shared: a query takes the vectors
+  it needs under the lock and works on them after releasing it, and
+  an update swaps in a new vector. Lists are directed, as AddFriend
+  is: b being a's friend says nothing of a being b's.
+
+  The index is filled from a scan of DataTable with load(), and kept
+  current with set() as lists are written. A list set while the scan
+  is in progress is newer than the scan, so load() leaves it alone.
+ */
+class FriendIndex {
+public:
+  using node = std::uint32_t;
+  using node_list = std::vector<node>;
+
+private:
+  using node_list_ptr = std::shared_ptr<const node_list>;
+
+  std::unordered_map<friend_id,node,friend_id_hash> numbers;
+  std::vector<friend_id> names;
+  std::vector<node_list_ptr> friends;
+  // Set by set(), so load() does not replace a newer list
+  std::vector<bool> updated;
+  mutable std::mutex lock;
+  std::atomic<bool> complete;
+
+  mutable std::atomic<unsigned long> queries;
+  std::atomic<unsigned long> updates;
+
+  node number_of (const friend_id& f);
+  node_list_ptr numbered (const FriendSet& list);
+  node_list_ptr friends_of (const friend_id& user) const;
+
+public:
+  FriendIndex () :
+    numbers {},
+    names {},
+    friends {},
+    updated {},
+    lock {},
+    complete {false},
+    queries {0},
+    updates {0}
+    {}
+
+  FriendIndex (const FriendIndex&) = delete;
+  FriendIndex& operator= (const FriendIndex&) = delete;
+
+  // The list of user as just written
+  void set (const friend_id& user, const FriendSet& list);
+  // The list of user as read by the scan
+  void load (const friend_id& user, const FriendSet& list);
+  // The scan has finished; queries are answered from now on
+  void mark_complete () { complete = true; }
+  bool is_complete () const { return complete; }
+
+  // Friends of both a and b, sorted
+  std::vector<friend_id> mutual (const friend_id& a, const friend_id& b) const;
+  /*
+    Up to limit friends of user's friends who are not user or user's
+    friends, with the number of user's friends each is a friend of,
+    most first
+   */
+  std::vector<std::pair<friend_id,std::size_t>> suggest (const friend_id& user,
+                                                         std::size_t limit) const;
+
+  std::size_t node_count () const;
+  unsigned long query_count () const { return queries; }
+  unsigned long update_count () const { return updates; }
+};
+
+/*
+  Intersection of two sorted node lists, appended to out. Gallops
+  through the longer list when one is much shorter than the other,
+  and otherwise merges without data-dependent branches.
+ */
+void intersect_sorted (const FriendIndex::node_list& a, const FriendIndex::node_list& b,
+                       FriendIndex::node_list& out);
+
+#endif
@@ -0,0 +1,191 @@
+#include "FriendSet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+namespace {
+  /*
+    Split a serialized list into its items, skipping empty ones
+   */
+  vector<string> split_items (const string& text) {
+    vector<string> result {};
+    size_t start {0};
+    while (start < text.size()) {
+      size_t end {text.find('|', start)};
+      if (end == string::npos)
+        end = text.size();
+      if (end > start)
+        result.push_back (text.substr(start, end - start));
+      start = end + 1;
+    }
+    return result;
+  }
+
+  bool to_friend_id (const string& item, friend_id& f) {
+    const size_t semi {item.find(';')};
+    if (semi == string::npos || semi == 0 || semi + 1 == item.size())
+      return false;
+    f = friend_id {item.substr(0, semi), item.substr(semi + 1)};
+    return true;
+  }
+}
+
+const char* outcome_name (friend_outcome outcome) {
+  switch (outcome) {
+  case friend_outcome::added: return "Added";
+  case friend_outcome::already_friend: return "AlreadyFriend";
+  case friend_outcome::removed: return "Removed";
+  case friend_outcome::not_friend: return "NotFriend";
+  case friend_outcome::invalid: return "Invalid";
+  case friend_outcome::conflict: return "Conflict";
+  }
+  return "Invalid";
+}
+
+/*
+  Entries without a ';' are not friends and are skipped
+ */
+FriendSet FriendSet::parse (const string& text, uint64_t version) {
+  FriendSet result {};
+  result.changes = version;
+  size_t start {0};
+  while (start < text.size()) {
+    size_t end {text.find('|', start)};
+    if (end == string::npos)
+      end = text.size();
+    const size_t semi {text.find(';', start)};
+    if (semi < end)
+      result.members.insert (friend_id {text.substr(start, semi - start),
+                                        text.substr(semi + 1, end - semi - 1)});
+    start = end + 1;
+  }
+  return result;
+}
+
+bool FriendSet::add (const friend_id& f) {
+  if ( ! members.insert(f).second)
+    return false;
+  ++changes;
+  return true;
+}
+
+bool FriendSet::remove (const friend_id& f) {
+  if (members.erase(f) == 0)
+    return false;
+  ++changes;
+  return true;
+}
+
+vector<friend_id> FriendSet::sorted () const {
+  vector<friend_id> result (members.begin(), members.end());
+  std::sort (result.begin(), result.end());
+  return result;
+}
+
+string FriendSet::serialize () const {
+  const vector<friend_id> ordered {sorted()};
+  size_t length {0};
+  for (const friend_id& f : ordered)
+    length += f.country.size() + f.name.size() + 2;
+
+  string result {};
+  result.reserve (length);
+  for (const friend_id& f : ordered) {
+    if ( ! result.empty())
+      result.push_back ('|');
+    result += f.country;
+    result.push_back (';');
+    result += f.name;
+  }
+  return result;
+}
+
+bool FriendSet::apply (const string& adds, const string& removes,
+                       vector<friend_change>& results) {
+  const vector<string> add_items {split_items(adds)};
+  const vector<string> remove_items {split_items(removes)};
+  std::unordered_set<friend_id,friend_id_hash> to_add {};
+  std::unordered_set<friend_id,friend_id_hash> to_remove {};
+  friend_id f {};
+  for (const string& item : add_items) {
+    if (to_friend_id(item, f))
+      to_add.insert (f);
+  }
+  for (const string& item : remove_items) {
+    if (to_friend_id(item, f))
+      to_remove.insert (f);
+  }
+
+  // A friend repeated in a list gets the outcome of its first item
+  std::unordered_map<friend_id,friend_outcome,friend_id_hash> first {};
+  results.clear();
+  results.reserve (add_items.size() + remove_items.size());
+  bool changed {false};
+  for (const string& item : add_items) {
+    friend_outcome outcome {friend_outcome::invalid};
+    if (to_friend_id(item, f)) {
+      auto seen (first.find(f));
+      if (seen != first.end())
+        outcome = seen->second;
+      else if (to_remove.count(f) == 1)
+        outcome = friend_outcome::conflict;
+      else if (add(f))
+        outcome = friend_outcome::added;
+      else
+        outcome = friend_outcome::already_friend;
+      first.emplace (f, outcome);
+    }
+    changed = changed || outcome == friend_outcome::added;
+    results.push_back (friend_change {true, item, outcome});
+  }
+  first.clear();
+  for (const string& item : remove_items) {
+    friend_outcome outcome {friend_outcome::invalid};
+    if (to_friend_id(item, f)) {
+      auto seen (first.find(f));
+      if (seen != first.end())
+        outcome = seen->second;
+      else if (to_add.count(f) == 1)
+        outcome = friend_outcome::conflict;
+      else if (remove(f))
+        outcome = friend_outcome::removed;
+      else
+        outcome = friend_outcome::not_friend;
+      first.emplace (f, outcome);
+    }
+    changed = changed || outcome == friend_outcome::removed;
+    results.push_back (friend_change {false, item, outcome});
+  }
+  return changed;
+}
+
+string FriendSet::page (const string& serialized, size_t offset, size_t limit, size_t& total) {
+  total = 0;
+  size_t begin {serialized.size()};
+  size_t end {serialized.size()};
+  size_t start {0};
+  while (start < serialized.size()) {
+    size_t next {serialized.find('|', start)};
+    if (next == string::npos)
+      next = serialized.size();
+    if (total == offset)
+      begin = start;
+    if (total >= offset && total - offset + 1 == limit)
+      end = next;
+    ++total;
+    start = next + 1;
+  }
+  if (limit == 0 || offset >= total)
+    return string {};
+  return serialized.substr(begin, end - begin);
+}
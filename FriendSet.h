@@ -0,0 +1,101 @@
+#ifndef FriendSet_h
+#define FriendSet_h
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+  One friend, identified as in DataTable by country and name
+ */
+struct friend_id {
+  std::string country;
+  std::string name;
+
+  bool operator== (const friend_id& other) const {
+    return country == other.country && name == other.name;
+  }
+  bool operator< (const friend_id& other) const {
+    return country < other.country || (country == other.country && name < other.name);
+  }
+};
+
+struct friend_id_hash {
+  std::size_t operator() (const friend_id& f) const {
+    const std::size_t h {std::hash<std::string> {}(f.country)};
+    return h ^ (std::hash<std::string> {}(f.name) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+  }
+};
+
+/*
+  What a bulk change did with one of its items
+ */
+enum class friend_outcome { added, already_friend, removed, not_friend, invalid, conflict };
+
+struct friend_change {
+  bool add;
+  // The item as given, "country;name"
+  std::string item;
+  friend_outcome outcome;
+};
+
+const char* outcome_name (friend_outcome outcome);
+
+/*
+  A user's friends, as a hash set with a version number
+
+  Membership, add, and remove are O(1). The version counts the
+  changes ever made to the list and is stored beside it, in the
+  FriendsVersion property, so readers can tell lists apart without
+  comparing them.
+
+  The serialized form is the one DataTable has always held in the
+  Friends property, "country;name|country;name|...", sorted so that
+  equal sets always serialize to the same string. Duplicate entries
+  in a stored list collapse into one on parsing.
+ */
+class FriendSet {
+private:
+  std::unordered_set<friend_id,friend_id_hash> members;
+  std::uint64_t changes;
+
+public:
+  FriendSet () : members {}, changes {0} {}
+
+  static FriendSet parse (const std::string& text, std::uint64_t version = 0);
+
+  bool contains (const friend_id& f) const { return members.count(f) == 1; }
+  // Each returns false, leaving the version alone, if nothing changed
+  bool add (const friend_id& f);
+  bool remove (const friend_id& f);
+  /*
+    Add the friends listed in adds and remove those in removes, both
+    in the serialized form, recording the outcome of each item in
+    results. An item without a country and a name is invalid, and
+    one in both lists is a conflict; neither is applied. A friend
+    listed twice in one list gets the outcome of the first listing
+    both times. Returns true if the set changed.
+   */
+  bool apply (const std::string& adds, const std::string& removes,
+              std::vector<friend_change>& results);
+
+  std::size_t size () const { return members.size(); }
+  std::uint64_t version () const { return changes; }
+
+  std::vector<friend_id> sorted () const;
+  std::string serialize () const;
+
+  /*
+    Entries offset to offset + limit - 1 of a serialized list, in
+    serialized form, without parsing it; total is set to the number
+    of entries in the list
+   */
+  static std::string page (const std::string& serialized, std::size_t offset,
+                           std::size_t limit, std::size_t& total);
+};
+
+#endif
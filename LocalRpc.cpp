@@ -0,0 +1,361 @@
+#include "LocalRpc.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::uint16_t;
+using std::uint32_t;
+using std::unique_lock;
+
+namespace {
+  // Larger frames are refused rather than allocated
+  constexpr uint32_t max_frame {64u << 20};
+
+  void put_u32 (string& out, uint32_t v) {
+    out.append (reinterpret_cast<const char*>(&v), sizeof v);
+  }
+
+  void put_string (string& out, const string& s) {
+    put_u32 (out, static_cast<uint32_t>(s.size()));
+    out += s;
+  }
+
+  void put_headers (string& out, const rpc_headers& headers) {
+    put_u32 (out, static_cast<uint32_t>(headers.size()));
+    for (const auto& h : headers) {
+      put_string (out, h.first);
+      put_string (out, h.second);
+    }
+  }
+
+  /*
+    Reads fields from a payload, failing once it runs past the end
+   */
+  class reader {
+  private:
+    const string& in;
+    size_t at;
+  public:
+    explicit reader (const string& payload) : in {payload}, at {0} {}
+
+    bool get (void* out, size_t size) {
+      if (in.size() - at < size)
+        return false;
+      std::memcpy (out, in.data() + at, size);
+      at += size;
+      return true;
+    }
+    bool get_u32 (uint32_t& v) { return get (&v, sizeof v); }
+    bool get_string (string& s) {
+      uint32_t size {0};
+      if ( ! get_u32(size) || in.size() - at < size)
+        return false;
+      s.assign (in, at, size);
+      at += size;
+      return true;
+    }
+    bool get_headers (rpc_headers& headers) {
+      uint32_t count {0};
+      if ( ! get_u32(count))
+        return false;
+      headers.clear();
+      for (uint32_t i {0}; i < count; ++i) {
+        string name {};
+        string value {};
+        if ( ! get_string(name) || ! get_string(value))
+          return false;
+        headers.emplace_back (std::move(name), std::move(value));
+      }
+      return true;
+    }
+    bool done () const { return at == in.size(); }
+  };
+
+  bool write_all (int fd, const char* p, size_t left) {
+    while (left > 0) {
+      const ssize_t n {::send(fd, p, left, MSG_NOSIGNAL)};
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      left -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  bool read_all (int fd, char* p, size_t left) {
+    while (left > 0) {
+      const ssize_t n {::read(fd, p, left)};
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      left -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  // The frame header is written with the payload, in one send
+  string frame (const string& payload) {
+    string out {};
+    out.reserve (sizeof(uint32_t) + payload.size());
+    put_u32 (out, static_cast<uint32_t>(payload.size()));
+    out += payload;
+    return out;
+  }
+
+  bool read_frame (int fd, string& payload) {
+    uint32_t size {0};
+    if ( ! read_all(fd, reinterpret_cast<char*>(&size), sizeof size) || size > max_frame)
+      return false;
+    payload.resize (size);
+    return size == 0 || read_all(fd, &payload[0], size);
+  }
+
+  sockaddr_un socket_address (const string& path) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof address.sun_path)
+      throw std::runtime_error {"Unix socket path too long: " + path};
+    std::memcpy (address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+  }
+}
+
+string encode_rpc_request (const rpc_request& request) {
+  string out {};
+  out.reserve (request.method.size() + request.path.size() + request.body.size() + 64);
+  put_string (out, request.method);
+  put_string (out, request.path);
+  put_headers (out, request.headers);
+  put_string (out, request.body);
+  return out;
+}
+
+bool decode_rpc_request (const string& payload, rpc_request& request) {
+  reader in {payload};
+  return in.get_string(request.method) && in.get_string(request.path) &&
+    in.get_headers(request.headers) && in.get_string(request.body) && in.done();
+}
+
+string encode_rpc_response (const rpc_response& response) {
+  string out {};
+  out.reserve (response.body.size() + 64);
+  out.append (reinterpret_cast<const char*>(&response.status), sizeof response.status);
+  put_headers (out, response.headers);
+  put_string (out, response.body);
+  return out;
+}
+
+bool decode_rpc_response (const string& payload, rpc_response& response) {
+  reader in {payload};
+  return in.get(&response.status, sizeof response.status) &&
+    in.get_headers(response.headers) && in.get_string(response.body) && in.done();
+}
+
+/*
+  Any stale socket file left by an earlier run is removed first
+ */
+LocalRpcServer::LocalRpcServer (const string& socket_path, rpc_handler handle) :
+  path {socket_path},
+  handler {std::move(handle)},
+  listen_fd {-1},
+  acceptor {},
+  connection_fds {},
+  lock {},
+  ended {},
+  closing {false}
+{
+  const sockaddr_un address {socket_address(path)};
+  listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    throw std::runtime_error {"Cannot create Unix socket " + path};
+  ::unlink (path.c_str());
+  if (::bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof address) != 0 ||
+      ::listen(listen_fd, SOMAXCONN) != 0) {
+    ::close (listen_fd);
+    throw std::runtime_error {"Cannot listen on Unix socket " + path};
+  }
+  acceptor = std::thread {&LocalRpcServer::accept_loop, this};
+}
+
+LocalRpcServer::~LocalRpcServer () {
+  close();
+}
+
+void LocalRpcServer::accept_loop () {
+  while ( ! closing) {
+    const int fd {::accept(listen_fd, nullptr, nullptr)};
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    unique_lock<std::mutex> guard {lock};
+    if (closing) {
+      ::close (fd);
+      return;
+    }
+    connection_fds.insert (fd);
+    std::thread {&LocalRpcServer::serve, this, fd}.detach();
+  }
+}
+
+void LocalRpcServer::serve (int fd) {
+  string payload {};
+  rpc_request request {};
+  while (read_frame(fd, payload) && decode_rpc_request(payload, request)) {
+    rpc_response response {500, rpc_headers {}, string {}};
+    try {
+      response = handler(request);
+    }
+    catch (const std::exception& e) {
+      cout << "Local RPC " << request.method << " " << request.path << " failed: " << e.what() << endl;
+    }
+    const string reply {frame(encode_rpc_response(response))};
+    if ( ! write_all(fd, reply.data(), reply.size()))
+      break;
+  }
+  // Closed under the lock, so close() never shuts down a reused descriptor
+  unique_lock<std::mutex> guard {lock};
+  connection_fds.erase (fd);
+  ::close (fd);
+  ended.notify_all();
+}
+
+/*
+  Stop accepting, end every connection, and wait for their threads
+ */
+void LocalRpcServer::close () {
+  if (closing.exchange(true))
+    return;
+  ::shutdown (listen_fd, SHUT_RDWR);
+  ::close (listen_fd);
+  if (acceptor.joinable())
+    acceptor.join();
+  ::unlink (path.c_str());
+
+  unique_lock<std::mutex> guard {lock};
+  for (int fd : connection_fds)
+    ::shutdown (fd, SHUT_RDWR);
+  ended.wait (guard, [this] { return connection_fds.empty(); });
+}
+
+LocalRpcClient::~LocalRpcClient () {
+  for (int fd : idle)
+    ::close (fd);
+}
+
+int LocalRpcClient::connect_socket () {
+  const sockaddr_un address {socket_address(path)};
+  const int fd {::socket(AF_UNIX, SOCK_STREAM, 0)};
+  if (fd < 0)
+    return -1;
+  const long ms {static_cast<long>(timeout.count())};
+  const timeval limit {ms / 1000, (ms % 1000) * 1000};
+  if (::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof limit) != 0 ||
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof limit) != 0 ||
+      ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof address) != 0) {
+    ::close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+  An idle connection has no reply pending, so one that is readable
+  has been closed by the server, perhaps on a restart, and is
+  dropped rather than written to.
+ */
+int LocalRpcClient::take_idle () {
+  for (;;) {
+    int fd {-1};
+    {
+      unique_lock<std::mutex> guard {lock};
+      if (idle.empty())
+        return -1;
+      fd = idle.back();
+      idle.pop_back();
+    }
+    pollfd ready {fd, POLLIN, 0};
+    if (::poll(&ready, 1, 0) == 0)
+      return fd;
+    ::close (fd);
+  }
+}
+
+/*
+  The server acts on a request only once it has read the whole
+  frame, so a failed write means it was not sent
+ */
+rpc_outcome LocalRpcClient::exchange (int fd, const string& request_frame, string& reply) {
+  if ( ! write_all(fd, request_frame.data(), request_frame.size()))
+    return rpc_outcome::not_sent;
+  // End of file leaves errno alone, so only a timeout sets EAGAIN
+  errno = 0;
+  if (read_frame(fd, reply))
+    return rpc_outcome::replied;
+  return errno == EAGAIN || errno == EWOULDBLOCK ? rpc_outcome::timed_out : rpc_outcome::no_reply;
+}
+
+/*
+  A pooled connection may still have been closed by the server
+  between the check in take_idle() and the write, so a request on
+  one is retried once on a new connection if it was not sent, or
+  was a GET that got no reply. A connection that fails in any way
+  is closed, as a late reply would be taken for the next one.
+ */
+rpc_outcome LocalRpcClient::call (const rpc_request& request, rpc_response& response) {
+  const string request_frame {frame(encode_rpc_request(request))};
+  string reply {};
+
+  int fd {take_idle()};
+  const bool pooled {fd >= 0};
+  if ( ! pooled)
+    fd = connect_socket();
+  if (fd < 0)
+    return rpc_outcome::not_sent;
+
+  rpc_outcome outcome {exchange(fd, request_frame, reply)};
+  if (pooled && (outcome == rpc_outcome::not_sent ||
+                 (outcome == rpc_outcome::no_reply && request.method == "GET"))) {
+    ::close (fd);
+    fd = connect_socket();
+    if (fd < 0)
+      return outcome;
+    outcome = exchange(fd, request_frame, reply);
+  }
+  if (outcome == rpc_outcome::replied && ! decode_rpc_response(reply, response))
+    outcome = rpc_outcome::no_reply;
+  if (outcome != rpc_outcome::replied) {
+    ::close (fd);
+    return outcome;
+  }
+
+  unique_lock<std::mutex> guard {lock};
+  if (idle.size() < max_idle)
+    idle.push_back (fd);
+  else
+    ::close (fd);
+  return rpc_outcome::replied;
+}
@@ -0,0 +1,139 @@
+#ifndef LocalRpc_h
+#define LocalRpc_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+  Request/reply transport over a Unix domain socket, for calls
+  between servers on the same host
+
+  Messages are HTTP-shaped, so a server answers them with its usual
+  handlers, but travel as one length-prefixed binary frame each way
+  on a persistent connection: no HTTP parsing, no TCP loopback.
+
+  Frame: u32 payload size, then the payload. Strings are a u32 size
+  and the bytes; integers are in host order, both ends being on one
+  host. Request payload: method, path, header count, name/value
+  pairs, body. Reply payload: u16 status, header count, name/value
+  pairs, body.
+ */
+
+using rpc_headers = std::vector<std::pair<std::string,std::string>>;
+
+struct rpc_request {
+  std::string method;
+  std::string path;
+  rpc_headers headers;
+  std::string body;
+};
+
+struct rpc_response {
+  std::uint16_t status;
+  rpc_headers headers;
+  std::string body;
+};
+
+using rpc_handler = std::function<rpc_response (const rpc_request& request)>;
+
+// How a LocalRpcClient::call ended
+enum class rpc_outcome {
+  // The response holds the server's reply
+  replied,
+  // The request never reached the server, which cannot have acted on it
+  not_sent,
+  // The server may have acted on the request, but no reply came
+  no_reply,
+  // No reply came within the client's timeout
+  timed_out
+};
+
+std::string encode_rpc_request (const rpc_request& request);
+bool decode_rpc_request (const std::string& payload, rpc_request& request);
+std::string encode_rpc_response (const rpc_response& response);
+bool decode_rpc_response (const std::string& payload, rpc_response& response);
+
+/*
+  Accepts connections on a Unix socket, serving each one on its own
+  thread with handler. Clients keep their connections open, so there
+  are only as many threads as concurrent callers.
+ */
+class LocalRpcServer {
+private:
+  const std::string path;
+  const rpc_handler handler;
+  int listen_fd;
+  std::thread acceptor;
+  // Open connections, each served by a detached thread
+  std::unordered_set<int> connection_fds;
+  std::mutex lock;
+  std::condition_variable ended;
+  std::atomic<bool> closing;
+
+  void accept_loop ();
+  void serve (int fd);
+
+public:
+  // Throws std::runtime_error if the socket cannot be opened
+  LocalRpcServer (const std::string& socket_path, rpc_handler handle);
+  ~LocalRpcServer ();
+
+  LocalRpcServer (const LocalRpcServer&) = delete;
+  LocalRpcServer& operator= (const LocalRpcServer&) = delete;
+
+  void close ();
+};
+
+/*
+  Client end, holding a pool of idle connections to one server
+
+  call() is safe to use from many threads; each call takes a
+  connection from the pool, or opens one, and returns it after.
+
+  Sending and receiving on a connection each give up after timeout,
+  so a hung server cannot hold a caller forever.
+ */
+class LocalRpcClient {
+private:
+  const std::string path;
+  const std::chrono::milliseconds timeout;
+  std::vector<int> idle;
+  std::mutex lock;
+  static constexpr std::size_t max_idle {16};
+
+  int connect_socket ();
+  int take_idle ();
+  rpc_outcome exchange (int fd, const std::string& frame, std::string& reply);
+
+public:
+  explicit LocalRpcClient (const std::string& socket_path,
+                           std::chrono::milliseconds reply_timeout = std::chrono::milliseconds {30000}) :
+    path {socket_path},
+    timeout {reply_timeout},
+    idle {},
+    lock {}
+    {}
+  ~LocalRpcClient ();
+
+  LocalRpcClient (const LocalRpcClient&) = delete;
+  LocalRpcClient& operator= (const LocalRpcClient&) = delete;
+
+  /*
+    A request is sent again on a new connection only when it surely
+    did not reach the server, or is a GET, so a write is never
+    applied twice. A reply that cannot be decoded is no_reply.
+   */
+  rpc_outcome call (const rpc_request& request, rpc_response& response);
+};
+
+#endif
@@ -0,0 +1,314 @@
+#include "LocalRpcHttp.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/containerstream.h>
+#include <cpprest/http_client.h>
+
+#include "ServerConfig.h"
+#include "make_unique.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::methods;
+using web::http::status_codes;
+
+using web::http::client::http_client;
+
+namespace {
+  struct local_route {
+    string base_uri;
+    unique_ptr<LocalRpcClient> client;
+  };
+
+  struct in_process_route {
+    string base_uri;
+    http_handler get;
+    http_handler post;
+    http_handler put;
+    http_handler del;
+  };
+
+  /*
+    Routes are set up as servers start, which in the all-in-one
+    binary may be on several threads at once. A route is never
+    removed, and a deque never moves its elements, so a route found
+    under the lock stays valid.
+   */
+  std::deque<local_route> routes {};
+  std::deque<in_process_route> in_process_routes {};
+  pplx::extensibility::critical_section_t routes_lock {};
+
+  string route_base (const string& base_uri) {
+    string base {base_uri};
+    if (base.empty() || base.back() != '/')
+      base.push_back ('/');
+    return base;
+  }
+
+  bool covers (const string& base, const string& uri_string) {
+    return uri_string.compare(0, base.size(), base) == 0;
+  }
+
+  // The handler of route for m, or null if it has none
+  const http_handler* handler_for (const in_process_route& route, const method& m) {
+    const http_handler* handle {nullptr};
+    if (m == methods::GET)
+      handle = &route.get;
+    else if (m == methods::POST)
+      handle = &route.post;
+    else if (m == methods::PUT)
+      handle = &route.put;
+    else if (m == methods::DEL)
+      handle = &route.del;
+    return handle != nullptr && *handle ? handle : nullptr;
+  }
+
+  /*
+    How long a server's handler may take over a request from a
+    socket before the caller is answered GatewayTimeout. Callers wait
+    a little longer than this, so they get that answer rather than
+    giving up on the connection themselves.
+   */
+  const std::chrono::milliseconds handler_timeout {config_long("LOCAL_RPC_TIMEOUT_MS", 30000)};
+  const std::chrono::milliseconds reply_margin {1000};
+
+  struct pending_reply {
+    std::mutex lock;
+    std::condition_variable ready;
+    bool done;
+    pplx::task<http_response> reply;
+
+    pending_reply () : lock {}, ready {}, done {false}, reply {} {}
+  };
+
+  /*
+    The reply the handler makes to message, which may come from a
+    continuation on another thread, or GatewayTimeout if none comes
+    within handler_timeout; a later reply is dropped
+   */
+  http_response wait_for_reply (const http_request& message) {
+    const std::shared_ptr<pending_reply> pending {std::make_shared<pending_reply>()};
+    message.get_response().then([pending] (pplx::task<http_response> reply) {
+      std::lock_guard<std::mutex> guard {pending->lock};
+      pending->reply = reply;
+      pending->done = true;
+      pending->ready.notify_all();
+    });
+    std::unique_lock<std::mutex> guard {pending->lock};
+    if ( ! pending->ready.wait_for(guard, handler_timeout, [&pending] { return pending->done; }))
+      return http_response {status_codes::GatewayTimeout};
+    return pending->reply.get();
+  }
+
+  const string content_type_header {"Content-Type"};
+  const string content_length_header {"Content-Length"};
+
+  /*
+    Whole body of a request or response made in this process; such
+    bodies are in memory, so reading them never blocks
+   */
+  string read_body (const concurrency::streams::istream& body) {
+    if ( ! body.is_valid())
+      return string {};
+    concurrency::streams::container_buffer<vector<std::uint8_t>> buffer {};
+    body.read_to_end(buffer).get();
+    const vector<std::uint8_t>& bytes (buffer.collection());
+    return string (bytes.begin(), bytes.end());
+  }
+
+  /*
+    Headers other than Content-Length, which framing makes redundant;
+    Content-Type is returned separately
+   */
+  rpc_headers copy_headers (const http_headers& headers, string& content_type) {
+    rpc_headers result {};
+    for (const auto& h : headers) {
+      if (h.first == content_type_header)
+        content_type = h.second;
+      else if (h.first != content_length_header)
+        result.emplace_back (h.first, h.second);
+    }
+    return result;
+  }
+
+  /*
+    Mark the body of message, an http_request or http_response made
+    in this process, as wholly received, as a listener or client
+    would once it had read the body, so that extract_json() and the
+    like return instead of waiting for more.
+
+    http_msg_base::_complete() is an internal of cpprest, public as
+    of Casablanca 2.8, the release this tree builds against. This is
+    the only use of cpprest internals here, so a cpprest upgrade that
+    changes it needs a change only here.
+   */
+  template <typename Message>
+  void mark_body_complete (Message& message, std::uint64_t size) {
+    message._get_impl()->_complete(size);
+  }
+
+  // Message is an http_request or an http_response
+  template <typename Message>
+  void set_message (Message& message, const rpc_headers& headers,
+                    const string& body, const string& content_type) {
+    for (const auto& h : headers) {
+      if (h.first == content_type_header)
+        continue;
+      message.headers().add(h.first, h.second);
+    }
+    if ( ! body.empty())
+      message.set_body(body, content_type.empty() ? string {"application/json"} : content_type);
+    mark_body_complete(message, body.size());
+  }
+
+  /*
+    The request is marked complete, as a listener would once it had
+    read the body, and so is the reply, as a client would; each end
+    then extracts the body just as it would over HTTP.
+   */
+  pplx::task<http_response> dispatch (const in_process_route& route,
+                                      const string& uri_string,
+                                      http_request request) {
+    const http_handler* handle {handler_for(route, request.method())};
+    if (handle == nullptr)
+      return pplx::task_from_result(http_response {status_codes::MethodNotAllowed});
+    request.set_request_uri(web::uri {"/" + uri_string.substr(route.base_uri.size())});
+    mark_body_complete(request, request.headers().content_length());
+    (*handle)(request);
+    return request.get_response()
+      .then([] (http_response response)
+      {
+        mark_body_complete(response, response.headers().content_length());
+        return response;
+      });
+  }
+
+  string find_content_type (const rpc_headers& headers) {
+    for (const auto& h : headers) {
+      if (h.first == content_type_header)
+        return h.second;
+    }
+    return string {};
+  }
+}
+
+rpc_handler http_rpc_handler (http_handler get, http_handler post,
+                              http_handler put, http_handler del) {
+  const in_process_route handlers {string {}, get, post, put, del};
+  return [handlers] (const rpc_request& request) {
+    const method m {request.method};
+    const http_handler* handle {handler_for(handlers, m)};
+    if (handle == nullptr)
+      return rpc_response {status_codes::MethodNotAllowed, rpc_headers {}, string {}};
+
+    http_request message {m};
+    message.set_request_uri(web::uri {request.path});
+    set_message(message, request.headers, request.body, find_content_type(request.headers));
+    (*handle)(message);
+
+    http_response response {wait_for_reply(message)};
+    string content_type {};
+    rpc_response result {response.status_code(),
+                         copy_headers(response.headers(), content_type),
+                         read_body(response.body())};
+    if ( ! content_type.empty())
+      result.headers.emplace_back (content_type_header, content_type);
+    return result;
+  };
+}
+
+unique_ptr<LocalRpcServer> open_local_rpc (const char* variable, rpc_handler handler) {
+  const string path {config_string(variable, "")};
+  if (path.empty())
+    return unique_ptr<LocalRpcServer> {};
+  return std::make_unique<LocalRpcServer>(path, std::move(handler));
+}
+
+void route_local_rpc (const string& base_uri, const char* variable) {
+  const string path {config_string(variable, "")};
+  if (path.empty())
+    return;
+  pplx::extensibility::scoped_critical_section_t lock {routes_lock};
+  routes.push_back (local_route {route_base(base_uri), std::make_unique<LocalRpcClient>(path, handler_timeout + reply_margin)});
+}
+
+void route_in_process (const string& base_uri, http_handler get, http_handler post,
+                       http_handler put, http_handler del) {
+  pplx::extensibility::scoped_critical_section_t lock {routes_lock};
+  in_process_routes.push_back (in_process_route {route_base(base_uri), get, post, put, del});
+}
+
+
+/*
+  If the server on a route cannot be reached, the request goes by
+  HTTP instead, so a server restarted without its socket, or not
+  co-located after all, is still served. A request the server may
+  already have acted on is not sent again unless it is a GET: it is
+  answered BadGateway, or GatewayTimeout if the server took too long.
+ */
+pplx::task<http_response> send_request (const string& uri_string, http_request request) {
+  const in_process_route* in_process {nullptr};
+  LocalRpcClient* rpc_client {nullptr};
+  string base {};
+  {
+    pplx::extensibility::scoped_critical_section_t lock {routes_lock};
+    for (const in_process_route& route : in_process_routes) {
+      if (covers(route.base_uri, uri_string)) {
+        in_process = &route;
+        break;
+      }
+    }
+    for (const local_route& route : routes) {
+      if (in_process == nullptr && covers(route.base_uri, uri_string)) {
+        rpc_client = route.client.get();
+        base = route.base_uri;
+        break;
+      }
+    }
+  }
+  if (in_process != nullptr)
+    return dispatch(*in_process, uri_string, request);
+
+  if (rpc_client != nullptr) {
+    string content_type {};
+    rpc_request call {request.method(),
+                      "/" + uri_string.substr(base.size()),
+                      copy_headers(request.headers(), content_type),
+                      read_body(request.body())};
+    if ( ! content_type.empty())
+      call.headers.emplace_back (content_type_header, content_type);
+
+    rpc_response reply {};
+    const rpc_outcome outcome {rpc_client->call(call, reply)};
+    if (outcome == rpc_outcome::replied) {
+      http_response response {reply.status};
+      set_message(response, reply.headers, reply.body, find_content_type(reply.headers));
+      return pplx::task_from_result(response);
+    }
+    if (outcome == rpc_outcome::timed_out)
+      return pplx::task_from_result(http_response {status_codes::GatewayTimeout});
+    if (outcome == rpc_outcome::no_reply && call.method != methods::GET)
+      return pplx::task_from_result(http_response {status_codes::BadGateway});
+    // The body was consumed by read_body, so it is set again for HTTP
+    if ( ! call.body.empty())
+      request.set_body(call.body, content_type);
+  }
+  http_client client {uri_string};
+  return client.request(request);
+}
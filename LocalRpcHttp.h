@@ -0,0 +1,57 @@
+#ifndef LocalRpcHttp_h
+#define LocalRpcHttp_h
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "LocalRpc.h"
+
+/*
+  HTTP requests between co-located servers, carried by LocalRpc
+
+  The serving side hands each rpc_request to the server's usual
+  handler as an http_request, and returns the reply the handler
+  makes. The calling side sends with send_request(), which uses a
+  LocalRpc route covering the URI if one is configured and answers,
+  and HTTP otherwise. External clients always use HTTP.
+
+  In the all-in-one binary, send_request passes the http_request
+  object itself to the handler of the server in the same process,
+  and returns the reply the handler makes: nothing is framed,
+  copied, or sent.
+
+  Each server's socket is named by an environment variable,
+  BASIC_RPC_SOCKET, AUTH_RPC_SOCKET, or PUSH_RPC_SOCKET; unset, the
+  default, leaves that server on HTTP only. A handler that has not
+  replied within LOCAL_RPC_TIMEOUT_MS, 30000 by default, is answered
+  GatewayTimeout on its behalf.
+ */
+
+using http_handler = std::function<void (web::http::http_request)>;
+
+// Handler passing requests to the server's HTTP handlers; an empty
+// handler gets MethodNotAllowed, as with an unsupported listener method
+rpc_handler http_rpc_handler (http_handler get, http_handler post,
+                              http_handler put, http_handler del);
+
+// A LocalRpcServer on the socket named by the variable, or null if unset
+std::unique_ptr<LocalRpcServer> open_local_rpc (const char* variable, rpc_handler handler);
+
+// Send requests for URIs beginning with base_uri to the server
+// on the socket named by the variable, if it is set
+void route_local_rpc (const std::string& base_uri, const char* variable);
+
+// Hand requests for URIs beginning with base_uri straight to the
+// handlers, in this process, ahead of any other route
+void route_in_process (const std::string& base_uri, http_handler get, http_handler post,
+                       http_handler put, http_handler del);
+
+pplx::task<web::http::http_response> send_request (const std::string& uri_string,
+                                                   web::http::http_request request);
+
+#endif
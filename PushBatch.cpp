@@ -0,0 +1,41 @@
+#include "PushBatch.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ServerUtils.h"
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::json::value;
+
+vector<push_batch> batch_by_country (const vector<friend_id>& recipients) {
+  vector<push_batch> batches {};
+  for (const friend_id& f : recipients) {
+    if (batches.empty() || batches.back().country != f.country ||
+        batches.back().names.size() == max_batch_size) {
+      batches.push_back (push_batch {f.country, vector<string> {}});
+    }
+    batches.back().names.push_back (f.name);
+  }
+  return batches;
+}
+
+void map_append_reply (const push_batch& batch, status_code status, const value& body,
+                       unordered_map<string,status_code>& results) {
+  for (const string& name : batch.names) {
+    status_code result {status};
+    if (status == status_codes::OK) {
+      result = status_codes::InternalError;
+      if (body.is_object() && body.has_field(name) && body.at(name).is_number())
+        result = static_cast<status_code>(body.at(name).as_integer());
+    }
+    results[batch.country + ";" + name] = result;
+  }
+}
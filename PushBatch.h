@@ -0,0 +1,40 @@
+#ifndef PushBatch_h
+#define PushBatch_h
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include "FriendSet.h"
+
+/*
+  Recipients of one country, at most max_batch_size of them (the
+  most BasicServer accepts), whose Updates BasicServer appends to
+  with one AppendEntitiesAdmin request
+ */
+struct push_batch {
+  std::string country;
+  std::vector<std::string> names;
+};
+
+/*
+  Group recipients, sorted as FriendSet::sorted returns them, into
+  batches by country
+ */
+std::vector<push_batch> batch_by_country (const std::vector<friend_id>& recipients);
+
+/*
+  Set the status of each recipient of batch in results, keyed
+  "country;name" as in Friends, from BasicServer's reply to its
+  AppendEntitiesAdmin request: the status of the request if it
+  failed, otherwise the row's status in body, or InternalError if
+  body has none for it
+ */
+void map_append_reply (const push_batch& batch, web::http::status_code status,
+                       const web::json::value& body,
+                       std::unordered_map<std::string,web::http::status_code>& results);
+
+#endif
@@ -2,7 +2,10 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <cstddef>
+#include <exception>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -13,6 +16,13 @@
 #include <was/common.h>
 #include <was/table.h>
 
+#include "AllInOne.h"
+#include "FanOut.h"
+#include "FriendSet.h"
+#include "LocalRpcHttp.h"
+#include "PushBatch.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "TableCache.h"
 #include "make_unique.h"
 
@@ -44,6 +54,8 @@ using std::vector;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
@@ -55,6 +67,11 @@ using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
+// In the all-in-one binary, each server's code is in a namespace of its own
+#ifdef ALL_IN_ONE
+namespace push_server {
+#endif
+
 constexpr const char* def_url = "http://localhost:34574/";
 constexpr const char* data_table_addr = "http://localhost:34568/";
 
@@ -69,13 +86,27 @@ const string data_table_name {"DataTable"};
 const string read_entity_admin {"ReadEntityAdmin"};
 const string update_entity_admin {"UpdateEntityAdmin"};
 const string delete_entity_admin {"DeleteEntityAdmin"};
+const string append_entities_admin {"AppendEntitiesAdmin"};
 
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
 
 const string post_push_status_op {"PushStatus"};
 
+enum class push_op { push_status, unknown };
+
+const route_table<push_op> push_routes {
+    {{post_push_status_op, push_op::push_status}},
+    push_op::unknown};
+
 const string update_prop {"Updates"};
+const string friends_prop {"Friends"};
+
+/*
+ Batches of recipients sent at once by each PushStatus, PUSH_FANOUT
+ (default 16)
+ */
+const std::size_t fan_out_limit {static_cast<std::size_t>(config_long("PUSH_FANOUT", 16))};
 
 
 pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
@@ -88,8 +119,7 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
     
     status_code code;
     value resp_body;
-    http_client client {uri_string};
-    client.request (request)
+    send_request (uri_string, request)
     .then([&code](http_response response)
           {
               code = response.status_code();
@@ -224,6 +254,22 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
     }
 }
 
+/*
+ Append status to the Updates of every recipient in batch, setting
+ the status of each in results
+ */
+void push_batch_to (const push_batch& batch, const string& status,
+                    unordered_map<string,status_code>& results) {
+    value appends {value::object()};
+    for (const string& name : batch.names)
+        appends[name] = value::string(status + "\n");
+    pair<status_code,value> reply {do_request(methods::PUT,
+                                              data_table_addr + append_entities_admin + "/" + data_table_name + "/" +
+                                              uri::encode_data_string(batch.country) + "/" + update_prop,
+                                              appends)};
+    map_append_reply(batch, reply.first, reply.second, results);
+}
+
 /*
  Top-level routine for processing all HTTP GET requests.
  */
@@ -237,42 +283,55 @@ void handle_get(http_request message) {
  Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
-  string path {uri::decode(message.relative_uri().path())};
+  const string path {message.relative_uri().path()};
   cout << endl << "**** PushServer POST " << path << endl;
-  auto paths = uri::split_path(path);
+  const path_segments paths {path};
   unordered_map<string,string> json_body {get_json_body(message)};
 
-  if(paths[0]==post_push_status_op && json_body.size()>0){
-    string user_friend {json_body["Friends"]};
-    friends_list_t friend_vector {parse_friends_list(user_friend)};
-    string friend_status {paths[3]};
-      
-      
-    auto it = user_friend.begin();
-    while (it != user_friend.end()){
-      string country_name = it->first;
-      string friend_name = it->second;
-        
-      pair<status_code,value> prop_of_friend {do_request(methods::GET,data_table_addr +
-                                                            read_entity_admin +"/" +
-                                                            country_name + "/" +
-                                                            friend_name)}; 
-
-      if(prop_of_friend.first == status_codes::OK){
-        string updates_str {get_json_object_prop(prop_of_friend.second, update_prop)};
-          
-        //add the updates
-        updates_str = updates_str + friend_status +"\n";
-
-        do_request(methods::PUT, data_table_addr + update_entity_admin + "/" + data_table_name +
-                    "/"+ country_name + "/" + friend_name, value::object(vector<pair<string,value>> 
-                                                              {make_pair(update_prop, value::string(updates_str))}));
+  // Need an operation, the sender's country and name, and the status
+  if (paths.size() < 4) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  if (push_routes.lookup(paths[0]) == push_op::push_status && json_body.size() > 0) {
+    const vector<friend_id> recipients {FriendSet::parse(json_body[friends_prop]).sorted()};
+    const string friend_status {paths.decoded(3)};
+
+    // One transaction per country's worth of recipients, up to max_batch_size,
+    // fan_out_limit of them at once
+    const vector<push_batch> batches {batch_by_country(recipients)};
+    vector<unordered_map<string,status_code>> batch_results (batches.size());
+    fan_out(batches.size(), fan_out_limit, [&batches, &friend_status, &batch_results] (std::size_t i) {
+      try {
+        push_batch_to(batches[i], friend_status, batch_results[i]);
+      }
+      catch (const std::exception& e) {
+        cout << "PushServer: push to " << batches[i].country << " failed: " << e.what() << endl;
+      }
+    });
+
+    // The status of each recipient's update, keyed as in Friends; a
+    // batch that threw leaves its recipients at InternalError
+    value reply {value::object()};
+    std::size_t failed {0};
+    for (std::size_t i {0}; i < batches.size(); ++i) {
+      for (const string& name : batches[i].names) {
+        const string key {batches[i].country + ";" + name};
+        auto found (batch_results[i].find(key));
+        const status_code result {found == batch_results[i].end() ?
+                                  status_codes::InternalError : found->second};
+        reply[key] = value::number(result);
+        if (result != status_codes::OK)
+          ++failed;
       }
-      it++;
     }
-    message.reply(status_codes::OK);
-    return;  
-  } 
+    cout << "PushServer: pushed to " << recipients.size() - failed << " of "
+         << recipients.size() << " friends in " << batches.size() << " batches" << endl;
+    message.reply(status_codes::OK, reply);
+    return;
+  }
+  message.reply(status_codes::BadRequest);
 }
 
 
@@ -305,6 +364,12 @@ int main (int argc, char const * argv[]) {
     cout << "PushServer: Parsing connection string" << endl;
     
     
+    // BasicServer is called over its Unix socket where configured, and
+    // co-located servers may call this one over PUSH_RPC_SOCKET
+    route_local_rpc(data_table_addr, "BASIC_RPC_SOCKET");
+    std::unique_ptr<LocalRpcServer> rpc_server {open_local_rpc("PUSH_RPC_SOCKET",
+        http_rpc_handler(http_handler {}, &handle_post, http_handler {}, http_handler {}))};
+    
     cout << "PushServer: Opening listener" << endl;
     http_listener listener {def_url};
     //listener.support(methods::GET, &handle_get);
@@ -313,11 +378,20 @@ int main (int argc, char const * argv[]) {
     //listener.support(methods::DEL, &handle_delete);
     listener.open().wait(); // Wait for listener to complete starting
     
+#ifdef ALL_IN_ONE
+    wait_for_stop();
+#else
     cout << "Enter carriage return to stop PushServer." << endl;
     string line;
     getline(std::cin, line);
+#endif
     
     // Shut it down
     listener.close().wait();
+    rpc_server.reset();
     cout << "PushServer closed" << endl;
 }
+
+#ifdef ALL_IN_ONE
+} // namespace push_server
+#endif
@@ -0,0 +1,166 @@
+#include "RateLimiter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Fnv1a.h"
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+
+constexpr uint64_t token_bits {24};
+constexpr uint64_t token_mask {(uint64_t {1} << token_bits) - 1};
+constexpr uint64_t milli {1000};
+
+RateLimiter::RateLimiter (size_t table_slots, double tokens_per_second, double burst) :
+  slots {},
+  group_mask {0},
+  rate {std::max<uint64_t>(1, static_cast<uint64_t>(tokens_per_second * milli))},
+  capacity {std::min<uint64_t>(token_mask, static_cast<uint64_t>(std::max(1.0, burst) * milli))},
+  refill_ms {0},
+  epoch {clock::now()},
+  allowed {0},
+  throttled {0}
+{
+  size_t groups {1};
+  while (groups * slots_per_group < table_slots)
+    groups *= 2;
+  group_mask = groups - 1;
+  slots.reset (new slot[groups * slots_per_group]);
+  for (size_t i {0}; i < groups * slots_per_group; ++i) {
+    slots[i].key.store (0, std::memory_order_relaxed);
+    slots[i].state.store (0, std::memory_order_relaxed);
+  }
+  refill_ms = capacity * milli / rate + 1;
+}
+
+/*
+  Milliseconds since construction, never 0, so that a state of 0
+  always means "full bucket, never used".
+ */
+uint64_t RateLimiter::now_ms () const {
+  return static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - epoch).count()) + 1;
+}
+
+namespace {
+  uint64_t hash_key (const string& key) {
+    const uint64_t h {fnv1a64(key)};
+    return h == 0 ? 1 : h;   // 0 marks a free slot
+  }
+}
+
+RateLimiter::slot& RateLimiter::slot_for (uint64_t h, uint64_t now) {
+  slot* const group {&slots[(h & group_mask) * slots_per_group]};
+
+  // Fast path: the key already owns a slot in its group
+  for (size_t i {0}; i < slots_per_group; ++i) {
+    if (group[i].key.load(std::memory_order_acquire) == h)
+      return group[i];
+  }
+
+  // Claim a free slot, or take over one whose bucket is full again
+  for (size_t i {0}; i < slots_per_group; ++i) {
+    uint64_t owner {group[i].key.load(std::memory_order_acquire)};
+    if (owner == 0) {
+      if (group[i].key.compare_exchange_strong(owner, h, std::memory_order_acq_rel))
+        return group[i];
+    }
+    if (owner == h)
+      return group[i];
+    const uint64_t last {group[i].state.load(std::memory_order_relaxed) >> token_bits};
+    if (now >= last + refill_ms &&
+        group[i].key.compare_exchange_strong(owner, h, std::memory_order_acq_rel)) {
+      group[i].state.store (0, std::memory_order_relaxed);
+      return group[i];
+    }
+  }
+  return group[0];
+}
+
+uint64_t RateLimiter::acquire (const string& key) {
+  const uint64_t now {now_ms()};
+  slot& s (slot_for(hash_key(key), now));
+
+  uint64_t old {s.state.load(std::memory_order_relaxed)};
+  for (;;) {
+    const uint64_t last {old >> token_bits};
+    uint64_t tokens {old == 0 ? capacity : old & token_mask};
+    // Refilling for longer than refill_ms fills the bucket, so the
+    // product cannot overflow
+    if (now > last)
+      tokens = std::min(capacity, tokens + std::min(now - last, refill_ms) * rate / milli);
+
+    if (tokens >= milli) {
+      const uint64_t next {(std::max(now, last) << token_bits) | (tokens - milli)};
+      if (s.state.compare_exchange_weak(old, next, std::memory_order_relaxed)) {
+        ++allowed;
+        return 0;
+      }
+    }
+    else {
+      ++throttled;
+      return ((milli - tokens) * milli + rate - 1) / rate;
+    }
+  }
+}
+
+vector<string> parse_address_list (const string& list) {
+  vector<string> result {};
+  size_t start {0};
+  for (;;) {
+    const size_t end {std::min(list.find(',', start), list.size())};
+    const size_t first {list.find_first_not_of(" \t", start)};
+    if (first < end) {
+      const size_t last {list.find_last_not_of(" \t", end - 1)};
+      result.push_back (list.substr(first, last - first + 1));
+    }
+    if (end == list.size())
+      return result;
+    start = end + 1;
+  }
+}
+
+string client_address (const string& remote, const string& forwarded, const vector<string>& proxies) {
+  vector<string> hops {parse_address_list(forwarded)};
+  string sender {remote};
+  const auto trusted = [&proxies] (const string& address) {
+    return address.empty() || std::find(proxies.begin(), proxies.end(), address) != proxies.end();
+  };
+  while (trusted(sender) && ! hops.empty()) {
+    sender = hops.back();
+    hops.pop_back();
+  }
+  return sender;
+}
+
+string client_key (const http_request& message, const vector<string>& proxies) {
+  const http_headers& headers {message.headers()};
+  auto forwarded (headers.find("X-Forwarded-For"));
+  return client_address(message.remote_address(),
+                        forwarded == headers.end() ? string {} : forwarded->second,
+                        proxies);
+}
+
+bool throttle (const http_request& message, RateLimiter& limiter, const string& key) {
+  if (key.empty())
+    return false;
+  const uint64_t wait_ms {limiter.acquire(key)};
+  if (wait_ms == 0)
+    return false;
+  http_response response {too_many_requests};
+  response.headers().add("Retry-After", std::to_string((wait_ms + 999) / 1000));
+  message.reply(response);
+  return true;
+}
@@ -0,0 +1,105 @@
+#ifndef RateLimiter_h
+#define RateLimiter_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+/*
+  Token-bucket rate limiter over many keys, without locks
+
+  Each key hashes to a group of slots_per_group adjacent slots and
+  claims one with a compare-and-swap on its key field. A slot's
+  bucket is a single 64-bit word, (last refill time in ms << 24) |
+  milli-tokens, updated with compare-and-swap, so a check is a hash
+  and a few atomic operations.
+
+  Slots are never freed. A slot whose bucket has refilled completely
+  carries no state, so it may be taken over by another key. If every
+  slot in the group is busy, the key shares the first one with its
+  owner, which errs on the side of throttling.
+ */
+class RateLimiter {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t slots_per_group {8};
+
+private:
+  struct slot {
+    std::atomic<std::uint64_t> key;
+    std::atomic<std::uint64_t> state;
+  };
+
+  std::unique_ptr<slot[]> slots;
+  std::size_t group_mask;
+  std::uint64_t rate;        // milli-tokens per second
+  std::uint64_t capacity;    // burst size in milli-tokens
+  std::uint64_t refill_ms;   // time to refill an empty bucket
+  clock::time_point epoch;
+  std::atomic<unsigned long> allowed;
+  std::atomic<unsigned long> throttled;
+
+  std::uint64_t now_ms () const;
+  slot& slot_for (std::uint64_t h, std::uint64_t now);
+
+public:
+  RateLimiter (std::size_t table_slots, double tokens_per_second, double burst);
+
+  RateLimiter (const RateLimiter&) = delete;
+  RateLimiter& operator= (const RateLimiter&) = delete;
+
+  /*
+    Take one token from key's bucket
+
+    Returns 0 if the request may proceed, otherwise the number of
+    milliseconds until a token will be available.
+   */
+  std::uint64_t acquire (const std::string& key);
+
+  unsigned long allowed_count () const { return allowed; }
+  unsigned long throttled_count () const { return throttled; }
+};
+
+// Status returned when a rate limit is exceeded
+constexpr web::http::status_code too_many_requests {429};
+
+// Addresses in a comma-separated list, such as a list of proxies
+std::vector<std::string> parse_address_list (const std::string& list);
+
+/*
+  Address of the client behind a request that arrived from remote
+  with the X-Forwarded-For header forwarded, which may be empty
+
+  The header is believed only as far as trusted proxies wrote it:
+  its addresses are taken from the right, where each proxy appends
+  the address it was sent from, while the sender is one of proxies.
+  A request with no remote address came from another server, over
+  LocalRpc or in process, and is trusted as a proxy is.
+
+  Returns an empty string for a request another server made on its
+  own behalf.
+ */
+std::string client_address (const std::string& remote, const std::string& forwarded,
+                            const std::vector<std::string>& proxies);
+
+// Key identifying the client that sent message, for a client limiter
+std::string client_key (const web::http::http_request& message,
+                        const std::vector<std::string>& proxies);
+
+/*
+  Take a token for key from limiter, replying 429 Too Many Requests
+  with Retry-After if none is left. An empty key, a server calling on
+  its own behalf, is never throttled.
+
+  Returns true if the request was throttled and has been answered.
+ */
+bool throttle (const web::http::http_request& message, RateLimiter& limiter,
+               const std::string& key);
+
+#endif
@@ -0,0 +1,81 @@
+#include "Router.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using std::size_t;
+using std::string;
+using std::uint32_t;
+
+path_segments::path_segments (const string& path) :
+  segs {},
+  count {0}
+{
+  const char* p {path.data()};
+  const char* const end {p + path.size()};
+  while (p < end) {
+    while (p < end && *p == '/')
+      ++p;
+    const char* start {p};
+    while (p < end && *p != '/')
+      ++p;
+    if (p > start) {
+      if (count < max_segments)
+        segs[count] = path_segment {start, static_cast<size_t>(p - start)};
+      ++count;
+    }
+  }
+}
+
+string path_segment::decoded () const {
+  return decode_segment (data, size);
+}
+
+namespace {
+  int hex_value (char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+}
+
+/*
+  Percent-decode one path segment
+
+  Malformed escapes are copied through unchanged.
+ */
+string decode_segment (const char* data, size_t size) {
+  string result {};
+  result.reserve (size);
+  for (size_t i {0}; i < size; ++i) {
+    if (data[i] == '%' && i + 2 < size) {
+      const int hi {hex_value(data[i + 1])};
+      const int lo {hex_value(data[i + 2])};
+      if (hi >= 0 && lo >= 0) {
+        result.push_back (static_cast<char>(hi * 16 + lo));
+        i += 2;
+        continue;
+      }
+    }
+    result.push_back (data[i]);
+  }
+  return result;
+}
+
+/*
+  FNV-1a, perturbed by seed so that route_table can search
+  for a collision-free placement.
+ */
+uint32_t hash_segment (const char* data, size_t size, uint32_t seed) {
+  uint32_t h {2166136261u ^ (seed * 16777619u)};
+  for (size_t i {0}; i < size; ++i) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
@@ -0,0 +1,133 @@
+#ifndef Router_h
+#define Router_h
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+  Non-owning view of one segment of a request path
+
+  The segment is left undecoded. Operation names never contain
+  escapes, so they can be compared against the raw segment; operands
+  are decoded only when a handler asks for them.
+ */
+struct path_segment {
+  const char* data;
+  std::size_t size;
+
+  bool operator== (const std::string& s) const {
+    return size == s.size() && s.compare(0, size, data, size) == 0;
+  }
+  bool operator!= (const std::string& s) const { return ! (*this == s); }
+
+  std::string str () const { return std::string (data, size); }
+  std::string decoded () const;
+};
+
+/*
+  Segments of a request path, split in place
+
+  Empty segments are skipped, as with uri::split_path. The path
+  string must outlive this object, as segments point into it.
+ */
+class path_segments {
+public:
+  static constexpr std::size_t max_segments {16};
+
+private:
+  std::array<path_segment,max_segments> segs;
+  std::size_t count;
+
+public:
+  explicit path_segments (const std::string& path);
+
+  // Number of segments in the path, even beyond max_segments
+  std::size_t size () const { return count; }
+
+  // Segment i, or an empty segment if i is past the last one stored
+  path_segment operator[] (std::size_t i) const {
+    return i < count && i < max_segments ? segs[i] : path_segment {"", 0};
+  }
+
+  std::string decoded (std::size_t i) const { return (*this)[i].decoded(); }
+};
+
+std::string decode_segment (const char* data, std::size_t size);
+
+std::uint32_t hash_segment (const char* data, std::size_t size, std::uint32_t seed);
+
+/*
+  Precomputed table from operation names to values of type T
+
+  The table is built once, at startup, as an open-addressed array
+  whose hash seed is chosen so that no two names share a slot. A
+  lookup is then one hash of the segment and at most one comparison,
+  with no allocation.
+
+  Names not in the table map to the not_found value given at
+  construction.
+ */
+template <typename T>
+class route_table {
+private:
+  std::vector<std::pair<std::string,T>> slots;
+  std::vector<bool> used;
+  std::uint32_t seed;
+  std::uint32_t mask;
+  T not_found;
+
+public:
+  route_table (std::initializer_list<std::pair<std::string,T>> routes, T missing) :
+    slots {},
+    used {},
+    seed {0},
+    mask {0},
+    not_found {missing}
+  {
+    std::size_t size {4};
+    while (size < 4 * routes.size())
+      size *= 2;
+    for (;;) {
+      for (std::uint32_t s {1}; s < 1024; ++s) {
+        if (try_build (routes, size, s))
+          return;
+      }
+      size *= 2;
+      if (size > (1u << 16))
+        throw std::logic_error {"route_table: cannot place routes"};
+    }
+  }
+
+  T lookup (const path_segment& seg) const {
+    const std::uint32_t h {hash_segment(seg.data, seg.size, seed) & mask};
+    if (used[h] && seg == slots[h].first)
+      return slots[h].second;
+    return not_found;
+  }
+
+private:
+  bool try_build (std::initializer_list<std::pair<std::string,T>> routes,
+                  std::size_t size,
+                  std::uint32_t s) {
+    slots.assign (size, std::make_pair (std::string {}, not_found));
+    used.assign (size, false);
+    mask = static_cast<std::uint32_t>(size - 1);
+    for (const auto& r : routes) {
+      const std::uint32_t h {hash_segment(r.first.data(), r.first.size(), s) & mask};
+      if (used[h])
+        return false;
+      used[h] = true;
+      slots[h] = r;
+    }
+    seed = s;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef ServerConfig_h
+#define ServerConfig_h
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/*
+  Tuning parameters of the servers are read from environment
+  variables at startup, in the manner of setvars.sh, so they can be
+  adjusted per deployment without a rebuild.
+
+  Each function returns def if the variable is unset or unparsable,
+  except config_required, which has no default.
+ */
+
+inline long config_long (const char* name, long def) {
+  const char* text {std::getenv(name)};
+  if (text == nullptr || *text == '\0')
+    return def;
+  char* end {nullptr};
+  const long result {std::strtol(text, &end, 10)};
+  return *end == '\0' ? result : def;
+}
+
+inline double config_double (const char* name, double def) {
+  const char* text {std::getenv(name)};
+  if (text == nullptr || *text == '\0')
+    return def;
+  char* end {nullptr};
+  const double result {std::strtod(text, &end)};
+  return *end == '\0' ? result : def;
+}
+
+inline std::string config_string (const char* name, const std::string& def) {
+  const char* text {std::getenv(name)};
+  return text == nullptr ? def : std::string {text};
+}
+
+// For a secret with no safe default: exits the process if name is unset or empty
+inline std::string config_required (const char* name) {
+  const char* text {std::getenv(name)};
+  if (text == nullptr || *text == '\0') {
+    std::cerr << name << " must be set" << std::endl;
+    std::exit (EXIT_FAILURE);
+  }
+  return std::string {text};
+}
+
+#endif
@@ -4,36 +4,273 @@
 
 #include "ServerUtils.h"
 
+#include <chrono>
+#include <cstddef>
+#include <exception>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <pplx/pplxtasks.h>
+
 #include <was/table.h>
 
+#include "Router.h"
+#include "SessionToken.h"
+#include "ShardedTtlCache.h"
+
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
 using azure::storage::entity_property;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
 using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
+using azure::storage::table_batch_operation;
 using azure::storage::table_entity;
 using azure::storage::table_operation;
+using azure::storage::table_query;
+using azure::storage::table_query_iterator;
 using azure::storage::table_result;
 
 using std::cout;
 using std::endl;
 using std::make_pair;
 using std::pair;
+using std::size_t;
 using std::string;
 using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 
+using web::http::http_headers;
 using web::http::http_request;
 using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+/*
+  Tokens already parsed by check_token, keyed by the undecoded token.
+
+  Each is held until it expires, or for parsed_token_ttl if it has
+  no expiry, and at most max_cached_tokens are held, so that a
+  stream of distinct tokens cannot grow the cache without bound.
+ */
+constexpr size_t max_cached_tokens {10000};
+constexpr std::chrono::hours parsed_token_ttl {1};
+ShardedTtlCache<string,token_scope> parsed_tokens {max_cached_tokens};
+
+bool token_scope::expired () const {
+  // A token without "se" relies on a stored policy we cannot see
+  if ( ! expiry.is_initialized())
+    return false;
+  return expiry.to_interval() <= utility::datetime::utc_now().to_interval();
+}
+
+bool token_scope::allows (char permission) const {
+  // As in expired(), what we cannot see is left for storage to check
+  if ( ! has_permissions)
+    return true;
+  return permissions.find(permission) != string::npos;
+}
+
+/*
+  Azure compares (partition, row) pairs ordinally against the
+  inclusive range [(spk, srk), (epk, erk)]. A missing bound is open.
+ */
+bool token_scope::covers (const string& partition, const string& row) const {
+  if ( ! start_partition.empty()) {
+    if (partition < start_partition)
+      return false;
+    if (partition == start_partition && ! start_row.empty() && row < start_row)
+      return false;
+  }
+  if ( ! end_partition.empty()) {
+    if (partition > end_partition)
+      return false;
+    if (partition == end_partition && ! end_row.empty() && row > end_row)
+      return false;
+  }
+  return true;
+}
+
+/*
+  Parse the query parameters of a shared access signature
+
+  The token may arrive with its '&' and '=' separators still
+  percent-encoded, in which case it is decoded once before splitting.
+  Each value is then decoded individually.
+ */
+token_scope parse_token (const string& token) {
+  const string query {token.find('&') == string::npos ? uri::decode(token) : token};
+  token_scope scope {};
+  string::size_type start {0};
+  while (start < query.size()) {
+    string::size_type end {query.find('&', start)};
+    if (end == string::npos)
+      end = query.size();
+    const string param {query.substr(start, end - start)};
+    start = end + 1;
+
+    const string::size_type eq {param.find('=')};
+    if (eq == string::npos)
+      continue;
+    const string key {param.substr(0, eq)};
+    const string val {uri::decode(param.substr(eq + 1))};
+    if (key == "se")
+      scope.expiry = utility::datetime::from_string(val, utility::datetime::ISO_8601);
+    else if (key == "spk")
+      scope.start_partition = val;
+    else if (key == "srk")
+      scope.start_row = val;
+    else if (key == "epk")
+      scope.end_partition = val;
+    else if (key == "erk")
+      scope.end_row = val;
+    else if (key == "sp") {
+      scope.permissions = val;
+      scope.has_permissions = true;
+    }
+  }
+  return scope;
+}
+
+/*
+  Check a token against the entity it is about to access, without
+  a round trip to Azure Storage
+
+  permission is the SAS permission letter the operation needs:
+    'r' to read, 'u' to update.
+
+  Returns OK if the token may be used, Forbidden if it has expired,
+  does not cover (partition, row), or lacks the permission. These
+  are the requests that Azure would otherwise refuse with a 403.
+ */
+status_code check_token (const string& token,
+                         const string& partition,
+                         const string& row,
+                         char permission) {
+  token_scope scope {};
+  if ( ! parsed_tokens.find(token, scope)) {
+    scope = parse_token(token);
+    std::chrono::seconds ttl {parsed_token_ttl};
+    if (scope.expiry.is_initialized()) {
+      // Intervals are unsigned, in units of 100 ns
+      const long long left {static_cast<long long>(scope.expiry.to_interval()) -
+                            static_cast<long long>(utility::datetime::utc_now().to_interval())};
+      ttl = std::chrono::seconds {left / 10000000};
+    }
+    if (ttl > std::chrono::seconds::zero())
+      parsed_tokens.insert(token, scope, ttl);
+  }
+
+  if (scope.expired()) {
+    cout << "Token expired" << endl;
+    return status_codes::Forbidden;
+  }
+  if ( ! scope.allows(permission)) {
+    cout << "Token lacks permission " << permission << endl;
+    return status_codes::Forbidden;
+  }
+  if ( ! scope.covers(uri::decode(partition), uri::decode(row))) {
+    cout << "Token does not cover " << partition << " / " << row << endl;
+    return status_codes::Forbidden;
+  }
+  return status_codes::OK;
+}
+
+/*
+  Components of an authenticated operation path,
+  OPERATION/TABLE/TOKEN/PARTITION/ROW, left undecoded.
+ */
+struct token_path {
+  string tname;
+  string token;
+  string partition;
+  string row;
+};
+
+/*
+  Split the path of an authenticated request
+
+  Tokens can contain %2F ('/'). Thus we split the URI path
+  *before* decoding and pass the undecoded values to Azure Storage.
+
+  Returns false if the path does not have exactly five segments.
+ */
+bool split_token_path (const http_request& message, token_path& tp) {
+  const string undecoded_path {message.relative_uri().path()};
+  const path_segments undecoded_paths {undecoded_path};
+  if (undecoded_paths.size () != 5) {
+    return false;
+  }
+  tp.tname = undecoded_paths[1].str();
+  tp.token = undecoded_paths[2].str();
+  tp.partition = undecoded_paths[3].str();
+  tp.row = undecoded_paths[4].str();
+  return true;
+}
+
+/*
+  Map a storage exception to the status code returned to the client
+ */
+status_code storage_error_status (const storage_exception& e) {
+  cout << "Azure Table Storage error: " << e.what() << endl;
+  cout << e.result().extended_error().message() << endl;
+  if (e.result().http_status_code() == status_codes::Forbidden)
+    return status_codes::Forbidden;
+  else if (e.result().http_status_code() == status_codes::PreconditionFailed)
+    return status_codes::PreconditionFailed;
+  else
+    return status_codes::InternalError;
+}
+
+/*
+  Map any other exception from storage or the REST client to
+  InternalError, so that a handler always has a status to reply with
+ */
+status_code unexpected_error_status (const std::exception& e) {
+  cout << "Unexpected error: " << e.what() << endl;
+  return status_codes::InternalError;
+}
+
+/*
+  Table reference authorized only by the token in tp
+ */
+cloud_table token_table (const token_path& tp, const string& endpoint) {
+  uri endpoint_uri {endpoint};
+  storage_credentials creds {tp.token};
+  cloud_table_client client {endpoint_uri, creds};
+  return client.get_table_reference(tp.tname);
+}
+
+/*
+  Merge or replace operation writing props to partition/row
+
+  If if_match is empty, the write is unconditional. Otherwise it is
+  sent with If-Match: if_match and storage refuses it with 412 if the
+  entity has changed since that ETag was read.
+ */
+table_operation write_operation (const string& partition,
+                                 const string& row,
+                                 const unordered_map<string,string>& props,
+                                 const string& if_match,
+                                 bool replace) {
+  table_entity entity {partition, row};
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto v : props) {
+    properties[v.first] = entity_property {v.second};
+  }
+  entity.set_etag(if_match.empty() ? string {"*"} : if_match);
+  if (replace)
+    return table_operation::replace_entity(entity);
+  else
+    return table_operation::merge_entity(entity);
+}
+
 /*
   Read from a table using a security token
 
@@ -46,33 +283,26 @@ using web::http::uri;
     replaced by the user's Azure Storage account name.
 
   Returns a pair:
-    first: HTTP status code from the read
-    second: if the status code is OK, the entity read from the table
+    first: HTTP status code from the read, or Forbidden without
+      contacting storage if check_token rejects the token
+    second: if the status code is OK, the entity read from the table.
+      Its etag() may be passed as if_match to update_with_token.
  */
 pair<status_code,table_entity> read_with_token (const http_request& message,
                                                  const string& endpoint) {
-  /*
-    Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
-   */
-  const string undecoded_path {message.relative_uri().path()};
-  const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
-  if (undecoded_paths.size () != 5) {
+  token_path tp {};
+  if ( ! split_token_path(message, tp)) {
     return make_pair (status_codes::BadRequest, table_entity{});
   }
 
-  const string tname {undecoded_paths[1]};
-  const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
+  const status_code token_status {check_token(tp.token, tp.partition, tp.row, 'r')};
+  if (token_status != status_codes::OK) {
+    return make_pair (token_status, table_entity{});
+  }
 
   try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-
-    table_operation op {table_operation::retrieve_entity(partition, row)};
-    cloud_table table_cred {client.get_table_reference(tname)};
+    table_operation op {table_operation::retrieve_entity(tp.partition, tp.row)};
+    cloud_table table_cred {token_table(tp, endpoint)};
     table_result retrieve_result {table_cred.execute(op)};
     if (retrieve_result.http_status_code() == status_codes::NotFound) {
       cout << "Not found" << endl;
@@ -85,14 +315,8 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
                        entity);
   }
   catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return make_pair (status_codes::Forbidden,
-                         table_entity{});
-    else
-      return make_pair (status_codes::InternalError,
-                         table_entity{});
+    return make_pair (storage_error_status(e),
+                       table_entity{});
   }
 }
 
@@ -108,40 +332,31 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
     replaced by the user's Azure Storage account name.
   props is an unordered_map of properties to be merged into
     the entity. This will typically be the result of get_json_body().
+  if_match, if not empty, is the ETag the entity must still have.
+  replace replaces the entity with props instead of merging them.
 
-  Returns:  HTTP status code from the write.
+  Returns:  HTTP status code from the write, or Forbidden without
+    contacting storage if check_token rejects the token, or
+    PreconditionFailed if the entity no longer matches if_match.
  */
 status_code update_with_token (const http_request& message,
                                const string& endpoint,
-                               const unordered_map<string,string>& props) {
-  
-  /*
-    Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
-   */
-  const string undecoded_path {message.relative_uri().path()};
-  const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
-  if (undecoded_paths.size () != 5) {
+                               const unordered_map<string,string>& props,
+                               const string& if_match,
+                               bool replace) {
+  token_path tp {};
+  if ( ! split_token_path(message, tp)) {
     return status_codes::BadRequest;
   }
-  
-  const string tname {undecoded_paths[1]};
-  const string token {undecoded_paths[2]};
-  const string partition {undecoded_paths[3]};
-  const string row {undecoded_paths[4]};
-  table_entity entity {partition, row};
-  try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
 
-    table_entity::properties_type& properties = entity.properties();
-    for (const auto v : props) {
-      properties[v.first] = entity_property {v.second};
-    }
+  const status_code token_status {check_token(tp.token, tp.partition, tp.row, 'u')};
+  if (token_status != status_codes::OK) {
+    return token_status;
+  }
 
-    table_operation op {table_operation::merge_entity(entity)};
-    cloud_table table_cred {client.get_table_reference(tname)};
+  try {
+    table_operation op {write_operation(tp.partition, tp.row, props, if_match, replace)};
+    cloud_table table_cred {token_table(tp, endpoint)};
     table_result update_result {table_cred.execute(op)};
     status_code status {static_cast<status_code> (update_result.http_status_code())};
     if (status == status_codes::NoContent || status == status_codes::OK)
@@ -151,11 +366,374 @@ status_code update_with_token (const http_request& message,
   }
   catch (const storage_exception& e)
   {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return status_codes::Forbidden;
-    else
-      return status_codes::InternalError;
+    return storage_error_status(e);
+  }
+}
+
+/*
+  Read partition/row from table, completing on the task scheduler
+
+  Storage and other exceptions are mapped to status codes inside the
+  continuation, so the returned task never throws and can be chained
+  directly by a handler that replies in a continuation.
+ */
+pplx::task<pair<status_code,table_entity>>
+read_entity_async (const cloud_table& table,
+                   const string& partition,
+                   const string& row) {
+  try {
+    table_operation op {table_operation::retrieve_entity(partition, row)};
+    return table.execute_async(op)
+      .then([] (pplx::task<table_result> t) -> pair<status_code,table_entity>
+      {
+        try {
+          table_result retrieve_result {t.get()};
+          if (retrieve_result.http_status_code() == status_codes::NotFound) {
+            return make_pair (status_codes::NotFound, table_entity{});
+          }
+          return make_pair (status_codes::OK, retrieve_result.entity());
+        }
+        catch (const storage_exception& e) {
+          return make_pair (storage_error_status(e), table_entity{});
+        }
+        catch (const std::exception& e) {
+          return make_pair (unexpected_error_status(e), table_entity{});
+        }
+      });
+  }
+  catch (const storage_exception& e) {
+    return pplx::task_from_result(make_pair (storage_error_status(e), table_entity{}));
+  }
+  catch (const std::exception& e) {
+    return pplx::task_from_result(make_pair (unexpected_error_status(e), table_entity{}));
+  }
+}
+
+/*
+  Merge or replace props into partition/row of table, completing on
+  the task scheduler. As with read_entity_async, the returned task
+  never throws.
+
+  The task yields the status and, if the write succeeded, the new
+  ETag of the entity.
+ */
+pplx::task<pair<status_code,string>>
+write_entity_async (const cloud_table& table,
+                    const string& partition,
+                    const string& row,
+                    const unordered_map<string,string>& props,
+                    const string& if_match,
+                    bool replace) {
+  try {
+    table_operation op {write_operation(partition, row, props, if_match, replace)};
+    return table.execute_async(op)
+      .then([] (pplx::task<table_result> t) -> pair<status_code,string>
+      {
+        try {
+          const table_result result {t.get()};
+          status_code status {static_cast<status_code> (result.http_status_code())};
+          if (status == status_codes::NoContent || status == status_codes::OK)
+            return make_pair (status_codes::OK, result.etag());
+          else
+            return make_pair (status, string {});
+        }
+        catch (const storage_exception& e) {
+          return make_pair (storage_error_status(e), string {});
+        }
+        catch (const std::exception& e) {
+          return make_pair (unexpected_error_status(e), string {});
+        }
+      });
+  }
+  catch (const storage_exception& e) {
+    return pplx::task_from_result(make_pair (storage_error_status(e), string {}));
+  }
+  catch (const std::exception& e) {
+    return pplx::task_from_result(make_pair (unexpected_error_status(e), string {}));
+  }
+}
+
+/*
+  Asynchronous version of read_with_token
+ */
+pplx::task<pair<status_code,table_entity>>
+read_with_token_async (const http_request& message,
+                       const string& endpoint) {
+  token_path tp {};
+  if ( ! split_token_path(message, tp)) {
+    return pplx::task_from_result(make_pair (status_codes::BadRequest, table_entity{}));
+  }
+
+  const status_code token_status {check_token(tp.token, tp.partition, tp.row, 'r')};
+  if (token_status != status_codes::OK) {
+    return pplx::task_from_result(make_pair (token_status, table_entity{}));
+  }
+
+  try {
+    return read_entity_async(token_table(tp, endpoint), tp.partition, tp.row);
+  }
+  catch (const std::exception& e) {
+    return pplx::task_from_result(make_pair (unexpected_error_status(e), table_entity{}));
+  }
+}
+
+/*
+  Asynchronous version of update_with_token
+ */
+pplx::task<status_code>
+update_with_token_async (const http_request& message,
+                         const string& endpoint,
+                         const unordered_map<string,string>& props,
+                         const string& if_match,
+                         bool replace) {
+  token_path tp {};
+  if ( ! split_token_path(message, tp)) {
+    return pplx::task_from_result(status_codes::BadRequest);
+  }
+
+  const status_code token_status {check_token(tp.token, tp.partition, tp.row, 'u')};
+  if (token_status != status_codes::OK) {
+    return pplx::task_from_result(token_status);
+  }
+
+  try {
+    return write_entity_async(token_table(tp, endpoint), tp.partition, tp.row, props, if_match, replace)
+      .then([] (pair<status_code,string> result)
+      {
+        return result.first;
+      });
+  }
+  catch (const std::exception& e) {
+    return pplx::task_from_result(unexpected_error_status(e));
+  }
+}
+
+/*
+  Claims of the session token in the Authorization header of message
+
+  Returns Unauthorized if the header is missing or the token does
+  not verify under signer, Forbidden if update is required and the
+  session is read-only.
+ */
+status_code check_session (const http_request& message,
+                           const SessionSigner& signer,
+                           bool update,
+                           session_claims& claims) {
+  const http_headers& headers {message.headers()};
+  auto authorization (headers.find("Authorization"));
+  if (authorization == headers.end() ||
+      ! signer.verify(bearer_token(authorization->second), claims))
+    return status_codes::Unauthorized;
+  if (update && ! claims.update)
+    return status_codes::Forbidden;
+  return status_codes::OK;
+}
+
+/*
+  Read-modify-write of one entity using a security token, retrying
+  when a concurrent writer changes the entity in between
+
+  mutate receives the entity as read and sets changes to the
+    properties to be merged. It returns false if no write is needed.
+  max_attempts bounds the number of read-modify-write cycles.
+
+  Each write is conditional on the ETag of the preceding read, so a
+  concurrent update is never silently overwritten: the cycle is
+  repeated against the new entity instead.
+
+  Returns: OK, the first non-retryable status, or PreconditionFailed
+    if every attempt conflicted.
+ */
+status_code modify_with_token (const http_request& message,
+                               const string& endpoint,
+                               const entity_mutator& mutate,
+                               int max_attempts) {
+  status_code status {status_codes::PreconditionFailed};
+  for (int attempt {0}; attempt < max_attempts; ++attempt) {
+    pair<status_code,table_entity> read {read_with_token(message, endpoint)};
+    if (read.first != status_codes::OK)
+      return read.first;
+
+    unordered_map<string,string> changes {};
+    if ( ! mutate(read.second, changes))
+      return status_codes::OK;
+
+    status = update_with_token(message, endpoint, changes, read.second.etag());
+    if (status != status_codes::PreconditionFailed)
+      return status;
+    cout << "ETag conflict, retrying" << endl;
+  }
+  return status;
+}
+
+/*
+  Storage limits on a batch: the whole request, and one string
+  property, which is stored as UTF-16 and so takes up to twice the
+  bytes of its UTF-8 text
+ */
+constexpr size_t max_batch_bytes {4u << 20};
+constexpr size_t max_property_bytes {64u << 10};
+// Allowance for the framing and headers of each operation in a batch
+constexpr size_t batch_operation_bytes {1024};
+
+/*
+  Apply the merges of one batch, setting the status of each row in
+  results and removing it from pending, or leaving it in pending to
+  be read and tried again if its entity changed since it was read.
+
+  If a batch of several merges fails, including because one of its
+  entities changed, the merges are made one at a time, so that one
+  bad or contended row does not fail the others. Only the rows that
+  changed again stay pending.
+ */
+void execute_merges (const cloud_table& table,
+                     const vector<table_entity>& merges,
+                     unordered_map<string,status_code>& results,
+                     unordered_set<string>& pending) {
+  table_batch_operation batch {};
+  for (const table_entity& entity : merges)
+    batch.merge_entity(entity);
+  status_code status {status_codes::OK};
+  try {
+    table.execute_batch(batch);
+  }
+  catch (const storage_exception& e) {
+    status = storage_error_status(e);
+  }
+  if (status == status_codes::OK || merges.size() == 1) {
+    if (status == status_codes::PreconditionFailed)
+      return;
+    for (const table_entity& entity : merges) {
+      results[entity.row_key()] = status;
+      pending.erase(entity.row_key());
+    }
+    return;
+  }
+
+  cout << (status == status_codes::PreconditionFailed ? "ETag conflict in batch" : "Batch failed")
+       << ", merging " << merges.size() << " rows singly" << endl;
+  for (const table_entity& entity : merges) {
+    status_code row_status {status_codes::OK};
+    try {
+      table.execute(table_operation::merge_entity(entity));
+    }
+    catch (const storage_exception& e) {
+      row_status = storage_error_status(e);
+    }
+    if (row_status == status_codes::PreconditionFailed)
+      continue;
+    results[entity.row_key()] = row_status;
+    pending.erase(entity.row_key());
+  }
+}
+
+/*
+  Append text to a string property of several entities of one
+  partition, in as few entity-group transactions as storage allows
+
+  appends maps each row to the text to append to its property; it
+    may name at most max_batch_size rows.
+
+  The entities are read by queries naming up to rows_per_query rows
+  each, as storage allows at most 15 comparisons in a filter. The
+  merges then go in batches of at most max_batch_bytes, each merge
+  conditional on the ETag just read: storage applies all of a
+  batch or none of it. A row whose property would grow past
+  max_property_bytes is left alone. A batch that fails is retried a
+  merge at a time, and only rows whose entities changed in between
+  are read and merged again, up to max_attempts times. So 100
+  appends cost 8 queries and 1 batch instead of 100 reads and 100
+  writes, and one contended row does not hold up the other 99.
+
+  Returns the status for each row: OK, NotFound if the entity does
+  not exist, RequestEntityTooLarge if the property would be too
+  long, PreconditionFailed if the entity kept changing, or the
+  status of the failed read or write.
+ */
+unordered_map<string,status_code>
+append_to_partition (const cloud_table& table,
+                     const string& partition,
+                     const string& property,
+                     const unordered_map<string,string>& appends,
+                     int max_attempts) {
+  constexpr size_t rows_per_query {14};
+  unordered_map<string,status_code> results {};
+  unordered_set<string> pending {};
+  for (const auto& a : appends) {
+    pending.insert (a.first);
+    results[a.first] = status_codes::PreconditionFailed;
+  }
+  const string in_partition {table_query::generate_filter_condition("PartitionKey",
+                               query_comparison_operator::equal, partition)};
+
+  for (int attempt {0}; attempt < max_attempts && ! pending.empty(); ++attempt) {
+    if (attempt > 0)
+      cout << "ETag conflict, retrying " << pending.size() << " rows" << endl;
+    const vector<string> rows (pending.begin(), pending.end());
+    vector<table_entity> found {};
+    try {
+      for (size_t first {0}; first < rows.size(); first += rows_per_query) {
+        string any_row {};
+        for (size_t r {first}; r < rows.size() && r < first + rows_per_query; ++r) {
+          const string is_row {table_query::generate_filter_condition("RowKey",
+                                 query_comparison_operator::equal, rows[r])};
+          any_row = any_row.empty() ? is_row :
+            table_query::combine_filter_conditions(any_row, query_logical_operator::op_or, is_row);
+        }
+        table_query query {};
+        query.set_filter_string(table_query::combine_filter_conditions(in_partition,
+                                  query_logical_operator::op_and, any_row));
+        table_query_iterator end;
+        for (table_query_iterator it {table.execute_query(query)}; it != end; ++it)
+          found.push_back (*it);
+      }
+    }
+    catch (const storage_exception& e) {
+      const status_code status {storage_error_status(e)};
+      for (const string& row : rows)
+        results[row] = status;
+      return results;
+    }
+
+    unordered_set<string> found_rows {};
+    for (const table_entity& current : found)
+      found_rows.insert (current.row_key());
+    for (const string& row : rows) {
+      if (found_rows.count(row) == 0) {
+        results[row] = status_codes::NotFound;
+        pending.erase(row);
+      }
+    }
+
+    // Merges in batches of at most max_batch_bytes, as estimated
+    vector<table_entity> merges {};
+    size_t batch_bytes {0};
+    for (const table_entity& current : found) {
+      string text {};
+      auto existing (current.properties().find(property));
+      if (existing != current.properties().end())
+        text = existing->second.str();
+      text += appends.at(current.row_key());
+      if (2 * text.size() > max_property_bytes) {
+        results[current.row_key()] = status_codes::RequestEntityTooLarge;
+        pending.erase(current.row_key());
+        continue;
+      }
+      const size_t bytes {2 * (text.size() + current.row_key().size() + partition.size() + property.size()) +
+                          batch_operation_bytes};
+      if ( ! merges.empty() && batch_bytes + bytes > max_batch_bytes) {
+        execute_merges(table, merges, results, pending);
+        merges.clear();
+        batch_bytes = 0;
+      }
+      table_entity entity {partition, current.row_key()};
+      entity.properties()[property] = entity_property {text};
+      entity.set_etag(current.etag());
+      merges.push_back (entity);
+      batch_bytes += bytes;
+    }
+    if ( ! merges.empty())
+      execute_merges(table, merges, results, pending);
   }
+  return results;
 }
@@ -1,13 +1,48 @@
 #ifndef ServerUtils_h
 #define ServerUtils_h
 
+#include <cstddef>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
+#include <cpprest/asyncrt_utils.h>
 #include <cpprest/http_listener.h>
 
+#include <pplx/pplxtasks.h>
+
 #include <was/table.h>
 
+#include "SessionToken.h"
+
+/*
+  Scope, permissions, and expiry of a shared access signature,
+  parsed from the query parameters of the token.
+ */
+struct token_scope {
+  utility::datetime expiry;
+  std::string start_partition;
+  std::string start_row;
+  std::string end_partition;
+  std::string end_row;
+  std::string permissions;
+  // Whether the token has "sp"; without it, a stored policy decides
+  bool has_permissions;
+
+  bool expired () const;
+  bool allows (char permission) const;
+  bool covers (const std::string& partition, const std::string& row) const;
+};
+
+token_scope parse_token (const std::string& token);
+
+web::http::status_code
+check_token (const std::string& token,
+             const std::string& partition,
+             const std::string& row,
+             char permission);
+
 std::pair<web::http::status_code,azure::storage::table_entity>
 read_with_token(const web::http::http_request& message,
                 const std::string& endpoint);
@@ -16,5 +51,57 @@ read_with_token(const web::http::http_request& message,
 web::http::status_code
 update_with_token (const web::http::http_request& message,
                    const std::string& endpoint,
-                   const std::unordered_map<std::string,std::string>& props);
+                   const std::unordered_map<std::string,std::string>& props,
+                   const std::string& if_match = std::string {},
+                   bool replace = false);
+
+pplx::task<std::pair<web::http::status_code,azure::storage::table_entity>>
+read_with_token_async (const web::http::http_request& message,
+                       const std::string& endpoint);
+
+pplx::task<web::http::status_code>
+update_with_token_async (const web::http::http_request& message,
+                         const std::string& endpoint,
+                         const std::unordered_map<std::string,std::string>& props,
+                         const std::string& if_match = std::string {},
+                         bool replace = false);
+
+pplx::task<std::pair<web::http::status_code,azure::storage::table_entity>>
+read_entity_async (const azure::storage::cloud_table& table,
+                   const std::string& partition,
+                   const std::string& row);
+
+pplx::task<std::pair<web::http::status_code,std::string>>
+write_entity_async (const azure::storage::cloud_table& table,
+                    const std::string& partition,
+                    const std::string& row,
+                    const std::unordered_map<std::string,std::string>& props,
+                    const std::string& if_match = std::string {},
+                    bool replace = false);
+
+web::http::status_code
+check_session (const web::http::http_request& message,
+               const SessionSigner& signer,
+               bool update,
+               session_claims& claims);
+
+using entity_mutator =
+  std::function<bool (const azure::storage::table_entity&,
+                      std::unordered_map<std::string,std::string>&)>;
+
+web::http::status_code
+modify_with_token (const web::http::http_request& message,
+                   const std::string& endpoint,
+                   const entity_mutator& mutate,
+                   int max_attempts = 5);
+
+// Most entities in one entity-group transaction
+constexpr std::size_t max_batch_size {100};
+
+std::unordered_map<std::string,web::http::status_code>
+append_to_partition (const azure::storage::cloud_table& table,
+                     const std::string& partition,
+                     const std::string& property,
+                     const std::unordered_map<std::string,std::string>& appends,
+                     int max_attempts = 5);
 #endif
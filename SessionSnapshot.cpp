@@ -0,0 +1,239 @@
+#include "SessionSnapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::int64_t;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::unordered_set;
+
+namespace {
+  const char magic[4] {'U', 'S', 'S', '1'};
+
+  struct snapshot_header {
+    char magic[4];
+    uint32_t record_size;
+    int64_t written_at;
+    uint64_t count;
+  };
+
+  struct record_header {
+    uint32_t userid_size;
+    uint32_t token_size;
+    uint32_t partition_size;
+    uint32_t row_size;
+    int64_t idle_left;
+    int64_t absolute_left;
+  };
+
+  int64_t unix_now () {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  void append (string& buffer, const void* data, size_t size) {
+    buffer.append (static_cast<const char*>(data), size);
+  }
+
+  bool write_all (int fd, const string& buffer) {
+    const char* p {buffer.data()};
+    size_t left {buffer.size()};
+    while (left > 0) {
+      const ssize_t written {::write(fd, p, left)};
+      if (written < 0)
+        return false;
+      p += written;
+      left -= static_cast<size_t>(written);
+    }
+    return true;
+  }
+
+  // Sign-offs since the last snapshot, and those since the one before
+  string journal_path (const string& path) { return path + ".signoff"; }
+  string old_journal_path (const string& path) { return path + ".signoff.old"; }
+
+  // Held while appending to a journal and while moving it aside
+  std::mutex journal_lock {};
+
+  /*
+    Add the tokens in the journal at path to revoked. A record cut
+    short by a crash ends the journal.
+   */
+  void read_journal (const string& path, unordered_set<string>& revoked) {
+    const int fd {::open(path.c_str(), O_RDONLY)};
+    if (fd < 0)
+      return;
+    string journal {};
+    char chunk[65536];
+    ssize_t got {0};
+    while ((got = ::read(fd, chunk, sizeof chunk)) > 0)
+      journal.append (chunk, static_cast<size_t>(got));
+    ::close (fd);
+
+    size_t p {0};
+    uint32_t token_size {0};
+    while (journal.size() - p >= sizeof token_size) {
+      std::memcpy (&token_size, &journal[p], sizeof token_size);
+      p += sizeof token_size;
+      if (journal.size() - p < token_size)
+        break;
+      revoked.insert (journal.substr(p, token_size));
+      p += token_size;
+    }
+  }
+}
+
+/*
+  The whole snapshot is built in memory first, so the store's
+  shards are locked only while they are copied, never during I/O.
+ */
+bool save_session_snapshot (SessionStore& store, const string& path) {
+  /*
+    Every sign-off in the journal was made before the store is
+    copied, so none of its sessions can be in this snapshot. If an
+    earlier save failed the journal it moved aside is kept, and the
+    current one stays where it is.
+   */
+  {
+    std::lock_guard<std::mutex> guard {journal_lock};
+    if (::access(old_journal_path(path).c_str(), F_OK) != 0)
+      std::rename (journal_path(path).c_str(), old_journal_path(path).c_str());
+  }
+
+  string buffer (sizeof(snapshot_header), '\0');
+  uint64_t count {0};
+  store.for_each ([&buffer, &count] (const string& userid,
+                                     const user_session& session,
+                                     std::chrono::seconds idle_left,
+                                     std::chrono::seconds absolute_left)
+  {
+    const record_header r {static_cast<uint32_t>(userid.size()),
+                           static_cast<uint32_t>(session.token.size()),
+                           static_cast<uint32_t>(session.partition.size()),
+                           static_cast<uint32_t>(session.row.size()),
+                           static_cast<int64_t>(idle_left.count()),
+                           static_cast<int64_t>(absolute_left.count())};
+    append (buffer, &r, sizeof r);
+    buffer += userid;
+    buffer += session.token;
+    buffer += session.partition;
+    buffer += session.row;
+    ++count;
+  });
+
+  snapshot_header h {};
+  std::memcpy (h.magic, magic, sizeof magic);
+  h.record_size = sizeof(record_header);
+  h.written_at = unix_now();
+  h.count = count;
+  std::memcpy (&buffer[0], &h, sizeof h);
+
+  const string temp_path {path + ".tmp"};
+  const int fd {::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)};
+  if (fd < 0)
+    return false;
+  const bool written {write_all(fd, buffer) && ::fsync(fd) == 0};
+  ::close (fd);
+  if ( ! written || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove (temp_path.c_str());
+    return false;
+  }
+  std::remove (old_journal_path(path).c_str());
+  return true;
+}
+
+/*
+  Tokens are unique to a sign-on, so a record never ends a later
+  session of the same user.
+ */
+bool journal_sign_off (const string& path, const user_session& session) {
+  const uint32_t token_size {static_cast<uint32_t>(session.token.size())};
+  string record {};
+  append (record, &token_size, sizeof token_size);
+  record += session.token;
+
+  std::lock_guard<std::mutex> guard {journal_lock};
+  const int fd {::open(journal_path(path).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600)};
+  if (fd < 0)
+    return false;
+  const bool written {write_all(fd, record) && ::fdatasync(fd) == 0};
+  ::close (fd);
+  return written;
+}
+
+long load_session_snapshot (SessionStore& store, const string& path) {
+  const int fd {::open(path.c_str(), O_RDONLY)};
+  if (fd < 0)
+    return -1;
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(snapshot_header)) {
+    ::close (fd);
+    return -1;
+  }
+  const size_t size {static_cast<size_t>(st.st_size)};
+  void* mapping {::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+  ::close (fd);
+  if (mapping == MAP_FAILED)
+    return -1;
+  ::madvise (mapping, size, MADV_SEQUENTIAL);
+
+  const char* const begin {static_cast<const char*>(mapping)};
+  const char* const end {begin + size};
+  snapshot_header h {};
+  std::memcpy (&h, begin, sizeof h);
+  if (std::memcmp(h.magic, magic, sizeof magic) != 0 || h.record_size != sizeof(record_header)) {
+    ::munmap (mapping, size);
+    return -1;
+  }
+
+  unordered_set<string> revoked {};
+  read_journal (old_journal_path(path), revoked);
+  read_journal (journal_path(path), revoked);
+
+  const int64_t downtime {std::max (int64_t {0}, unix_now() - h.written_at)};
+  long restored {0};
+  const char* p {begin + sizeof h};
+  for (uint64_t i {0}; i < h.count; ++i) {
+    record_header r {};
+    if (static_cast<size_t>(end - p) < sizeof r)
+      break;
+    std::memcpy (&r, p, sizeof r);
+    p += sizeof r;
+    const size_t strings {size_t {r.userid_size} + r.token_size + r.partition_size + r.row_size};
+    if (static_cast<size_t>(end - p) < strings)
+      break;
+
+    string userid (p, r.userid_size);
+    p += r.userid_size;
+    user_session session {string (p, r.token_size), string {}, string {}};
+    p += r.token_size;
+    session.partition.assign (p, r.partition_size);
+    p += r.partition_size;
+    session.row.assign (p, r.row_size);
+    p += r.row_size;
+
+    if (r.idle_left > downtime && r.absolute_left > downtime && revoked.count(session.token) == 0) {
+      store.restore (userid, session,
+                     std::chrono::seconds {r.idle_left - downtime},
+                     std::chrono::seconds {r.absolute_left - downtime});
+      ++restored;
+    }
+  }
+  ::munmap (mapping, size);
+  return restored;
+}
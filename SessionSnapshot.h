@@ -0,0 +1,40 @@
+#ifndef SessionSnapshot_h
+#define SessionSnapshot_h
+
+#include <string>
+
+#include "SessionStore.h"
+
+/*
+  Snapshots of a SessionStore, so that UserServer can restart
+  without making every signed-on user sign on again
+
+  A snapshot is one binary file: a header with the wall-clock time
+  it was written, then for each session the lengths of its four
+  strings, its remaining idle and absolute time, and the strings.
+  The file is written beside path and renamed over it, so a crash
+  mid-write leaves the previous snapshot intact.
+
+  The loader maps the file and restores the sessions straight from
+  the mapping, after taking off the time since the snapshot was
+  written; sessions that ended meanwhile are skipped. The format is
+  native-endian, for restarts on the same host.
+
+  A session signed off since the last snapshot is still in it, so
+  each SignOff appends the session's token to a journal beside path.
+  The loader skips sessions whose token is in the journal. Saving a
+  snapshot moves the journal aside first and deletes it once the new
+  snapshot is in place, as the sessions it names are no longer in
+  the store by then.
+ */
+
+// Returns false if the file could not be written
+bool save_session_snapshot (SessionStore& store, const std::string& path);
+
+// Record that session was signed off; returns false if the journal could not be written
+bool journal_sign_off (const std::string& path, const user_session& session);
+
+// Returns the number of sessions restored, or -1 if path is missing or not a valid snapshot
+long load_session_snapshot (SessionStore& store, const std::string& path);
+
+#endif
@@ -0,0 +1,200 @@
+#include "SessionStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+SessionStore::SessionStore (std::chrono::seconds idle_timeout,
+                            std::chrono::seconds absolute_timeout,
+                            size_t expected_sessions) :
+  shards {},
+  epoch {clock::now()},
+  idle_ticks {static_cast<uint64_t>(idle_timeout.count())},
+  absolute_ticks {static_cast<uint64_t>(absolute_timeout.count())},
+  next_generation {0},
+  wheel {},
+  expired_per_tick {},
+  wheel_lock {},
+  expired {0}
+{
+  for (shard& s : shards)
+    s.sessions.reserve (expected_sessions / shard_count);
+}
+
+/*
+  The top bits of the hash pick the shard, leaving the low bits,
+  which unordered_map uses for its buckets, evenly spread within it.
+ */
+SessionStore::shard& SessionStore::shard_for (const string& userid) {
+  const size_t h {std::hash<string> {}(userid)};
+  return shards[(h >> (8 * sizeof h - 6)) % shard_count];
+}
+
+/*
+  Whole seconds since the store was created
+ */
+uint64_t SessionStore::tick () const {
+  return static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::seconds>(clock::now() - epoch).count());
+}
+
+uint64_t SessionStore::deadline (const entry& e) const {
+  return std::min (e.idle_deadline, e.absolute_deadline);
+}
+
+bool SessionStore::find (const string& userid, user_session& session) {
+  const uint64_t now {tick()};
+  shard& s (shard_for(userid));
+  scoped_critical_section_t lock {s.lock};
+
+  auto e (s.sessions.find(userid));
+  if (e == s.sessions.end() || deadline(e->second) <= now)
+    return false;
+  e->second.idle_deadline = now + idle_ticks;
+  session = e->second.session;
+  return true;
+}
+
+void SessionStore::insert (const string& userid, const user_session& session) {
+  const uint64_t now {tick()};
+  put (userid, session, now + idle_ticks, now + absolute_ticks);
+}
+
+void SessionStore::restore (const string& userid,
+                            const user_session& session,
+                            std::chrono::seconds idle_left,
+                            std::chrono::seconds absolute_left) {
+  if (idle_left.count() <= 0 || absolute_left.count() <= 0)
+    return;
+  const uint64_t now {tick()};
+  put (userid, session,
+       now + std::min (static_cast<uint64_t>(idle_left.count()), idle_ticks),
+       now + std::min (static_cast<uint64_t>(absolute_left.count()), absolute_ticks));
+}
+
+void SessionStore::put (const string& userid,
+                        const user_session& session,
+                        uint64_t idle_deadline,
+                        uint64_t absolute_deadline) {
+  const uint64_t generation {++next_generation};
+  entry e {session, idle_deadline, absolute_deadline, generation};
+  const uint64_t due {deadline(e)};
+  {
+    shard& s (shard_for(userid));
+    scoped_critical_section_t lock {s.lock};
+    s.sessions[userid] = std::move(e);
+  }
+  scoped_critical_section_t lock {wheel_lock};
+  wheel.schedule (wheel_timer {userid, generation, due});
+}
+
+/*
+  The session's timer stays in the wheel and is discarded when it
+  fires, as its generation no longer matches.
+ */
+bool SessionStore::erase (const string& userid) {
+  shard& s (shard_for(userid));
+  scoped_critical_section_t lock {s.lock};
+
+  return s.sessions.erase(userid) == 1;
+}
+
+bool SessionStore::erase (const string& userid, user_session& session) {
+  shard& s (shard_for(userid));
+  scoped_critical_section_t lock {s.lock};
+
+  auto e (s.sessions.find(userid));
+  if (e == s.sessions.end())
+    return false;
+  session = std::move(e->second.session);
+  s.sessions.erase (e);
+  return true;
+}
+
+/*
+  Timers fire by tick, with the wheel locked only while it advances
+  and while rescheduling. A fired timer ends its session only if the
+  session is the one it was set for and its deadline has passed;
+  a session used since the timer was set gets a new timer instead.
+ */
+unsigned long SessionStore::expire () {
+  const uint64_t now {tick()};
+  vector<wheel_timer> due {};
+  {
+    scoped_critical_section_t lock {wheel_lock};
+    const uint64_t from {wheel.now()};
+    for (uint64_t t {from + 1}; t <= now && t <= from + rate_window; ++t)
+      expired_per_tick[t % rate_window] = 0;
+    wheel.advance (now, due);
+  }
+
+  unsigned long ended {0};
+  vector<wheel_timer> again {};
+  for (wheel_timer& timer : due) {
+    shard& s (shard_for(timer.key));
+    scoped_critical_section_t lock {s.lock};
+
+    auto e (s.sessions.find(timer.key));
+    if (e == s.sessions.end() || e->second.generation != timer.generation)
+      continue;
+    const uint64_t when {deadline(e->second)};
+    if (when <= now) {
+      s.sessions.erase (e);
+      ++ended;
+    }
+    else {
+      timer.deadline = when;
+      again.push_back (std::move(timer));
+    }
+  }
+
+  scoped_critical_section_t lock {wheel_lock};
+  for (wheel_timer& timer : again)
+    wheel.schedule (std::move(timer));
+  expired_per_tick[now % rate_window] += ended;
+  expired += ended;
+  return ended;
+}
+
+void SessionStore::for_each (const session_visitor& visit) {
+  const uint64_t now {tick()};
+  for (shard& s : shards) {
+    scoped_critical_section_t lock {s.lock};
+    for (const auto& e : s.sessions) {
+      if (deadline(e.second) <= now)
+        continue;
+      visit (e.first, e.second.session,
+             std::chrono::seconds {static_cast<long long>(e.second.idle_deadline - now)},
+             std::chrono::seconds {static_cast<long long>(e.second.absolute_deadline - now)});
+    }
+  }
+}
+
+size_t SessionStore::size () {
+  size_t total {0};
+  for (shard& s : shards) {
+    scoped_critical_section_t lock {s.lock};
+    total += s.sessions.size();
+  }
+  return total;
+}
+
+unsigned long SessionStore::expired_last_minute () {
+  scoped_critical_section_t lock {wheel_lock};
+  unsigned long total {0};
+  for (unsigned long n : expired_per_tick)
+    total += n;
+  return total;
+}
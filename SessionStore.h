@@ -0,0 +1,110 @@
+#ifndef SessionStore_h
+#define SessionStore_h
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include <pplx/pplxtasks.h>
+
+#include "TimingWheel.h"
+
+/*
+  What UserServer keeps about a signed-on user: the session token
+  from SignOn and the coordinates of the user's DataTable entity
+ */
+struct user_session {
+  std::string token;
+  std::string partition;
+  std::string row;
+};
+
+/*
+  Signed-on users, keyed by userid
+
+  cpprest runs handlers on many threads at once, so the map is split
+  into shards, each an unordered_map with its own lock. Lookup,
+  insert, and erase touch only the shard of their userid, and users
+  in different shards never contend.
+
+  A session ends idle_timeout after its last use, or absolute_timeout
+  after sign-on, whichever comes first. An ended session is never
+  returned by find; expire() removes it. Each session has one timer
+  in a TimingWheel with one-second ticks. A use only records the
+  time, and a timer that fires early is simply set again for the
+  session's real deadline.
+ */
+class SessionStore {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t shard_count {64};
+  static constexpr std::size_t rate_window {60};
+
+private:
+  struct entry {
+    user_session session;
+    std::uint64_t idle_deadline;
+    std::uint64_t absolute_deadline;
+    std::uint64_t generation;
+  };
+  struct shard {
+    std::unordered_map<std::string,entry> sessions;
+    pplx::extensibility::critical_section_t lock;
+  };
+
+  std::array<shard,shard_count> shards;
+  const clock::time_point epoch;
+  const std::uint64_t idle_ticks;
+  const std::uint64_t absolute_ticks;
+  std::atomic<std::uint64_t> next_generation;
+
+  TimingWheel wheel;
+  std::array<unsigned long,rate_window> expired_per_tick;
+  pplx::extensibility::critical_section_t wheel_lock;
+  std::atomic<unsigned long> expired;
+
+  shard& shard_for (const std::string& userid);
+  std::uint64_t tick () const;
+  std::uint64_t deadline (const entry& e) const;
+  void put (const std::string& userid, const user_session& session,
+            std::uint64_t idle_deadline, std::uint64_t absolute_deadline);
+
+public:
+  // expected_sessions presizes the shards to avoid rehashing under load
+  SessionStore (std::chrono::seconds idle_timeout,
+                std::chrono::seconds absolute_timeout,
+                std::size_t expected_sessions = 0);
+
+  // Marks the session as used, restarting its idle timeout
+  bool find (const std::string& userid, user_session& session);
+  // Replaces any session userid already has
+  void insert (const std::string& userid, const user_session& session);
+  bool erase (const std::string& userid);
+  // As erase, copying the ended session into session
+  bool erase (const std::string& userid, user_session& session);
+  // As insert, for a session with only the given time left;
+  // a session with no time left is ignored
+  void restore (const std::string& userid, const user_session& session,
+                std::chrono::seconds idle_left, std::chrono::seconds absolute_left);
+
+  using session_visitor =
+    std::function<void (const std::string& userid, const user_session& session,
+                        std::chrono::seconds idle_left, std::chrono::seconds absolute_left)>;
+  // Call visit for every live session, locking one shard at a time
+  void for_each (const session_visitor& visit);
+
+  // Remove sessions that have ended, returning how many
+  unsigned long expire ();
+
+  std::size_t size ();
+  unsigned long expired_count () const { return expired; }
+  // Sessions expired per minute, over the last rate_window ticks
+  unsigned long expired_last_minute ();
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "SessionToken.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+using std::int64_t;
+using std::size_t;
+using std::uint32_t;
+using std::string;
+using std::vector;
+
+namespace {
+  constexpr char separator {'\x1f'};
+  constexpr const char* format_version {"1"};
+
+  const char base64url_chars[] {
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"};
+
+  int base64url_value (char c) {
+    if (c >= 'A' && c <= 'Z')
+      return c - 'A';
+    if (c >= 'a' && c <= 'z')
+      return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+      return c - '0' + 52;
+    if (c == '-')
+      return 62;
+    if (c == '_')
+      return 63;
+    return -1;
+  }
+
+  void append_field (string& payload, const string& field) {
+    if (field.find(separator) != string::npos)
+      throw std::invalid_argument {"session claim contains separator"};
+    payload.push_back (separator);
+    payload += field;
+  }
+
+  vector<string> split_fields (const string& payload) {
+    vector<string> fields {};
+    string::size_type start {0};
+    for (;;) {
+      const string::size_type end {payload.find(separator, start)};
+      if (end == string::npos) {
+        fields.push_back (payload.substr(start));
+        return fields;
+      }
+      fields.push_back (payload.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+}
+
+/*
+  Unpadded base64url, as used in URLs and headers
+ */
+string base64url_encode (const unsigned char* data, size_t size) {
+  string result {};
+  result.reserve ((size * 4 + 2) / 3);
+  size_t i {0};
+  for (; i + 2 < size; i += 3) {
+    const uint32_t n {(uint32_t {data[i]} << 16) | (uint32_t {data[i + 1]} << 8) | data[i + 2]};
+    result.push_back (base64url_chars[(n >> 18) & 63]);
+    result.push_back (base64url_chars[(n >> 12) & 63]);
+    result.push_back (base64url_chars[(n >> 6) & 63]);
+    result.push_back (base64url_chars[n & 63]);
+  }
+  if (i + 1 == size) {
+    const uint32_t n {uint32_t {data[i]} << 16};
+    result.push_back (base64url_chars[(n >> 18) & 63]);
+    result.push_back (base64url_chars[(n >> 12) & 63]);
+  }
+  else if (i + 2 == size) {
+    const uint32_t n {(uint32_t {data[i]} << 16) | (uint32_t {data[i + 1]} << 8)};
+    result.push_back (base64url_chars[(n >> 18) & 63]);
+    result.push_back (base64url_chars[(n >> 12) & 63]);
+    result.push_back (base64url_chars[(n >> 6) & 63]);
+  }
+  return result;
+}
+
+bool base64url_decode (const string& text, string& out) {
+  out.clear ();
+  out.reserve (text.size() * 3 / 4);
+  uint32_t bits {0};
+  int count {0};
+  for (char c : text) {
+    const int v {base64url_value(c)};
+    if (v < 0)
+      return false;
+    bits = (bits << 6) | static_cast<uint32_t>(v);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out.push_back (static_cast<char>((bits >> count) & 0xff));
+    }
+  }
+  // A lone trailing character cannot encode a whole byte
+  return count < 6;
+}
+
+void SessionSigner::md_ctx_deleter::operator() (EVP_MD_CTX* ctx) const {
+  EVP_MD_CTX_free (ctx);
+}
+
+/*
+  Precompute the HMAC states H(key ^ ipad) and H(key ^ opad)
+  (RFC 2104), which every mac then continues from.
+ */
+SessionSigner::SessionSigner (const string& signing_key) :
+  inner {EVP_MD_CTX_new()},
+  outer {EVP_MD_CTX_new()}
+{
+  if (signing_key.empty())
+    throw std::invalid_argument {"session signing key is empty"};
+  if ( ! inner || ! outer)
+    throw std::bad_alloc {};
+
+  unsigned char block[SHA256_CBLOCK] {};
+  if (signing_key.size() > sizeof block) {
+    unsigned int size {0};
+    EVP_Digest (signing_key.data(), signing_key.size(), block, &size, EVP_sha256(), nullptr);
+  }
+  else {
+    std::memcpy (block, signing_key.data(), signing_key.size());
+  }
+
+  unsigned char pad[SHA256_CBLOCK];
+  for (size_t i {0}; i < sizeof pad; ++i)
+    pad[i] = block[i] ^ 0x36;
+  EVP_DigestInit_ex (inner.get(), EVP_sha256(), nullptr);
+  EVP_DigestUpdate (inner.get(), pad, sizeof pad);
+  for (size_t i {0}; i < sizeof pad; ++i)
+    pad[i] = block[i] ^ 0x5c;
+  EVP_DigestInit_ex (outer.get(), EVP_sha256(), nullptr);
+  EVP_DigestUpdate (outer.get(), pad, sizeof pad);
+  OPENSSL_cleanse (block, sizeof block);
+  OPENSSL_cleanse (pad, sizeof pad);
+}
+
+/*
+  Each thread continues from the keyed states in a context of its
+  own, so concurrent handlers share nothing mutable.
+ */
+string SessionSigner::mac (const char* data, size_t size) const {
+  thread_local md_ctx_ptr work {EVP_MD_CTX_new()};
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size {0};
+
+  EVP_MD_CTX_copy_ex (work.get(), inner.get());
+  EVP_DigestUpdate (work.get(), data, size);
+  EVP_DigestFinal_ex (work.get(), digest, &digest_size);
+
+  EVP_MD_CTX_copy_ex (work.get(), outer.get());
+  EVP_DigestUpdate (work.get(), digest, digest_size);
+  EVP_DigestFinal_ex (work.get(), digest, &digest_size);
+  return base64url_encode (digest, digest_size);
+}
+
+string SessionSigner::sign (const session_claims& claims) const {
+  string payload {format_version};
+  append_field (payload, claims.userid);
+  append_field (payload, claims.partition);
+  append_field (payload, claims.row);
+  append_field (payload, std::to_string(claims.expiry));
+  append_field (payload, claims.update ? "u" : "r");
+
+  string token {base64url_encode(reinterpret_cast<const unsigned char*>(payload.data()), payload.size())};
+  const string signature {mac(token.data(), token.size())};
+  token.push_back ('.');
+  token += signature;
+  return token;
+}
+
+/*
+  The mac is checked before the payload is decoded, so a forged
+  token costs one HMAC and is never parsed.
+ */
+bool SessionSigner::verify (const string& token, int64_t now, session_claims& claims) const {
+  const string::size_type dot {token.find('.')};
+  if (dot == string::npos)
+    return false;
+  const string expected {mac(token.data(), dot)};
+  if (token.size() - dot - 1 != expected.size() ||
+      CRYPTO_memcmp(expected.data(), token.data() + dot + 1, expected.size()) != 0)
+    return false;
+
+  string payload {};
+  if ( ! base64url_decode(token.substr(0, dot), payload))
+    return false;
+  const vector<string> fields {split_fields(payload)};
+  if (fields.size() != 6 || fields[0] != format_version)
+    return false;
+
+  char* end {nullptr};
+  const int64_t expiry {std::strtoll(fields[4].c_str(), &end, 10)};
+  if (fields[4].empty() || *end != '\0' || expiry <= now)
+    return false;
+
+  claims = session_claims {fields[1], fields[2], fields[3], expiry, fields[5] == "u"};
+  return true;
+}
+
+bool SessionSigner::verify (const string& token, session_claims& claims) const {
+  return verify (token, session_now(), claims);
+}
+
+int64_t session_now () {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+string bearer_token (const string& authorization) {
+  const string scheme {"Bearer "};
+  if (authorization.compare(0, scheme.size(), scheme) != 0)
+    return string {};
+  return authorization.substr(scheme.size());
+}
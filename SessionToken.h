@@ -0,0 +1,76 @@
+#ifndef SessionToken_h
+#define SessionToken_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+/*
+  What a session token asserts: who the user is, which DataTable
+  entity holds their data, whether they may update it, and until
+  when (seconds since the Unix epoch).
+ */
+struct session_claims {
+  std::string userid;
+  std::string partition;
+  std::string row;
+  std::int64_t expiry;
+  bool update;
+};
+
+/*
+  Signs and verifies session tokens with HMAC-SHA256
+
+  A token is base64url(payload) "." base64url(mac), where the mac is
+  computed over the encoded payload. Every server holding the same
+  key can therefore check a token with one HMAC and no storage or
+  network access.
+
+  The HMAC inner and outer digest states are keyed once, at
+  construction, so each token costs two SHA-256 passes over its
+  payload and no key schedule.
+
+  sign throws std::invalid_argument if a claim contains the
+  separator character of the payload.
+ */
+class SessionSigner {
+private:
+  struct md_ctx_deleter {
+    void operator() (EVP_MD_CTX* ctx) const;
+  };
+  using md_ctx_ptr = std::unique_ptr<EVP_MD_CTX,md_ctx_deleter>;
+
+  md_ctx_ptr inner;
+  md_ctx_ptr outer;
+
+public:
+  explicit SessionSigner (const std::string& signing_key);
+
+  std::string sign (const session_claims& claims) const;
+
+  // False if the token is malformed, forged, or expired at now
+  bool verify (const std::string& token, std::int64_t now, session_claims& claims) const;
+  bool verify (const std::string& token, session_claims& claims) const;
+
+private:
+  std::string mac (const char* data, std::size_t size) const;
+};
+
+/*
+  Current time in the units of session_claims::expiry
+ */
+std::int64_t session_now ();
+
+/*
+  The token of an "Authorization: Bearer <token>" header value,
+  or an empty string if the value is not of that form.
+ */
+std::string bearer_token (const std::string& authorization);
+
+std::string base64url_encode (const unsigned char* data, std::size_t size);
+bool base64url_decode (const std::string& text, std::string& out);
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef ShardedTtlCache_h
+#define ShardedTtlCache_h
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Bounded map from Key to Value whose entries expire, shared by
+  many handler threads
+
+  The map is split into shards, each with its own lock, so that
+  concurrent requests for different keys rarely contend. Each entry
+  has its own expiry, set when it is inserted and moved by renew().
+  An expired entry is not returned by find(), but stays until it is
+  replaced or evicted, so find_any() can still hand it out for
+  revalidation.
+
+  A shard holds at most max_entries / shard_count + 1 entries. To
+  make room for a new key, one victim is evicted: of a few entries
+  sampled from a rotating bucket, the one that expires soonest, so
+  expired entries go first and live ones are rarely lost.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedTtlCache {
+public:
+  using clock = std::chrono::steady_clock;
+  static constexpr std::size_t shard_count {16};
+  static constexpr std::size_t victim_samples {8};
+
+private:
+  struct entry {
+    Value value;
+    clock::time_point expires;
+  };
+  struct shard {
+    std::unordered_map<Key,entry,Hash> entries;
+    std::size_t next_bucket;
+    pplx::extensibility::critical_section_t lock;
+
+    shard () : entries {}, next_bucket {0}, lock {} {}
+  };
+
+  std::array<shard,shard_count> shards;
+  std::size_t max_per_shard;
+
+  shard& shard_for (const Key& key) {
+    return shards[Hash {}(key) % shard_count];
+  }
+
+  /*
+    Called with the lock of s held, when s is full
+   */
+  void evict_one (shard& s) {
+    const std::size_t buckets {s.entries.bucket_count()};
+    const Key* victim {nullptr};
+    clock::time_point victim_expires {};
+    std::size_t sampled {0};
+    for (std::size_t n {0}; n < buckets && sampled < victim_samples; ++n) {
+      const std::size_t b {s.next_bucket++ % buckets};
+      for (auto e = s.entries.begin(b); e != s.entries.end(b) && sampled < victim_samples; ++e, ++sampled) {
+        if (victim == nullptr || e->second.expires < victim_expires) {
+          victim = &e->first;
+          victim_expires = e->second.expires;
+        }
+      }
+    }
+    if (victim != nullptr) {
+      // Copied, as erase must not be passed a key it is destroying
+      const Key doomed {*victim};
+      s.entries.erase(doomed);
+    }
+  }
+
+public:
+  explicit ShardedTtlCache (std::size_t max_entries) :
+    shards {},
+    max_per_shard {max_entries / shard_count + 1}
+    {}
+
+  ShardedTtlCache (const ShardedTtlCache&) = delete;
+  ShardedTtlCache& operator= (const ShardedTtlCache&) = delete;
+
+  // Copy the value of key into value; false if absent or expired
+  bool find (const Key& key, Value& value) {
+    bool fresh {false};
+    return find_any(key, value, fresh) && fresh;
+  }
+
+  // Copy the value of key into value, expired or not; fresh is set if not
+  bool find_any (const Key& key, Value& value, bool& fresh) {
+    shard& s (shard_for(key));
+    pplx::extensibility::scoped_critical_section_t guard {s.lock};
+    auto e (s.entries.find(key));
+    if (e == s.entries.end())
+      return false;
+    value = e->second.value;
+    fresh = clock::now() < e->second.expires;
+    return true;
+  }
+
+  // Set the value of key, to expire ttl from now
+  void insert (const Key& key, Value value, clock::duration ttl) {
+    shard& s (shard_for(key));
+    pplx::extensibility::scoped_critical_section_t guard {s.lock};
+    const clock::time_point expires {clock::now() + ttl};
+    auto e (s.entries.find(key));
+    if (e != s.entries.end()) {
+      e->second = entry {std::move(value), expires};
+      return;
+    }
+    if (s.entries.size() >= max_per_shard)
+      evict_one (s);
+    s.entries.emplace (key, entry {std::move(value), expires});
+  }
+
+  /*
+    Make the entry of key expire ttl from now, if it has one and
+    still_current(value) is true
+
+    Returns true if the entry was renewed.
+   */
+  template <typename Predicate>
+  bool renew (const Key& key, clock::duration ttl, Predicate still_current) {
+    shard& s (shard_for(key));
+    pplx::extensibility::scoped_critical_section_t guard {s.lock};
+    auto e (s.entries.find(key));
+    if (e == s.entries.end() || ! still_current(e->second.value))
+      return false;
+    e->second.expires = clock::now() + ttl;
+    return true;
+  }
+
+  bool erase (const Key& key) {
+    shard& s (shard_for(key));
+    pplx::extensibility::scoped_critical_section_t guard {s.lock};
+    return s.entries.erase(key) == 1;
+  }
+
+  // Entries held, including expired ones not yet evicted
+  std::size_t size () {
+    std::size_t total {0};
+    for (shard& s : shards) {
+      pplx::extensibility::scoped_critical_section_t guard {s.lock};
+      total += s.entries.size();
+    }
+    return total;
+  }
+};
+
+#endif
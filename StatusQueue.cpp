@@ -0,0 +1,330 @@
+#include "StatusQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+using std::int64_t;
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::unique_lock;
+
+namespace {
+  /*
+    Journal record: u32 size of the rest, type ('E' enqueued or 'D'
+    done), u64 seq, and for 'E' the i64 enqueue time and the five
+    strings of the update, each a u32 size and the bytes
+   */
+  constexpr char enqueued_record {'E'};
+  constexpr char done_record {'D'};
+
+  // Attempts at dispatching an update that fails with 5xx or an exception
+  constexpr int max_attempts {3};
+
+  int64_t unix_ms () {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  void append_raw (string& out, const void* data, size_t size) {
+    out.append (static_cast<const char*>(data), size);
+  }
+
+  void append_string (string& out, const string& s) {
+    const uint32_t size {static_cast<uint32_t>(s.size())};
+    append_raw (out, &size, sizeof size);
+    out += s;
+  }
+
+  bool read_raw (const string& in, size_t& at, void* out, size_t size) {
+    if (in.size() - at < size)
+      return false;
+    std::memcpy (out, in.data() + at, size);
+    at += size;
+    return true;
+  }
+
+  bool read_string (const string& in, size_t& at, string& s) {
+    uint32_t size {0};
+    if ( ! read_raw(in, at, &size, sizeof size) || in.size() - at < size)
+      return false;
+    s.assign (in, at, size);
+    at += size;
+    return true;
+  }
+}
+
+StatusQueue::StatusQueue (const string& journal, size_t max_depth,
+                          size_t dispatcher_threads, dispatch_function deliver) :
+  capacity {max_depth},
+  dispatch {std::move(deliver)},
+  lanes (dispatcher_threads > 0 ? dispatcher_threads : 1),
+  dispatchers {},
+  lock {},
+  stopping {false},
+  depth {0},
+  journal_path {journal},
+  journal_fd {-1},
+  next_seq {1},
+  sync_lock {},
+  synced_seq {0},
+  enqueued {0},
+  rejected {0},
+  dispatched {0},
+  failures {0},
+  last_lag {0},
+  max_lag {0},
+  total_lag {0}
+{
+  if ( ! journal_path.empty()) {
+    journal_fd = ::open(journal_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal_fd < 0)
+      cout << "StatusQueue: cannot open " << journal_path << ", queueing in memory only" << endl;
+    else
+      replay();
+  }
+  for (size_t l {0}; l < lanes.size(); ++l)
+    dispatchers.emplace_back (&StatusQueue::run, this, l);
+}
+
+StatusQueue::~StatusQueue () {
+  stop();
+  if (journal_fd >= 0)
+    ::close (journal_fd);
+}
+
+size_t StatusQueue::lane_for (const string& userid) const {
+  return std::hash<string> {}(userid) % lanes.size();
+}
+
+/*
+  Queue the updates the journal holds without a done marker, in the
+  order they were first enqueued. A record cut short by a crash ends
+  the journal, and is cut off so that appends follow whole records.
+ */
+void StatusQueue::replay () {
+  string contents {};
+  char buffer[1 << 16];
+  ssize_t n {0};
+  while ((n = ::pread(journal_fd, buffer, sizeof buffer, static_cast<off_t>(contents.size()))) > 0)
+    contents.append (buffer, static_cast<size_t>(n));
+
+  std::map<uint64_t,status_update> pending {};
+  size_t at {0};
+  size_t good {0};
+  while (at < contents.size()) {
+    uint32_t size {0};
+    if ( ! read_raw(contents, at, &size, sizeof size) || contents.size() - at < size)
+      break;
+    const string record (contents, at, size);
+    at += size;
+    size_t r {0};
+    char type {0};
+    uint64_t seq {0};
+    if ( ! read_raw(record, r, &type, sizeof type) || ! read_raw(record, r, &seq, sizeof seq))
+      break;
+    if (type == enqueued_record) {
+      status_update u {};
+      if ( ! read_raw(record, r, &u.enqueued_at, sizeof u.enqueued_at) ||
+           ! read_string(record, r, u.userid) || ! read_string(record, r, u.partition) ||
+           ! read_string(record, r, u.row) || ! read_string(record, r, u.status) ||
+           ! read_string(record, r, u.friends))
+        break;
+      pending[seq] = std::move(u);
+    }
+    else {
+      pending.erase(seq);
+    }
+    if (seq >= next_seq)
+      next_seq = seq + 1;
+    good = at;
+  }
+
+  if (pending.empty())
+    good = 0;
+  if (good < contents.size() && ::ftruncate(journal_fd, static_cast<off_t>(good)) != 0)
+    cout << "StatusQueue: cannot truncate " << journal_path << endl;
+  synced_seq = next_seq - 1;
+  for (auto& p : pending) {
+    lanes[lane_for(p.second.userid)].queue.push_back (queued {p.first, std::move(p.second), true});
+    ++depth;
+    ++enqueued;
+  }
+  if ( ! pending.empty())
+    cout << "StatusQueue: " << pending.size() << " status updates replayed from " << journal_path << endl;
+}
+
+/*
+  Called with lock held, so records are appended in seq order
+ */
+bool StatusQueue::append (char type, uint64_t seq, const status_update* update) {
+  if (journal_fd < 0)
+    return true;
+  string record {};
+  append_raw (record, &type, sizeof type);
+  append_raw (record, &seq, sizeof seq);
+  if (update != nullptr) {
+    append_raw (record, &update->enqueued_at, sizeof update->enqueued_at);
+    append_string (record, update->userid);
+    append_string (record, update->partition);
+    append_string (record, update->row);
+    append_string (record, update->status);
+    append_string (record, update->friends);
+  }
+  string frame {};
+  append_string (frame, record);
+  return ::write(journal_fd, frame.data(), frame.size()) == static_cast<ssize_t>(frame.size());
+}
+
+/*
+  Make every record up to seq durable. Whoever syncs first syncs all
+  that has been appended so far, and the rest find their record
+  already on disk. Returns false if the sync failed.
+ */
+bool StatusQueue::sync_to (uint64_t seq) {
+  if (journal_fd < 0)
+    return true;
+  unique_lock<std::mutex> sync_guard {sync_lock};
+  if (synced_seq >= seq)
+    return true;
+  uint64_t appended {0};
+  {
+    unique_lock<std::mutex> guard {lock};
+    appended = next_seq - 1;
+  }
+  if (::fdatasync(journal_fd) != 0) {
+    cout << "StatusQueue: cannot sync " << journal_path << endl;
+    return false;
+  }
+  synced_seq = appended;
+  return true;
+}
+
+/*
+  The update goes into its lane as it is journaled, under the same
+  lock, so a user's updates are in their lane in seq order. It is
+  dispatched only once marked durable, and taken out again if the
+  journal cannot be synced.
+ */
+bool StatusQueue::enqueue (status_update update) {
+  update.enqueued_at = unix_ms();
+  lane& l (lanes[lane_for(update.userid)]);
+  uint64_t seq {0};
+  {
+    unique_lock<std::mutex> guard {lock};
+    if (stopping || depth >= capacity || ! append(enqueued_record, next_seq, &update)) {
+      ++rejected;
+      return false;
+    }
+    seq = next_seq++;
+    ++depth;
+    l.queue.push_back (queued {seq, std::move(update), journal_fd < 0});
+  }
+  if (journal_fd < 0) {
+    l.ready.notify_one();
+    ++enqueued;
+    return true;
+  }
+
+  const bool synced {sync_to(seq)};
+  {
+    unique_lock<std::mutex> guard {lock};
+    auto mine (std::lower_bound(l.queue.begin(), l.queue.end(), seq,
+                                [] (const queued& q, uint64_t s) { return q.seq < s; }));
+    if (synced) {
+      mine->durable = true;
+    }
+    else {
+      l.queue.erase (mine);
+      --depth;
+      append(done_record, seq, nullptr);
+      ++rejected;
+    }
+  }
+  l.ready.notify_all();
+  if (synced)
+    ++enqueued;
+  return synced;
+}
+
+void StatusQueue::run (size_t l) {
+  lane& mine (lanes[l]);
+  unique_lock<std::mutex> guard {lock};
+  for (;;) {
+    mine.ready.wait (guard, [this, &mine] {
+      return stopping || ( ! mine.queue.empty() && mine.queue.front().durable);
+    });
+    // Updates left in the journal are dispatched on the next start
+    if (mine.queue.empty() || (stopping && journal_fd >= 0))
+      return;
+    queued item {std::move(mine.queue.front())};
+    mine.queue.pop_front();
+    guard.unlock();
+
+    const int64_t lag {unix_ms() - item.update.enqueued_at};
+    last_lag = lag;
+    total_lag += lag;
+    int64_t max {max_lag};
+    while (lag > max && ! max_lag.compare_exchange_weak(max, lag)) {}
+
+    unsigned short status {500};
+    for (int attempt {1}; attempt <= max_attempts; ++attempt) {
+      try {
+        status = dispatch(item.update);
+      }
+      catch (const std::exception& e) {
+        cout << "StatusQueue: dispatch for " << item.update.userid << " failed: " << e.what() << endl;
+        status = 500;
+      }
+      if (status < 500 || attempt == max_attempts)
+        break;
+      std::this_thread::sleep_for (std::chrono::milliseconds {100 * attempt});
+    }
+    ++dispatched;
+    if (status < 200 || status >= 300)
+      ++failures;
+
+    guard.lock();
+    append(done_record, item.seq, nullptr);
+    if (--depth == 0 && journal_fd >= 0 && ::ftruncate(journal_fd, 0) != 0)
+      cout << "StatusQueue: cannot truncate " << journal_path << endl;
+  }
+}
+
+void StatusQueue::stop () {
+  {
+    unique_lock<std::mutex> guard {lock};
+    stopping = true;
+  }
+  for (lane& l : lanes)
+    l.ready.notify_all();
+  for (std::thread& d : dispatchers)
+    d.join();
+  dispatchers.clear();
+}
+
+size_t StatusQueue::size () {
+  unique_lock<std::mutex> guard {lock};
+  return depth;
+}
+
+int64_t StatusQueue::mean_lag_ms () const {
+  const unsigned long count {dispatched};
+  return count == 0 ? 0 : total_lag / static_cast<int64_t>(count);
+}
@@ -0,0 +1,121 @@
+#ifndef StatusQueue_h
+#define StatusQueue_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+  A status a user has set, to be pushed to the user's friends
+ */
+struct status_update {
+  std::string userid;
+  std::string partition;
+  std::string row;
+  std::string status;
+  std::string friends;
+  // Unix time in milliseconds at which it was enqueued
+  std::int64_t enqueued_at;
+};
+
+/*
+  Bounded queue of status updates, with background dispatchers
+
+  enqueue() returns once the update is in the journal and synced to
+  disk, so UpdateStatus can acknowledge it without waiting for the
+  fan-out. A full queue refuses updates instead of growing.
+
+  Each dispatcher has its own FIFO, and a user's updates always go
+  to the same one, so they are dispatched in order. On completion a
+  done marker is appended to the journal; the journal is emptied
+  whenever the queue is. Updates still in the journal when the
+  server stops are dispatched again on the next start: delivery is
+  at least once.
+
+  Concurrent enqueuers share each sync of the journal, in the
+  manner of a group commit. An empty journal path keeps the queue in
+  memory only; it is then drained before stop() returns.
+ */
+class StatusQueue {
+public:
+  // Deliver the update, returning the HTTP status of the attempt
+  using dispatch_function = std::function<unsigned short (const status_update& update)>;
+
+private:
+  // An update in a lane, not dispatched until its record is synced
+  struct queued {
+    std::uint64_t seq;
+    status_update update;
+    bool durable;
+  };
+  // Updates in seq order
+  struct lane {
+    std::deque<queued> queue;
+    std::condition_variable ready;
+  };
+
+  const std::size_t capacity;
+  const dispatch_function dispatch;
+  std::vector<lane> lanes;
+  std::vector<std::thread> dispatchers;
+  std::mutex lock;
+  bool stopping;
+  // Updates queued or being dispatched
+  std::size_t depth;
+
+  const std::string journal_path;
+  int journal_fd;
+  std::uint64_t next_seq;
+  // Journal writes are ordered by seq; synced_seq is the last on disk
+  std::mutex sync_lock;
+  std::uint64_t synced_seq;
+
+  std::atomic<unsigned long> enqueued;
+  std::atomic<unsigned long> rejected;
+  std::atomic<unsigned long> dispatched;
+  std::atomic<unsigned long> failures;
+  std::atomic<std::int64_t> last_lag;
+  std::atomic<std::int64_t> max_lag;
+  std::atomic<std::int64_t> total_lag;
+
+  std::size_t lane_for (const std::string& userid) const;
+  void replay ();
+  bool append (char type, std::uint64_t seq, const status_update* update);
+  bool sync_to (std::uint64_t seq);
+  void run (std::size_t l);
+
+public:
+  StatusQueue (const std::string& journal, std::size_t max_depth,
+               std::size_t dispatcher_threads, dispatch_function deliver);
+  ~StatusQueue ();
+
+  StatusQueue (const StatusQueue&) = delete;
+  StatusQueue& operator= (const StatusQueue&) = delete;
+
+  // Returns false if the queue is full, stopped, or cannot be journaled
+  // and synced
+  bool enqueue (status_update update);
+  void stop ();
+
+  std::size_t size ();
+  std::size_t max_size () const { return capacity; }
+  // Updates replayed from the journal at startup are counted as enqueued
+  unsigned long enqueued_count () const { return enqueued; }
+  unsigned long rejected_count () const { return rejected; }
+  unsigned long dispatched_count () const { return dispatched; }
+  unsigned long failure_count () const { return failures; }
+  // Enqueue-to-dispatch lag, in milliseconds
+  std::int64_t last_lag_ms () const { return last_lag; }
+  std::int64_t max_lag_ms () const { return max_lag; }
+  std::int64_t mean_lag_ms () const;
+};
+
+#endif
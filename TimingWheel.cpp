@@ -0,0 +1,61 @@
+#include "TimingWheel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using std::size_t;
+using std::uint64_t;
+using std::vector;
+
+/*
+  Put timer in the lowest level whose slot for it has not yet been
+  reached: the level at which timer and current first share a slot
+  of the level above.
+ */
+void TimingWheel::place (wheel_timer&& timer) {
+  const unsigned range_bits {slot_bits * levels};
+  if (range_bits < 64 && (timer.deadline >> range_bits) != (current >> range_bits))
+    timer.deadline = current | ((uint64_t {1} << range_bits) - 1);
+
+  unsigned level {0};
+  while (level + 1 < levels &&
+         (timer.deadline >> (slot_bits * (level + 1))) != (current >> (slot_bits * (level + 1))))
+    ++level;
+  const size_t index {(timer.deadline >> (slot_bits * level)) & (slots - 1)};
+  wheels[level][index].push_back (std::move(timer));
+}
+
+void TimingWheel::schedule (wheel_timer timer) {
+  if (timer.deadline <= current)
+    timer.deadline = current + 1;
+  place (std::move(timer));
+  ++count;
+}
+
+/*
+  Each tick first cascades the slots that begin at the new tick,
+  from the top level down, so that a timer moved from level 2 into
+  a level 1 slot due now is moved on into level 0 in the same tick.
+  The level 0 slot then holds exactly the timers due at the tick.
+ */
+void TimingWheel::advance (uint64_t to, vector<wheel_timer>& due) {
+  while (current < to) {
+    ++current;
+    for (unsigned level {levels - 1}; level > 0; --level) {
+      if ((current & ((uint64_t {1} << (slot_bits * level)) - 1)) != 0)
+        continue;
+      slot moving {};
+      moving.swap (wheels[level][(current >> (slot_bits * level)) & (slots - 1)]);
+      for (wheel_timer& timer : moving)
+        place (std::move(timer));
+    }
+
+    slot& firing (wheels[0][current & (slots - 1)]);
+    count -= firing.size();
+    for (wheel_timer& timer : firing)
+      due.push_back (std::move(timer));
+    firing.clear ();
+  }
+}
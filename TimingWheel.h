@@ -0,0 +1,67 @@
+#ifndef TimingWheel_h
+#define TimingWheel_h
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  A timer set in a TimingWheel: key is due at tick deadline.
+  generation lets the owner recognize timers it has superseded.
+ */
+struct wheel_timer {
+  std::string key;
+  std::uint64_t generation;
+  std::uint64_t deadline;
+};
+
+/*
+  Hierarchical timing wheel
+
+  Level 0 has one slot per tick for the next 64 ticks; each higher
+  level has slots 64 times as wide. A timer is placed at the lowest
+  level whose slot still lies ahead, and is moved down a level when
+  the wheel reaches its slot. Scheduling is O(1), and each tick
+  costs only the timers in the slot that falls due, plus one
+  cascade every 64 ticks, instead of a scan of every timer.
+
+  A deadline beyond the range of the top level fires at the end of
+  that range; owners re-check every timer that falls due and
+  reschedule it if it is not really due yet.
+
+  Not thread-safe; the owner serializes calls.
+ */
+class TimingWheel {
+public:
+  static constexpr unsigned slot_bits {6};
+  static constexpr std::size_t slots {1u << slot_bits};
+  static constexpr unsigned levels {6};
+
+private:
+  using slot = std::vector<wheel_timer>;
+  std::array<std::array<slot,slots>,levels> wheels;
+  std::uint64_t current;
+  std::size_t count;
+
+  void place (wheel_timer&& timer);
+
+public:
+  explicit TimingWheel (std::uint64_t start_tick = 0) :
+    wheels {},
+    current {start_tick},
+    count {0}
+    {};
+
+  // A deadline at or before now() fires on the next tick
+  void schedule (wheel_timer timer);
+
+  // Move to tick to, appending every timer that fell due to due
+  void advance (std::uint64_t to, std::vector<wheel_timer>& due);
+
+  std::uint64_t now () const { return current; }
+  std::size_t size () const { return count; }
+};
+
+#endif
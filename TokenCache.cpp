@@ -0,0 +1,48 @@
+#include "TokenCache.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using std::string;
+using std::uint8_t;
+
+string TokenCache::key (const string& partition, const string& row, uint8_t permissions) {
+  string k {partition};
+  k.push_back('\0');
+  k += row;
+  k.push_back('\0');
+  k.push_back(static_cast<char>(permissions));
+  return k;
+}
+
+/*
+  Copy a still-reusable token for the scope into token
+
+  Returns false, counting a miss, if none has been issued or the
+  cached one is past its reuse point.
+ */
+bool TokenCache::lookup (const string& partition,
+                         const string& row,
+                         uint8_t permissions,
+                         string& token) {
+  if ( ! entries.find(key(partition, row, permissions), token)) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  return true;
+}
+
+/*
+  The entry expires at the token's reuse point
+ */
+void TokenCache::insert (const string& partition,
+                         const string& row,
+                         uint8_t permissions,
+                         const string& token,
+                         std::chrono::seconds lifetime) {
+  using clock = ShardedTtlCache<string,string>::clock;
+  const auto reuse_for (std::chrono::duration_cast<clock::duration>(lifetime * reuse_fraction));
+  entries.insert(key(partition, row, permissions), token, reuse_for);
+}
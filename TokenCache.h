@@ -0,0 +1,53 @@
+#ifndef TokenCache_h
+#define TokenCache_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ShardedTtlCache.h"
+
+/*
+  Cache of issued shared access signatures, keyed by the scope
+  (partition, row) and permissions they grant
+
+  A token is handed out again until reuse_fraction of its lifetime
+  has passed, so every holder still has at least the remaining
+  fraction of the lifetime left. After that a fresh token is signed.
+ */
+class TokenCache {
+private:
+  ShardedTtlCache<std::string,std::string> entries;
+  double reuse_fraction;
+  std::atomic<unsigned long> hits;
+  std::atomic<unsigned long> misses;
+
+  static std::string key (const std::string& partition,
+                          const std::string& row,
+                          std::uint8_t permissions);
+
+public:
+  TokenCache (double fraction, std::size_t max_entries) :
+    entries {max_entries},
+    reuse_fraction {fraction},
+    hits {0},
+    misses {0}
+    {};
+
+  bool lookup (const std::string& partition,
+               const std::string& row,
+               std::uint8_t permissions,
+               std::string& token);
+  void insert (const std::string& partition,
+               const std::string& row,
+               std::uint8_t permissions,
+               const std::string& token,
+               std::chrono::seconds lifetime);
+
+  unsigned long hit_count () const { return hits; }
+  unsigned long miss_count () const { return misses; }
+};
+
+#endif
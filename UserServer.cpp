@@ -2,12 +2,22 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <thread>
+#include <utility>
 #include <unordered_map>
 #include <vector>
 #include <tuple>
 
+#include <cpprest/http_client.h>
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
@@ -17,10 +27,23 @@
 #include "TableCache.h"
 #include "make_unique.h"
 #include "ClientUtils.h"
+#include "FriendCache.h"
+#include "FriendIndex.h"
+#include "FriendSet.h"
+#include "AllInOne.h"
+#include "LocalRpcHttp.h"
+#include "RateLimiter.h"
+#include "Router.h"
+#include "ServerConfig.h"
 #include "ServerUtils.h"
+#include "SessionSnapshot.h"
+#include "SessionStore.h"
+#include "SessionToken.h"
+#include "StatusQueue.h"
+#include "WriteBehind.h"
 
 
-//#include "azure_keys.h"
+#include "azure_keys.h"
 /*
  using azure::storage::storage_exception;
  using azure::storage::cloud_table;
@@ -36,6 +59,7 @@
  using azure::storage::table_query_iterator;
  using azure::storage::table_result;
  */
+using std::function;
 using std::cin;
 using std::cout;
 using std::endl;
@@ -48,9 +72,13 @@ using std::vector;
 using std::tuple;
 using std::get;
 using std::make_tuple;
+using std::int64_t;
+using std::uint64_t;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
 using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
@@ -58,11 +86,18 @@ using web::http::uri;
 
 using web::json::value;
 
+using web::http::client::http_client;
+
 using web::http::experimental::listener::http_listener;
 
 using prop_str_vals_t = vector<pair<string,string>>;
 
 
+// In the all-in-one binary, each server's code is in a namespace of its own
+#ifdef ALL_IN_ONE
+namespace user_server {
+#endif
+
 constexpr const char* def_url = "http://localhost:34572";
 
 const string auth_table_name {"AuthTable"};
@@ -84,7 +119,66 @@ const string delete_entity_admin {"DeleteEntityAdmin"};
 
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
+const string read_entity_session {"ReadEntitySession"};
+const string update_entity_session {"UpdateEntitySession"};
 const string push_status {"PushStatus"};
+const string scan_table_admin {"ScanTableAdmin"};
+
+enum class user_op { sign_on, sign_off, read_friend_list, add_friend, un_friend, update_friends, update_status, mutual_friends, suggest_friends, metrics_admin, unknown };
+
+const route_table<user_op> user_routes {
+    {{"SignOn", user_op::sign_on},
+     {"SignOff", user_op::sign_off},
+     {"ReadFriendList", user_op::read_friend_list},
+     {"AddFriend", user_op::add_friend},
+     {"UnFriend", user_op::un_friend},
+     {"UpdateFriends", user_op::update_friends},
+     {"UpdateStatus", user_op::update_status},
+     {"MutualFriends", user_op::mutual_friends},
+     {"SuggestFriends", user_op::suggest_friends},
+     {"MetricsAdmin", user_op::metrics_admin}},
+    user_op::unknown};
+
+//Properties of a user's DataTable entity holding the friend list
+const string friends_prop {"Friends"};
+const string friends_version_prop {"FriendsVersion"};
+//Properties of an UpdateFriends body and reply, each a list of friends
+//in the form of friends_prop
+const string add_friends_prop {"Add"};
+const string remove_friends_prop {"Remove"};
+//Property of a SuggestFriends reply: for each suggestion, how many of
+//the user's friends it is a friend of
+const string mutual_counts_prop {"MutualCounts"};
+//Property of a paged ReadFriendList reply: the length of the whole list
+const string friend_count_prop {"FriendCount"};
+
+/*
+ Parsed friend lists of signed-on users. USER_FRIEND_FRESH_MS bounds
+ how long a change made through another server can go unseen.
+ */
+FriendCache friend_cache {std::chrono::milliseconds {config_long("USER_FRIEND_FRESH_MS", 2000)},
+                          static_cast<std::size_t>(config_long("USER_FRIEND_CACHE_SIZE", 100000))};
+
+/*
+ Every user's friend list, for MutualFriends and SuggestFriends.
+ Built at startup by scanning DataTable in USER_INDEX_SEGMENTS
+ segments at once (0 for no index), and kept current by every
+ friend list UserServer reads or writes afterwards.
+ */
+FriendIndex friend_index {};
+const long index_segments {config_long("USER_INDEX_SEGMENTS", 8)};
+
+//ReadFriendList replies, those of them NotModified, and the bytes of
+//friend lists sent
+std::atomic<unsigned long> friend_list_reads {0};
+std::atomic<unsigned long> friend_list_not_modified {0};
+std::atomic<unsigned long> friend_list_bytes {0};
+
+//Most suggestions SuggestFriends returns
+constexpr std::size_t max_suggestions {100};
+
+//Read-modify-write cycles attempted before giving up on a friend list update
+constexpr int max_update_attempts {5};
 
 
 //Address Declarations
@@ -95,6 +189,30 @@ static constexpr const char* push_addr {"http://localhost:34574/"};
 //End Address Declarations
 
 
+/*
+ Token buckets per userid and per client address, with rates in
+ requests per second. A client over its limit gets 429.
+ */
+RateLimiter user_limiter {static_cast<std::size_t>(config_long("USER_RATE_SLOTS", 65536)),
+                          config_double("USER_USER_RATE", 20),
+                          config_double("USER_USER_BURST", 40)};
+RateLimiter client_limiter {static_cast<std::size_t>(config_long("USER_RATE_SLOTS", 65536)),
+                            config_double("USER_CLIENT_RATE", 100),
+                            config_double("USER_CLIENT_BURST", 200)};
+
+/*
+ Proxies trusted to name the client in X-Forwarded-For, a
+ comma-separated list of addresses in USER_TRUSTED_PROXIES. The
+ header of any other sender is ignored.
+ */
+const vector<string> trusted_proxies {parse_address_list(config_string("USER_TRUSTED_PROXIES", ""))};
+
+/*
+ Checks the session tokens issued by AuthServer, with the same key,
+ so that a request is authorized without any lookup
+ */
+SessionSigner session_signer {config_required("SESSION_KEY")};
+
 //Cache of opened tables
 
 //TableCache table_cache {};
@@ -209,34 +327,501 @@ unordered_map<string,string> get_json_body(http_request message) {
  }
  
  */
-//Initialize Unordered_Map ===================
+/*
+ Make an HTTP request, returning the status code, any JSON value in
+ the body, and the ETag header of the response.
+ 
+ if_match: if not empty, sent as the If-Match header
+ session: if not empty, sent as "Authorization: Bearer session"
+ if_none_match: if not empty, sent as the If-None-Match header
+ forwarded_for: if not empty, sent as the X-Forwarded-For header
+ 
+ This is do_request for the requests UserServer makes with a
+ session token, including the conditional reads and writes of
+ modify_friends, which need the ETag that do_request drops.
+ */
+tuple<status_code,value,string> do_etag_request (const method& http_method,
+                                                 const string& uri_string,
+                                                 const value& req_body,
+                                                 const string& if_match,
+                                                 const string& session = string {},
+                                                 const string& if_none_match = string {},
+                                                 const string& forwarded_for = string {}) {
+    http_request request {http_method};
+    http_headers& headers (request.headers());
+    if (!forwarded_for.empty()) {
+        headers.add("X-Forwarded-For", forwarded_for);
+    }
+    if (!if_match.empty()) {
+        headers.add("If-Match", if_match);
+    }
+    if (!if_none_match.empty()) {
+        headers.add("If-None-Match", if_none_match);
+    }
+    if (!session.empty()) {
+        headers.add("Authorization", "Bearer " + session);
+    }
+    if (req_body != value {}) {
+        headers.add("Content-Type", "application/json");
+        request.set_body(req_body);
+    }
+    
+    status_code code;
+    value resp_body;
+    string etag;
+    send_request (uri_string, request)
+    .then([&code,&etag](http_response response)
+          {
+              code = response.status_code();
+              const http_headers& headers {response.headers()};
+              auto etag_header (headers.find("ETag"));
+              if (etag_header != headers.end())
+                  etag = etag_header->second;
+              auto content_type (headers.find("Content-Type"));
+              if (content_type == headers.end() ||
+                  content_type->second != "application/json")
+                  return pplx::task<value> ([] { return value {};});
+              else
+                  return response.extract_json();
+          })
+    .then([&resp_body](value v) -> void
+          {
+              resp_body = v;
+              return;
+          })
+    .wait();
+    return make_tuple(code, resp_body, etag);
+}
+
+/*
+ Friend list of a signed-on user, from friend_cache if possible
+ 
+ A fresh cache entry is returned without any request. A stale one
+ is revalidated with If-None-Match, so an unchanged list costs a
+ NotModified reply and no transfer or parsing. Otherwise the list
+ is read, parsed, and cached.
+ 
+ Returns the status of the read and, if OK, the list.
+ */
+pair<status_code,friend_snapshot_ptr> load_friends (const string& userid,
+                                                    const user_session& user_data) {
+    bool fresh {false};
+    friend_snapshot_ptr cached {friend_cache.lookup(userid, fresh)};
+    if (cached && fresh)
+        return make_pair(status_codes::OK, cached);
+    
+    auto read = do_etag_request(methods::GET,
+                                addr + read_entity_session + "/" + data_table_name,
+                                value {},
+                                string {},
+                                user_data.token,
+                                cached ? cached->etag : string {});
+    if (cached && get<0>(read) == status_codes::NotModified) {
+        friend_cache.confirm(userid, cached->etag);
+        return make_pair(status_codes::OK, cached);
+    }
+    if (get<0>(read) != status_codes::OK) {
+        friend_cache.drop(userid);
+        return make_pair(get<0>(read), friend_snapshot_ptr {});
+    }
+    FriendSet friends {FriendSet::parse(get_json_object_prop(get<1>(read), friends_prop),
+                                        std::strtoull(get_json_object_prop(get<1>(read), friends_version_prop).c_str(), nullptr, 10))};
+    friend_index.set(friend_id {user_data.partition, user_data.row}, friends);
+    return make_pair(status_codes::OK, friend_cache.store(userid, std::move(friends), get<2>(read)));
+}
+
+/*
+ Read-modify-write of a signed-on user's friend list
+ 
+ userid, user_data: the user and their session
+ mutate: changes the friend set in place, returning false if
+ the list needs no write
+ 
+ Only Friends and FriendsVersion are merged into the entity, and a
+ mutation that changes nothing writes nothing.
+ 
+ The list comes from load_friends, and the write is conditional on
+ its ETag. If the list changed in between, through another server
+ or a concurrent request, BasicServer answers PreconditionFailed,
+ the cached list is dropped, and the cycle is repeated on the list
+ as stored, up to max_update_attempts times. A successful write
+ puts the new list in friend_cache under the ETag it was given.
+ */
+status_code modify_friends (const string& userid,
+                            const user_session& user_data,
+                            const function<bool (FriendSet&)>& mutate) {
+    for (int attempt {0}; attempt < max_update_attempts; ++attempt) {
+        pair<status_code,friend_snapshot_ptr> read {load_friends(userid, user_data)};
+        if (read.first != status_codes::OK)
+            return read.first;
+        
+        FriendSet friends {read.second->friends};
+        if (!mutate(friends))
+            return status_codes::OK;
+        
+        const value changes {value::object(vector<pair<string,value>> {
+            make_pair(friends_prop, value::string(friends.serialize())),
+            make_pair(friends_version_prop, value::string(std::to_string(friends.version())))})};
+        auto write = do_etag_request(methods::PUT,
+                                     addr + update_entity_session + "/" + data_table_name,
+                                     changes,
+                                     read.second->etag,
+                                     user_data.token);
+        if (get<0>(write) == status_codes::OK && !get<2>(write).empty()) {
+            friend_index.set(friend_id {user_data.partition, user_data.row}, friends);
+            friend_cache.store(userid, std::move(friends), get<2>(write));
+            return status_codes::OK;
+        }
+        friend_cache.drop(userid);
+        if (get<0>(write) != status_codes::PreconditionFailed)
+            return get<0>(write);
+        cout << "Friend list changed concurrently, retrying" << endl;
+    }
+    return status_codes::PreconditionFailed;
+}
+
+/*
+ Apply a batch of AddFriend and UnFriend mutations, in order, in a
+ single modify_friends cycle. Called by friend_writes.
+ */
+status_code write_friend_mutations (const string& userid,
+                                    const user_session& user_data,
+                                    const vector<friend_mutation>& mutations) {
+    return modify_friends(userid, user_data, [&mutations] (FriendSet& friends) {
+        bool changed {false};
+        for (const friend_mutation& m : mutations) {
+            if (m.add ? friends.add(m.id) : friends.remove(m.id))
+                changed = true;
+        }
+        return changed;
+    });
+}
+
+/*
+ Write-behind buffer for AddFriend and UnFriend
+ 
+ A mutation is written at once unless one of the user's writes is
+ in flight. The mutations a user makes meanwhile, within
+ USER_WRITE_BEHIND_MS of each other, are written together, at once
+ if USER_WRITE_BEHIND_MAX of them gather first, by
+ USER_WRITE_BEHIND_THREADS writers.
+ 
+ USER_WRITE_ACK chooses when the client hears back:
+ "durable" (the default): after the write, with its status
+ "buffered": at once with Accepted (202); mutations still buffered
+ are lost if the server dies, though not if it is stopped
+ */
+WriteBehind friend_writes {std::chrono::milliseconds {config_long("USER_WRITE_BEHIND_MS", 50)},
+                           static_cast<std::size_t>(config_long("USER_WRITE_BEHIND_MAX", 100)),
+                           static_cast<std::size_t>(config_long("USER_WRITE_BEHIND_THREADS", 4)),
+                           &write_friend_mutations};
+const bool durable_friend_writes {config_string("USER_WRITE_ACK", "durable") != "buffered"};
 
-unordered_map<string, tuple<string,string,string>> SignedOn;
-unordered_map<string, tuple<string,string,string>>::iterator it;
+/*
+ Queue m for userid in friend_writes and reply to message as
+ USER_WRITE_ACK requires
+ */
+void submit_friend_mutation (const http_request& message,
+                             const string& userid,
+                             const user_session& user_data,
+                             const friend_mutation& m) {
+    if (durable_friend_writes) {
+        if (!friend_writes.submit(userid, user_data, m, [message] (status_code status) {
+            message.reply(status);
+        })) {
+            message.reply(status_codes::ServiceUnavailable);
+        }
+        return;
+    }
+    message.reply(friend_writes.submit(userid, user_data, m, WriteBehind::ack_function {}) ?
+                  status_codes::Accepted : status_codes::ServiceUnavailable);
+}
 
+/*
+ UpdateFriends: apply the friends to add and remove in one
+ modify_friends cycle, so a whole contact sync costs one read and
+ at most one write, and reply with what was done with each.
+ 
+ Mutations of userid still in friend_writes are written first, so
+ they cannot overtake this one. The reply follows the write whatever
+ USER_WRITE_ACK says, as it reports on the friend list as stored.
+ Items already in the wanted state are reported as such and need no
+ write, so a retried request is answered without touching storage.
+ */
+void update_friends (const http_request& message,
+                     const string& userid,
+                     const user_session& user_data) {
+    unordered_map<string,string> json_body {get_json_body(message)};
+    for (const auto& v : json_body) {
+        if (v.first != add_friends_prop && v.first != remove_friends_prop) {
+            message.reply(status_codes::BadRequest);
+            return;
+        }
+    }
+    const string adds {json_body[add_friends_prop]};
+    const string removes {json_body[remove_friends_prop]};
+    
+    friend_writes.flush(userid);
+    vector<friend_change> results {};
+    const status_code status {modify_friends(userid, user_data, [&] (FriendSet& friends) {
+        return friends.apply(adds, removes, results);
+    })};
+    if (status != status_codes::OK) {
+        message.reply(status);
+        return;
+    }
+    value added {value::object()};
+    value removed {value::object()};
+    for (const friend_change& c : results)
+        (c.add ? added : removed)[c.item] = value::string(outcome_name(c.outcome));
+    value reply {value::object()};
+    reply[add_friends_prop] = added;
+    reply[remove_friends_prop] = removed;
+    message.reply(status_codes::OK, reply);
+}
+
+/*
+ Fill friend_index from segment of segments of DataTable
+ 
+ Returns false if the scan failed.
+ */
+bool load_index_segment (long segment, long segments) {
+    auto scan = do_etag_request(methods::GET,
+                                addr + scan_table_admin + "/" + data_table_name + "/" +
+                                std::to_string(segment) + "/" + std::to_string(segments),
+                                value {},
+                                string {});
+    if (get<0>(scan) != status_codes::OK || !get<1>(scan).is_array())
+        return false;
+    for (const value& entity : get<1>(scan).as_array()) {
+        if (!entity.is_object() || !entity.has_field(friends_prop))
+            continue;
+        friend_index.load(friend_id {get_json_object_prop(entity, "Partition"),
+                                     get_json_object_prop(entity, "Row")},
+                          FriendSet::parse(get_json_object_prop(entity, friends_prop)));
+    }
+    return true;
+}
+
+/*
+ Scan all of DataTable into friend_index, index_segments segments
+ at a time, and mark the index complete if every segment was read.
+ */
+bool build_friend_index () {
+    vector<std::thread> scanners {};
+    std::atomic<long> failed {0};
+    for (long segment {0}; segment < index_segments; ++segment) {
+        scanners.emplace_back([segment, &failed] () {
+            try {
+                if (!load_index_segment(segment, index_segments))
+                    ++failed;
+            }
+            catch (const std::exception& e) {
+                cout << "UserServer: friend index scan failed: " << e.what() << endl;
+                ++failed;
+            }
+        });
+    }
+    for (std::thread& t : scanners)
+        t.join();
+    if (failed > 0)
+        return false;
+    friend_index.mark_complete();
+    cout << "UserServer: friend index holds " << friend_index.node_count() << " users and friends" << endl;
+    return true;
+}
+
+/*
+ True if an If-None-Match header names etag, or is "*". A weak
+ validator matches its strong form, as If-None-Match compares weakly.
+ */
+bool etag_matches (const string& if_none_match, const string& etag) {
+    std::size_t start {0};
+    while (start < if_none_match.size()) {
+        std::size_t end {if_none_match.find(',', start)};
+        if (end == string::npos)
+            end = if_none_match.size();
+        string tag {if_none_match.substr(start, end - start)};
+        const std::size_t first {tag.find_first_not_of(" \t")};
+        const std::size_t last {tag.find_last_not_of(" \t")};
+        tag = first == string::npos ? string {} : tag.substr(first, last - first + 1);
+        if (tag.compare(0, 2, "W/") == 0)
+            tag.erase(0, 2);
+        if (tag == "*" || tag == etag)
+            return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+/*
+ Parse a count from a path segment into count. Only a whole number
+ of decimal digits is accepted: no sign, space, or trailing text.
+ */
+bool parse_count (const string& text, std::size_t& count) {
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+        return false;
+    errno = 0;
+    const unsigned long long value {std::strtoull(text.c_str(), nullptr, 10)};
+    if (errno == ERANGE || value > std::numeric_limits<std::size_t>::max())
+        return false;
+    count = static_cast<std::size_t>(value);
+    return true;
+}
+
+/*
+ Friends' names in the form of friends_prop, in the order given
+ */
+string join_friends (const vector<friend_id>& friends) {
+    string result {};
+    for (const friend_id& f : friends) {
+        if (!result.empty())
+            result += "|";
+        result += f.country + ";" + f.name;
+    }
+    return result;
+}
+
+/*
+ Push a queued status update to the user's friends through PushServer.
+ Called by status_queue's dispatchers.
+ */
+unsigned short dispatch_status (const status_update& update) {
+    auto result = do_etag_request(methods::POST,
+                                  push_addr + push_status + "/" + update.partition + "/" + update.row + "/" + update.status,
+                                  build_json_value(friends_prop, update.friends),
+                                  string {});
+    return get<0>(result);
+}
+
+/*
+ Status updates waiting for PushServer, journaled in
+ USER_STATUS_JOURNAL (default "userserver.status.journal"; empty for
+ memory only), at most USER_STATUS_QUEUE of them, dispatched by
+ USER_STATUS_DISPATCHERS threads. Created in main, once requests can
+ be routed, as updates left in the journal are dispatched at once.
+ */
+std::unique_ptr<StatusQueue> status_queue {};
+
+/*
+ Users signed on through SignOn, shared by all handler threads.
+ A session ends USER_SESSION_IDLE seconds after its last use, or
+ USER_SESSION_MAX seconds after SignOn (the lifetime of its token).
+ USER_EXPECTED_SESSIONS presizes the store.
+ */
+SessionStore signed_on {std::chrono::seconds {config_long("USER_SESSION_IDLE", 30 * 60)},
+                        std::chrono::seconds {config_long("USER_SESSION_MAX", 24 * 60 * 60)},
+                        static_cast<std::size_t>(config_long("USER_EXPECTED_SESSIONS", 0))};
+
+/*
+ Sessions are saved to USER_SNAPSHOT_PATH every USER_SNAPSHOT_INTERVAL
+ seconds (never if <= 0), and each SignOff in between is journalled
+ beside it, so a restart restores neither ended nor revoked sessions.
+ */
+const string snapshot_path {config_string("USER_SNAPSHOT_PATH", "userserver.snap")};
+const long snapshot_interval {config_long("USER_SNAPSHOT_INTERVAL", 30)};
+
+/*
+ Counters reported by GET MetricsAdmin
+ */
+value metrics () {
+    value result {value::object ()};
+    result["RateAllowedByUser"] = value::number(static_cast<uint64_t>(user_limiter.allowed_count()));
+    result["RateThrottledByUser"] = value::number(static_cast<uint64_t>(user_limiter.throttled_count()));
+    result["RateAllowedByClient"] = value::number(static_cast<uint64_t>(client_limiter.allowed_count()));
+    result["RateThrottledByClient"] = value::number(static_cast<uint64_t>(client_limiter.throttled_count()));
+    result["SessionsLive"] = value::number(static_cast<uint64_t>(signed_on.size()));
+    result["SessionsExpired"] = value::number(static_cast<uint64_t>(signed_on.expired_count()));
+    result["SessionsExpiredLastMinute"] = value::number(static_cast<uint64_t>(signed_on.expired_last_minute()));
+    result["FriendCacheFreshHits"] = value::number(static_cast<uint64_t>(friend_cache.fresh_hit_count()));
+    result["FriendCacheRevalidations"] = value::number(static_cast<uint64_t>(friend_cache.stale_hit_count()));
+    result["FriendCacheMisses"] = value::number(static_cast<uint64_t>(friend_cache.miss_count()));
+    result["FriendCacheSize"] = value::number(static_cast<uint64_t>(friend_cache.size()));
+    result["FriendMutations"] = value::number(static_cast<uint64_t>(friend_writes.mutation_count()));
+    result["FriendWrites"] = value::number(static_cast<uint64_t>(friend_writes.write_count()));
+    result["FriendWriteFailures"] = value::number(static_cast<uint64_t>(friend_writes.failure_count()));
+    result["FriendWritesPending"] = value::number(static_cast<uint64_t>(friend_writes.pending()));
+    result["FriendListReads"] = value::number(static_cast<uint64_t>(friend_list_reads));
+    result["FriendListNotModified"] = value::number(static_cast<uint64_t>(friend_list_not_modified));
+    result["FriendListBytes"] = value::number(static_cast<uint64_t>(friend_list_bytes));
+    result["FriendIndexComplete"] = value::boolean(friend_index.is_complete());
+    result["FriendIndexNodes"] = value::number(static_cast<uint64_t>(friend_index.node_count()));
+    result["FriendIndexQueries"] = value::number(static_cast<uint64_t>(friend_index.query_count()));
+    result["FriendIndexUpdates"] = value::number(static_cast<uint64_t>(friend_index.update_count()));
+    result["StatusQueueDepth"] = value::number(static_cast<uint64_t>(status_queue->size()));
+    result["StatusQueueCapacity"] = value::number(static_cast<uint64_t>(status_queue->max_size()));
+    result["StatusEnqueued"] = value::number(static_cast<uint64_t>(status_queue->enqueued_count()));
+    result["StatusRejected"] = value::number(static_cast<uint64_t>(status_queue->rejected_count()));
+    result["StatusDispatched"] = value::number(static_cast<uint64_t>(status_queue->dispatched_count()));
+    result["StatusDispatchFailures"] = value::number(static_cast<uint64_t>(status_queue->failure_count()));
+    result["StatusLagLastMs"] = value::number(static_cast<int64_t>(status_queue->last_lag_ms()));
+    result["StatusLagMeanMs"] = value::number(static_cast<int64_t>(status_queue->mean_lag_ms()));
+    result["StatusLagMaxMs"] = value::number(static_cast<int64_t>(status_queue->max_lag_ms()));
+    return result;
+}
 
 
-//End initialize Unordered_Map ================
+/*
+ Find the session of userid
+ 
+ A session token in the Authorization header is checked against
+ session_signer, and must also be the token of the session SignOn
+ recorded for userid, so that SignOff and idle expiry end it as
+ they end the session. A client that sends no token uses the
+ recorded session.
+ 
+ user_data: set to the user's session
+ 
+ Returns false if userid is not signed on, or signed on with
+ another token.
+ */
+bool find_session (const http_request& message,
+                   const string& userid,
+                   user_session& user_data) {
+    const http_headers& headers {message.headers()};
+    auto authorization (headers.find("Authorization"));
+    if (authorization != headers.end()) {
+        const string token {bearer_token(authorization->second)};
+        session_claims claims {};
+        if (!session_signer.verify(token, claims) || claims.userid != userid)
+            return false;
+        user_session recorded {};
+        if (!signed_on.find(userid, recorded) || recorded.token != token)
+            return false;
+        user_data = user_session {token, claims.partition, claims.row};
+        return true;
+    }
+    return signed_on.find(userid, user_data);
+}
 
 /*
  Top-level routine for processing all HTTP GET requests.
  */
 void handle_get(http_request message) {
     
-    string path {uri::decode(message.relative_uri().path())};
-    cout << endl << "**** AuthServer GET " << path << endl;
-    auto paths = uri::split_path(path);
-    unordered_map<string,string> json_body {get_json_body(message)};
+    const string path {message.relative_uri().path()};
+    cout << endl << "**** UserServer GET " << path << endl;
+    const path_segments paths {path};
     
-    //User Data from tuple
-    tuple<string,string,string> user_data = SignedOn[paths[1]];
+    if (user_routes.lookup(paths[0]) == user_op::metrics_admin) {
+        message.reply(status_codes::OK, metrics());
+        return;
+    }
     
+    unordered_map<string,string> json_body {get_json_body(message)};
     
     // Need at least an operation and userid
     if (paths.size() < 2) {
         message.reply(status_codes::BadRequest);
         return;
     }
+    const user_op operation {user_routes.lookup(paths[0])};
+    const string userid {paths.decoded(1)};
+    if (throttle(message, client_limiter, client_key(message, trusted_proxies)) ||
+        throttle(message, user_limiter, userid)) {
+        return;
+    }
+    
     //json body cannot have more than 1 property
     if(json_body.size()>1){
         message.reply(status_codes::BadRequest);
@@ -268,31 +853,129 @@ void handle_get(http_request message) {
     // //     return;
     // //   }
     
-    bool signed_in = false;             //set signed_in status for user as false
-    for (SignedOn.begin(); it!=SignedOn.end(); it++) {
-        if (it->first == paths[1]) {    //if user is found in the map, set as true
-            signed_in = true;
-        }
-    }
+    //User Data from tuple
+    user_session user_data {};
+    const bool signed_in {find_session(message, userid, user_data)};
     
     
-    if (paths[0] == "ReadFriendList") {
+    if (operation == user_op::read_friend_list) {
         if (!signed_in) {
             message.reply(status_codes::Forbidden);
             return;
         }
         else{
-            auto user_entity = do_request(methods::GET, addr + read_entity_auth + "/"+"DataTable"+"/"+ get<0>(user_data) + "/" + get<1>(user_data) + "/" + get<2>(user_data));
-            auto entity_map = unpack_json_object(user_entity.second);
-            string friends_list = entity_map["Friends"];
-            value FriendList = build_json_value("Friends",friends_list);
-            message.reply(status_codes::OK,FriendList);
+            //ReadFriendList/userid/offset/limit returns a page of the list
+            std::size_t offset {0};
+            std::size_t limit {std::numeric_limits<std::size_t>::max()};
+            const bool paged {paths.size() == 4};
+            if ((!paged && paths.size() != 2) ||
+                (paged && (!parse_count(paths.decoded(2), offset) ||
+                           !parse_count(paths.decoded(3), limit))) ||
+                limit == 0) {
+                message.reply(status_codes::BadRequest);
+                return;
+            }
+            friend_writes.flush(userid);
+            pair<status_code,friend_snapshot_ptr> read {load_friends(userid, user_data)};
+            if (read.first != status_codes::OK) {
+                message.reply(read.first);
+                return;
+            }
+            ++friend_list_reads;
+            //The list's ETag covers every page of it
+            const string& list_etag {read.second->list_etag};
+            const http_headers& headers {message.headers()};
+            auto if_none_match (headers.find("If-None-Match"));
+            if (if_none_match != headers.end() && etag_matches(if_none_match->second, list_etag)) {
+                ++friend_list_not_modified;
+                http_response response {status_codes::NotModified};
+                response.headers().add("ETag", list_etag);
+                message.reply(response);
+                return;
+            }
+            value FriendList {};
+            if (paths.size() == 4) {
+                std::size_t total {0};
+                const string page {FriendSet::page(read.second->serialized, offset, limit, total)};
+                friend_list_bytes += page.size();
+                FriendList = build_json_value(friends_prop, page);
+                FriendList[friend_count_prop] = value::string(std::to_string(total));
+            }
+            else {
+                friend_list_bytes += read.second->serialized.size();
+                FriendList = build_json_value(friends_prop, read.second->serialized);
+            }
+            http_response response {status_codes::OK};
+            response.headers().add("ETag", list_etag);
+            response.set_body(FriendList);
+            message.reply(response);
             return;
             
         }
         
     }
     
+    /*
+     MutualFriends/userid/country/name: friends of both userid and
+     the user named in DataTable by country and name
+     */
+    if (operation == user_op::mutual_friends) {
+        if (!signed_in) {
+            message.reply(status_codes::Forbidden);
+            return;
+        }
+        if (paths.size() < 4) {
+            message.reply(status_codes::BadRequest);
+            return;
+        }
+        if (!friend_index.is_complete()) {
+            message.reply(status_codes::ServiceUnavailable);
+            return;
+        }
+        friend_writes.flush(userid);
+        const vector<friend_id> mutual {friend_index.mutual(friend_id {user_data.partition, user_data.row},
+                                                            friend_id {paths.decoded(2), paths.decoded(3)})};
+        message.reply(status_codes::OK, build_json_value(friends_prop, join_friends(mutual)));
+        return;
+    }
+    
+    /*
+     SuggestFriends/userid[/limit]: up to limit (default 10) friends of
+     userid's friends, most shared friends first, with how many each
+     shares in MutualCounts
+     */
+    if (operation == user_op::suggest_friends) {
+        if (!signed_in) {
+            message.reply(status_codes::Forbidden);
+            return;
+        }
+        if (!friend_index.is_complete()) {
+            message.reply(status_codes::ServiceUnavailable);
+            return;
+        }
+        std::size_t limit {10};
+        if (paths.size() > 2) {
+            if (!parse_count(paths.decoded(2), limit) || limit == 0 || limit > max_suggestions) {
+                message.reply(status_codes::BadRequest);
+                return;
+            }
+        }
+        friend_writes.flush(userid);
+        const vector<pair<friend_id,std::size_t>> suggestions {
+            friend_index.suggest(friend_id {user_data.partition, user_data.row}, limit)};
+        vector<friend_id> names {};
+        string counts {};
+        for (const pair<friend_id,std::size_t>& s : suggestions) {
+            names.push_back(s.first);
+            counts += (counts.empty() ? "" : "|") + std::to_string(s.second);
+        }
+        value reply {value::object()};
+        reply[friends_prop] = value::string(join_friends(names));
+        reply[mutual_counts_prop] = value::string(counts);
+        message.reply(status_codes::OK, reply);
+        return;
+    }
+    
     
     
 }
@@ -301,14 +984,21 @@ void handle_get(http_request message) {
  Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
-    string path {uri::decode(message.relative_uri().path())};
+    const string path {message.relative_uri().path()};
     cout << endl << "**** POST " << path << endl;
-    auto paths = uri::split_path(path);
+    const path_segments paths {path};
     
-    //User Data from tuple
-    tuple<string,string,string> user_data = SignedOn[paths[1]];
-    
-    string userid = paths[1];
+    // Need at least an operation and userid
+    if (paths.size() < 2) {
+        message.reply(status_codes::BadRequest);
+        return;
+    }
+    const user_op operation {user_routes.lookup(paths[0])};
+    const string userid {paths.decoded(1)};
+    if (throttle(message, client_limiter, client_key(message, trusted_proxies)) ||
+        throttle(message, user_limiter, userid)) {
+        return;
+    }
     unordered_map<string,string> json_body {get_json_body(message)};
     string pass {};
     string prop {};
@@ -329,32 +1019,39 @@ void handle_post(http_request message) {
     cout << prop << ": " << pass << endl;   //Debug
     
     
-    if (paths[0] == "SignOn") {
+    if (operation == user_op::sign_on) {
         cout << "Entering SignOn" << endl;  //Debug
         pair<string,string> pswd = make_pair(prop,pass);
-        cout << "User ID is: " << paths[1] << pswd.first << ": " << pswd.second << endl;  //Debug
+        cout << "User ID is: " << userid << pswd.first << ": " << pswd.second << endl;  //Debug
         value password = build_json_value(pswd);
-        auto status = do_request(methods::GET, auth_addr + get_update_token_op + "/" + paths[1],password);
-        cout << "Status Code: " << status.first << endl;    //Debug
-        if (status.first == status_codes::OK) {
-            auto update_data = unpack_json_object(status.second);
-            pair<string,tuple<string,string,string>> client = make_pair(userid,make_tuple(update_data["token"],update_data["DataPartition"],update_data["DataRow"]));
-            SignedOn.insert(client); //Insert the userid & token into SignedOn status
-            message.reply(status_codes::OK,status.second);
+        // AuthServer limits the client, not this server
+        auto status = do_etag_request(methods::GET, auth_addr + get_update_token_op + "/" + userid, password, string {},
+                                      string {}, string {}, client_key(message, trusted_proxies));
+        cout << "Status Code: " << get<0>(status) << endl;    //Debug
+        if (get<0>(status) == status_codes::OK) {
+            auto update_data = unpack_json_object(get<1>(status));
+            //Record the session, replacing any earlier one of userid
+            signed_on.insert(userid, user_session {update_data["session"],update_data["DataPartition"],update_data["DataRow"]});
+            message.reply(status_codes::OK,get<1>(status));
             return;
         }
     }
     
-    if (paths[0] == "SignOff") {
+    if (operation == user_op::sign_off) {
         cout << "Entering SignOff" << endl; //Debug
-        for (SignedOn.begin(); it!=SignedOn.end(); it++){
-            if (it->first == paths[1]) {
-                SignedOn.erase(paths[1]);   //Erase the userid and token from SignedOn status
-                message.reply(status_codes::OK);
-                return;
-            }
+        //Erase the session of userid, if signed on, and its cached friend list
+        friend_writes.flush(userid);
+        friend_cache.drop(userid);
+        user_session ended {};
+        if (!signed_on.erase(userid, ended)) {
+            message.reply(status_codes::NotFound);
+            return;
+        }
+        //Journal the sign-off, so a restart does not restore the session
+        if (snapshot_interval > 0 && !journal_sign_off(snapshot_path, ended)) {
+            cout << "UserServer: cannot journal SignOff to " << snapshot_path << endl;
         }
-        message.reply(status_codes::NotFound);
+        message.reply(status_codes::OK);
         return;
     }
 }
@@ -366,97 +1063,93 @@ void handle_post(http_request message) {
  Top-level routine for processing all HTTP PUT requests.
  */
 void handle_put(http_request message) {
-    string path {uri::decode(message.relative_uri().path())};
+    const string path {message.relative_uri().path()};
     cout << endl << "**** PUT " << path << endl;
-    auto paths = uri::split_path(path);
-    
-    //User Data from tuple
-    tuple<string,string,string> user_data = SignedOn[paths[1]];
+    const path_segments paths {path};
     
-    bool signed_in = false;             //set signed_in status for user as false
-    for (SignedOn.begin(); it!=SignedOn.end(); it++) {
-        if (it->first == paths[1]) {    //if user is found in the map, set as true
-            signed_in = true;
-        }
+    // Need at least an operation and userid
+    if (paths.size() < 2) {
+        message.reply(status_codes::BadRequest);
+        return;
+    }
+    const user_op operation {user_routes.lookup(paths[0])};
+    const string userid {paths.decoded(1)};
+    if (throttle(message, client_limiter, client_key(message, trusted_proxies)) ||
+        throttle(message, user_limiter, userid)) {
+        return;
     }
     
-    //GET THE FRIEND LIST
-    auto user_entity = do_request(methods::GET, addr + read_entity_auth + "/"+"DataTable"+"/"+ get<0>(user_data) + "/" + paths[1] + "/" + paths[2]);
-    auto entity_map = unpack_json_object(user_entity.second);
-    string friends_list = entity_map["Friends"];
-    friends_list_t friends_list_parsed = parse_friends_list(friends_list); //parse the friends list from previous line, returns vector of pairs
-    ////////////
-    
+    //User Data from tuple
+    user_session user_data {};
+    const bool signed_in {find_session(message, userid, user_data)};
     
-    if (paths[0] == "AddFriend") {  //method for adding a friend
+    if (operation == user_op::add_friend) {  //method for adding a friend
         if (!signed_in) {
             message.reply(status_codes::Forbidden);
             return;
         }
-        else{
-            //check if friend already exists in the list, if it is return status code ok
-            for (auto const& v: friends_list_parsed) {
-                if (v.first == paths[1] && v.second == paths[2]) {
-                    message.reply(status_codes::OK);
-                    cout << "The person exists in the table" << endl;
-                    return;
-                }
-            }
-            //Add the friend into friend list if he/she does not exist in the list
-            pair<string,string> friend_to_be_added = make_pair(paths[1],paths[2]);
-            friends_list_parsed.push_back(friend_to_be_added);
-            string new_string_of_friends = friends_list_to_string (friends_list_parsed); //friend list string
-            auto new_friend_list = do_request(methods::GET, addr + update_entity_auth + "/"+"DataTable"+"/"+ get<0>(user_data) + "/" + paths[1] + "/" + paths[2],build_json_value("Friends",new_string_of_friends));
-            if (new_friend_list.first == status_codes::OK) {
-                message.reply(status_codes::OK);
-                return;
-            }
-            
+        if (paths.size() < 4) {
+            message.reply(status_codes::BadRequest);
+            return;
         }
-        
-        
+        //Adding a friend already in the list leaves it unchanged and returns OK
+        const friend_id friend_to_be_added {paths.decoded(2), paths.decoded(3)};
+        submit_friend_mutation(message, userid, user_data, friend_mutation {true, friend_to_be_added});
+        return;
     }
     
-    
-    
-    if (paths[0] == "UnFriend") {  //method for deleting a friend
+    if (operation == user_op::un_friend) {  //method for deleting a friend
         if (!signed_in) {
             message.reply(status_codes::Forbidden);
             return;
         }
-        else{
-            //check if friend already exists in the list, if he/she is remove the friend
-            for (auto v = friends_list_parsed.begin(); v != friends_list_parsed.end(); v++) {
-                if (v->first == paths[2] && v->second == paths[3]) {
-                    string friend_to_be_deleted = paths[1];
-                    friends_list_parsed.erase(v); //removing the friend
-                    string new_string_of_friends = friends_list_to_string(friends_list_parsed);
-                    auto new_friend_list = do_request(methods::GET, addr + update_entity_auth + "/"+"DataTable"+"/"+ get<0>(user_data) + "/" + paths[1] + "/" + paths[2],build_json_value("Friends",new_string_of_friends));
-                    if (new_friend_list.first == status_codes::OK) {
-                        message.reply(status_codes::OK);
-                        return;
-                    }
-                }
-                
-            }
-            //Friend does not exist in the friend list, return OK
-            cout << "The person does not exist in your list" << endl;
-            message.reply(status_codes::OK);
+        if (paths.size() < 4) {
+            message.reply(status_codes::BadRequest);
             return;
         }
-        
+        //Removing a friend not in the list leaves it unchanged and returns OK
+        const friend_id friend_to_be_deleted {paths.decoded(2), paths.decoded(3)};
+        submit_friend_mutation(message, userid, user_data, friend_mutation {false, friend_to_be_deleted});
+        return;
     }
     
     
-    if (paths[0] == "UpdateStatus") {  //method for updating status
+    if (operation == user_op::update_friends) {  //method for adding and removing many friends
+        if (!signed_in) {
+            message.reply(status_codes::Forbidden);
+            return;
+        }
+        update_friends(message, userid, user_data);
+        return;
+    }
+    
+    if (operation == user_op::update_status) {  //method for updating status
         if (!signed_in) {
             message.reply(status_codes::Forbidden);
             return;
         }
+        else if (paths.size() < 3) {
+            message.reply(status_codes::BadRequest);
+            return;
+        }
         else{
-            string string_of_friends = friends_list_to_string(friends_list_parsed);
-            pair<status_code, value> result = do_request(methods::POST, push_addr + push_status +"/"+get<1>(user_data)+"/"+get<2>(user_data)+"/"+paths[2]);
-            
+            friend_writes.flush(userid);
+            pair<status_code,friend_snapshot_ptr> read {load_friends(userid, user_data)};
+            if (read.first != status_codes::OK) {
+                message.reply(read.first);
+                return;
+            }
+            //Acknowledged once journaled; the status stays percent-encoded,
+            //as it came, for the PushStatus URI
+            if (!status_queue->enqueue(status_update {userid, user_data.partition, user_data.row,
+                                                      paths[2].str(), read.second->serialized, 0})) {
+                http_response response {status_codes::ServiceUnavailable};
+                response.headers().add("Retry-After", "1");
+                message.reply(response);
+                return;
+            }
+            message.reply(status_codes::Accepted);
+            return;
         }
     }
     
@@ -492,6 +1185,23 @@ int main (int argc, char const * argv[]) {
     cout << "AuthServer: Parsing connection string" << endl;
     //table_cache.init (storage_connection_string);
     
+    // Sessions saved by the previous run, so users need not sign on again
+    const long restored {load_session_snapshot(signed_on, snapshot_path)};
+    if (restored >= 0) {
+        cout << "UserServer: " << restored << " sessions restored from " << snapshot_path << endl;
+    }
+    
+    // Co-located servers are called over Unix sockets where configured
+    route_local_rpc(addr, "BASIC_RPC_SOCKET");
+    route_local_rpc(auth_addr, "AUTH_RPC_SOCKET");
+    route_local_rpc(push_addr, "PUSH_RPC_SOCKET");
+    
+    status_queue = std::make_unique<StatusQueue>(
+        config_string("USER_STATUS_JOURNAL", "userserver.status.journal"),
+        static_cast<std::size_t>(config_long("USER_STATUS_QUEUE", 10000)),
+        static_cast<std::size_t>(config_long("USER_STATUS_DISPATCHERS", 2)),
+        &dispatch_status);
+    
     cout << "AuthServer: Opening listener" << endl;
     http_listener listener {def_url};
     listener.support(methods::GET, &handle_get);
@@ -500,11 +1210,51 @@ int main (int argc, char const * argv[]) {
     listener.support(methods::DEL, &handle_delete);
     listener.open().wait(); // Wait for listener to complete starting
     
+    // Ends idle and expired sessions once a second, and saves the
+    // sessions every snapshot_interval seconds
+    std::atomic<bool> stopping {false};
+    std::thread reaper {[&stopping] () {
+        long seconds {0};
+        while (!stopping) {
+            std::this_thread::sleep_for(std::chrono::seconds {1});
+            signed_on.expire();
+            if (snapshot_interval > 0 && ++seconds % snapshot_interval == 0 &&
+                !save_session_snapshot(signed_on, snapshot_path)) {
+                cout << "UserServer: cannot write " << snapshot_path << endl;
+            }
+        }
+    }};
+    
+    // Builds friend_index, retrying every 5 seconds until DataTable can be scanned
+    std::thread index_builder {[&stopping] () {
+        while (index_segments > 0 && !stopping && !build_friend_index()) {
+            cout << "UserServer: cannot build friend index, retrying" << endl;
+            for (int i {0}; i < 5 && !stopping; ++i)
+                std::this_thread::sleep_for(std::chrono::seconds {1});
+        }
+    }};
+    
+#ifdef ALL_IN_ONE
+    wait_for_stop();
+#else
     cout << "Enter carriage return to stop AuthServer." << endl;
     string line;
     getline(std::cin, line);
+#endif
     
     // Shut it down
     listener.close().wait();
+    friend_writes.stop();
+    status_queue->stop();
+    stopping = true;
+    reaper.join();
+    index_builder.join();
+    if (snapshot_interval > 0) {
+        save_session_snapshot(signed_on, snapshot_path);
+    }
     cout << "AuthServer closed" << endl;
 }
+
+#ifdef ALL_IN_ONE
+} // namespace user_server
+#endif
@@ -0,0 +1,74 @@
+#include "UseridFilter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Fnv1a.h"
+
+using std::size_t;
+using std::string;
+using std::uint64_t;
+
+/*
+  Allocate a Bloom filter of the given size, rounded up to a
+  multiple of 64 bits. Must be called before the server starts
+  taking requests.
+ */
+void UseridFilter::enable_bloom (size_t bits) {
+  const size_t words {(bits + 63) / 64};
+  bloom.reset (new std::atomic<uint64_t>[words]);
+  for (size_t i {0}; i < words; ++i)
+    bloom[i].store (0, std::memory_order_relaxed);
+  bloom_bits = words * 64;
+}
+
+/*
+  Bit positions are h1 + i*h2 (double hashing), i < bloom_hashes,
+  from FNV-1a rather than std::hash so that they are unrelated to
+  the negative cache's buckets.
+ */
+bool UseridFilter::bloom_contains (const string& userid) const {
+  const uint64_t h1 {fnv1a64(userid)};
+  const uint64_t h2 {(h1 >> 33) | 1};
+  for (unsigned i {0}; i < bloom_hashes; ++i) {
+    const uint64_t bit {(h1 + i * h2) % bloom_bits};
+    if ((bloom[bit / 64].load(std::memory_order_relaxed) & (uint64_t {1} << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
+
+void UseridFilter::add_known (const string& userid) {
+  missing.erase(userid);
+  if ( ! bloom_enabled())
+    return;
+  const uint64_t h1 {fnv1a64(userid)};
+  const uint64_t h2 {(h1 >> 33) | 1};
+  for (unsigned i {0}; i < bloom_hashes; ++i) {
+    const uint64_t bit {(h1 + i * h2) % bloom_bits};
+    bloom[bit / 64].fetch_or (uint64_t {1} << (bit % 64), std::memory_order_relaxed);
+  }
+}
+
+/*
+  True if userid is known not to exist, from either the Bloom
+  filter or an unexpired negative cache entry
+ */
+bool UseridFilter::known_absent (const string& userid) {
+  if (bloom_enabled() && ! bloom_contains(userid)) {
+    ++bloom_rejects;
+    return true;
+  }
+
+  bool absent {false};
+  if ( ! missing.find(userid, absent))
+    return false;
+  ++negative_hits;
+  return true;
+}
+
+void UseridFilter::add_missing (const string& userid) {
+  missing.insert(userid, true, ttl);
+}
@@ -0,0 +1,66 @@
+#ifndef UseridFilter_h
+#define UseridFilter_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "ShardedTtlCache.h"
+
+/*
+  Answers "this userid certainly does not exist" without storage I/O
+
+  Two mechanisms, either of which can reject a userid:
+
+  - A negative cache of userids recently found missing in AuthTable,
+    each remembered for ttl. Bounded in size, so a flood of distinct
+    made-up userids cannot exhaust memory.
+  - An optional Bloom filter of every known userid, built from
+    AuthTable at startup and extended by add_known(). A userid the
+    filter has never seen does not exist. The filter has no false
+    negatives, so it only works if every user creation calls
+    add_known(); leave it disabled otherwise.
+ */
+class UseridFilter {
+public:
+  static constexpr unsigned bloom_hashes {7};
+
+private:
+  // The value is unused; an unexpired entry is the fact of absence
+  ShardedTtlCache<std::string,bool> missing;
+  std::chrono::milliseconds ttl;
+
+  std::unique_ptr<std::atomic<std::uint64_t>[]> bloom;
+  std::size_t bloom_bits;
+
+  std::atomic<unsigned long> negative_hits;
+  std::atomic<unsigned long> bloom_rejects;
+
+  bool bloom_contains (const std::string& userid) const;
+
+public:
+  UseridFilter (std::chrono::milliseconds time_to_live, std::size_t max_entries) :
+    missing {max_entries},
+    ttl {time_to_live},
+    bloom {},
+    bloom_bits {0},
+    negative_hits {0},
+    bloom_rejects {0}
+    {};
+
+  void enable_bloom (std::size_t bits);
+  bool bloom_enabled () const { return bloom_bits != 0; }
+
+  bool known_absent (const std::string& userid);
+  void add_missing (const std::string& userid);
+  void add_known (const std::string& userid);
+
+  unsigned long negative_hit_count () const { return negative_hits; }
+  unsigned long bloom_reject_count () const { return bloom_rejects; }
+  std::size_t negative_size () { return missing.size(); }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "WorkerPool.h"
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+using std::cout;
+using std::endl;
+using std::function;
+using std::size_t;
+using std::unique_lock;
+
+WorkerPool::WorkerPool (size_t threads, size_t queue_capacity) :
+  workers {},
+  queue {},
+  lock {},
+  ready {},
+  capacity {queue_capacity},
+  peak_depth {0},
+  stopping {false},
+  accepted {0},
+  rejected {0},
+  completed {0}
+{
+  for (size_t i {0}; i < threads; ++i)
+    workers.emplace_back (&WorkerPool::run, this);
+}
+
+/*
+  Finish the jobs already queued, then join the workers
+ */
+WorkerPool::~WorkerPool () {
+  {
+    unique_lock<std::mutex> guard {lock};
+    stopping = true;
+  }
+  ready.notify_all();
+  for (std::thread& w : workers)
+    w.join();
+}
+
+/*
+  Queue job for a worker
+
+  Returns false, counting a rejection, if the queue already holds
+  capacity jobs. The job is then not run.
+ */
+bool WorkerPool::submit (function<void()> job) {
+  {
+    unique_lock<std::mutex> guard {lock};
+    if (stopping || queue.size() >= capacity) {
+      ++rejected;
+      return false;
+    }
+    queue.push_back (std::move(job));
+    if (queue.size() > peak_depth)
+      peak_depth = queue.size();
+  }
+  ++accepted;
+  ready.notify_one();
+  return true;
+}
+
+void WorkerPool::run () {
+  for (;;) {
+    function<void()> job {};
+    {
+      unique_lock<std::mutex> guard {lock};
+      ready.wait (guard, [this] { return stopping || ! queue.empty(); });
+      if (queue.empty())
+        return;
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+    try {
+      job();
+    }
+    catch (const std::exception& e) {
+      cout << "Worker job failed: " << e.what() << endl;
+    }
+    ++completed;
+  }
+}
+
+size_t WorkerPool::depth () {
+  unique_lock<std::mutex> guard {lock};
+  return queue.size();
+}
+
+size_t WorkerPool::peak () {
+  unique_lock<std::mutex> guard {lock};
+  return peak_depth;
+}
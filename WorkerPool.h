@@ -0,0 +1,52 @@
+#ifndef WorkerPool_h
+#define WorkerPool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+  Fixed set of worker threads fed by a bounded queue
+
+  submit() refuses work rather than blocking when the queue is full,
+  so that the caller (typically a listener thread) can shed load
+  with 503 instead of stalling behind CPU-heavy jobs.
+ */
+class WorkerPool {
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> queue;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::size_t capacity;
+  std::size_t peak_depth;
+  bool stopping;
+  std::atomic<unsigned long> accepted;
+  std::atomic<unsigned long> rejected;
+  std::atomic<unsigned long> completed;
+
+  void run ();
+
+public:
+  WorkerPool (std::size_t threads, std::size_t queue_capacity);
+  ~WorkerPool ();
+
+  WorkerPool (const WorkerPool&) = delete;
+  WorkerPool& operator= (const WorkerPool&) = delete;
+
+  bool submit (std::function<void()> job);
+
+  std::size_t depth ();
+  std::size_t peak ();
+  std::size_t max_depth () const { return capacity; }
+  unsigned long accepted_count () const { return accepted; }
+  unsigned long rejected_count () const { return rejected; }
+  unsigned long completed_count () const { return completed; }
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "WriteBehind.h"
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::unique_lock;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+WriteBehind::WriteBehind (std::chrono::milliseconds window_time, size_t max_mutations,
+                          size_t writer_threads, flush_function flush) :
+  window {window_time},
+  max_batch {max_mutations > 0 ? max_mutations : 1},
+  flush_batch {std::move(flush)},
+  users {},
+  due {},
+  lock {},
+  ready {},
+  written {},
+  writers {},
+  stopping {false},
+  mutations {0},
+  writes {0},
+  failures {0}
+{
+  for (size_t i {0}; i < writer_threads || i == 0; ++i)
+    writers.emplace_back (&WriteBehind::run, this);
+}
+
+WriteBehind::~WriteBehind () {
+  stop();
+}
+
+bool WriteBehind::submit (const string& userid, const user_session& session,
+                          const friend_mutation& m, ack_function ack) {
+  {
+    unique_lock<std::mutex> guard {lock};
+    if (stopping)
+      return false;
+    user_state& u (users[userid]);
+    batch& b (u.open);
+    const clock::time_point now {clock::now()};
+    if (b.mutations.empty()) {
+      b.opened = now;
+      // With none of the user's writes in flight, waiting gains nothing
+      if (u.writing)
+        due.emplace_back (now + window, userid);
+      else
+        due.emplace_front (now, userid);
+    }
+    b.session = session;
+    b.mutations.push_back (m);
+    b.acks.push_back (std::move(ack));
+    ++u.submitted;
+    // A full batch goes to the front, to be written at once
+    if (b.mutations.size() == max_batch)
+      due.emplace_front (now, userid);
+  }
+  ++mutations;
+  ready.notify_one();
+  return true;
+}
+
+/*
+  Block until some user's batch is due and none of that user's
+  batches is being written, then move it into b. Once stopping,
+  every batch is due. Returns false when stopped with nothing left.
+
+  A due entry may be stale, its batch written already, or early,
+  for a batch opened after an earlier one was written when full.
+  Stale entries are skipped; an early one merely writes its batch
+  ahead of its window.
+ */
+bool WriteBehind::take (string& userid, batch& b, unique_lock<std::mutex>& guard) {
+  for (;;) {
+    if (due.empty()) {
+      if (stopping)
+        return false;
+      ready.wait (guard);
+      continue;
+    }
+    if ( ! stopping && due.front().first > clock::now()) {
+      ready.wait_until (guard, due.front().first);
+      continue;
+    }
+    string next {std::move(due.front().second)};
+    due.pop_front();
+    auto u (users.find(next));
+    // A user being written is queued again when the write ends
+    if (u == users.end() || u->second.open.mutations.empty() || u->second.writing)
+      continue;
+    userid = std::move(next);
+    b = std::move(u->second.open);
+    u->second.open = batch {};
+    u->second.writing = true;
+    return true;
+  }
+}
+
+void WriteBehind::run () {
+  unique_lock<std::mutex> guard {lock};
+  string userid {};
+  batch b {};
+  while (take(userid, b, guard)) {
+    guard.unlock();
+    status_code status {status_codes::InternalError};
+    try {
+      status = flush_batch(userid, b.session, b.mutations);
+    }
+    catch (const std::exception& e) {
+      cout << "Write-behind of " << userid << " failed: " << e.what() << endl;
+    }
+    ++writes;
+    if (status != status_codes::OK)
+      ++failures;
+    for (const ack_function& ack : b.acks) {
+      if (ack)
+        ack(status);
+    }
+    guard.lock();
+
+    user_state& u (users[userid]);
+    u.writing = false;
+    u.completed += b.mutations.size();
+    if (u.open.mutations.empty()) {
+      users.erase(userid);
+    }
+    else {
+      const clock::time_point now {clock::now()};
+      if (u.open.mutations.size() >= max_batch || u.open.opened + window <= now)
+        due.emplace_front (now, userid);
+    }
+    written.notify_all();
+  }
+}
+
+void WriteBehind::flush (const string& userid) {
+  unique_lock<std::mutex> guard {lock};
+  auto u (users.find(userid));
+  if (u == users.end())
+    return;
+  const unsigned long target {u->second.submitted};
+  if ( ! u->second.open.mutations.empty()) {
+    due.emplace_front (clock::now(), userid);
+    ready.notify_one();
+  }
+  written.wait (guard, [this, &userid, target] {
+    auto v (users.find(userid));
+    return v == users.end() || v->second.completed >= target;
+  });
+}
+
+void WriteBehind::stop () {
+  {
+    unique_lock<std::mutex> guard {lock};
+    stopping = true;
+  }
+  ready.notify_all();
+  for (std::thread& w : writers)
+    w.join();
+  writers.clear();
+}
+
+size_t WriteBehind::pending () {
+  unique_lock<std::mutex> guard {lock};
+  size_t total {0};
+  for (const auto& u : users)
+    total += u.second.open.mutations.size();
+  return total;
+}
@@ -0,0 +1,111 @@
+#ifndef WriteBehind_h
+#define WriteBehind_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include "FriendSet.h"
+#include "SessionStore.h"
+
+/*
+  One AddFriend (add) or UnFriend (! add)
+ */
+struct friend_mutation {
+  bool add;
+  friend_id id;
+};
+
+/*
+  Per-user write-behind buffer for friend-list mutations
+
+  A mutation submitted while none of its user's writes is in flight
+  is written at once. Those submitted while one is gather, for
+  window after the first of them or until max_batch have gathered,
+  and are handed to the flush function together, in the order they
+  were submitted, so they cost one storage write instead of one
+  each. Each mutation's ack, if any, is called with the status of
+  that write.
+
+  Batches are written by a few writer threads. A user's batches are
+  written one at a time and in order, so a later UnFriend can never
+  be overtaken by an earlier AddFriend of the same friend.
+ */
+class WriteBehind {
+public:
+  using clock = std::chrono::steady_clock;
+  // Writes the mutations of userid, returning the status of the write
+  using flush_function =
+    std::function<web::http::status_code (const std::string& userid,
+                                          const user_session& session,
+                                          const std::vector<friend_mutation>& mutations)>;
+  using ack_function = std::function<void (web::http::status_code status)>;
+
+private:
+  struct batch {
+    user_session session;
+    std::vector<friend_mutation> mutations;
+    std::vector<ack_function> acks;
+    clock::time_point opened;
+  };
+  struct user_state {
+    batch open;
+    bool writing;
+    unsigned long submitted;
+    unsigned long completed;
+  };
+
+  const std::chrono::milliseconds window;
+  const std::size_t max_batch;
+  const flush_function flush_batch;
+
+  std::unordered_map<std::string,user_state> users;
+  // Users whose open batch is due at the given time, oldest first
+  std::deque<std::pair<clock::time_point,std::string>> due;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable written;
+  std::vector<std::thread> writers;
+  bool stopping;
+
+  std::atomic<unsigned long> mutations;
+  std::atomic<unsigned long> writes;
+  std::atomic<unsigned long> failures;
+
+  bool take (std::string& userid, batch& b, std::unique_lock<std::mutex>& guard);
+  void run ();
+
+public:
+  WriteBehind (std::chrono::milliseconds window_time, std::size_t max_mutations,
+               std::size_t writer_threads, flush_function flush);
+  ~WriteBehind ();
+
+  WriteBehind (const WriteBehind&) = delete;
+  WriteBehind& operator= (const WriteBehind&) = delete;
+
+  // ack may be empty; returns false, calling no ack, once stopped
+  bool submit (const std::string& userid, const user_session& session,
+               const friend_mutation& m, ack_function ack);
+  // Write any mutations pending for userid now, and wait until they are
+  void flush (const std::string& userid);
+  // Write everything pending, then join the writers
+  void stop ();
+
+  unsigned long mutation_count () const { return mutations; }
+  unsigned long write_count () const { return writes; }
+  unsigned long failure_count () const { return failures; }
+  std::size_t pending ();
+};
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ Benchmark of token issuance latency against AuthTable size
+
+ Grows AuthTable to each requested size with synthetic users
+ (inserted through BasicServer's UpdateEntityAdmin) and measures
+ the mean latency of GetReadToken for a sample of those users.
+ With the point read in AuthServer the latency should stay flat
+ as the table grows.
+
+ Requires BasicServer and AuthServer to be running.
+
+ Usage: authbench [size ...]     (default: 100 1000 10000)
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::to_string;
+using std::vector;
+
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::http::client::http_client;
+
+using web::json::value;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr const char* addr {"http://localhost:34568/"};
+constexpr const char* auth_addr {"http://localhost:34570/"};
+
+const string auth_table {"AuthTable"};
+const string auth_table_partition {"Userid"};
+const string update_entity_admin {"UpdateEntityAdmin"};
+const string get_read_token_op {"GetReadToken"};
+
+constexpr int samples {200};
+
+pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
+  http_request request {http_method};
+  if (req_body != value {}) {
+    http_headers& headers (request.headers());
+    headers.add("Content-Type", "application/json");
+    request.set_body(req_body);
+  }
+
+  status_code code;
+  value resp_body;
+  http_client client {uri_string};
+  client.request (request)
+    .then([&code](http_response response)
+    {
+      code = response.status_code();
+      const http_headers& headers {response.headers()};
+      auto content_type (headers.find("Content-Type"));
+      if (content_type == headers.end() ||
+          content_type->second != "application/json")
+        return pplx::task<value> ([] { return value {};});
+      else
+        return response.extract_json();
+    })
+    .then([&resp_body](value v) -> void
+    {
+      resp_body = v;
+    })
+    .wait();
+  return make_pair(code, resp_body);
+}
+
+string bench_userid (long i) {
+  return "bench-user-" + to_string(i);
+}
+
+value password_body (long i) {
+  return value::object (vector<pair<string,value>> {
+      make_pair("Password", value::string("pw" + to_string(i)))});
+}
+
+/*
+  Insert users [from, to) into AuthTable
+ */
+void populate (long from, long to) {
+  for (long i {from}; i < to; ++i) {
+    value props {value::object (vector<pair<string,value>> {
+        make_pair("Password", value::string("pw" + to_string(i))),
+        make_pair("DataPartition", value::string("Bench")),
+        make_pair("DataRow", value::string(bench_userid(i)))})};
+    do_request (methods::PUT,
+                string(addr) + update_entity_admin + "/" + auth_table + "/" +
+                auth_table_partition + "/" + bench_userid(i),
+                props);
+  }
+}
+
+int main (int argc, const char* argv[]) {
+  vector<long> sizes {};
+  for (int i {1}; i < argc; ++i)
+    sizes.push_back (std::atol(argv[i]));
+  if (sizes.empty())
+    sizes = vector<long> {100, 1000, 10000};
+
+  long populated {0};
+  for (long size : sizes) {
+    populate (populated, size);
+    populated = size;
+
+    long failures {0};
+    const auto start (bench_clock::now());
+    for (int s {0}; s < samples; ++s) {
+      const long i {(s * 7919L) % size};
+      pair<status_code,value> result {do_request (methods::GET,
+                                                  string(auth_addr) + get_read_token_op + "/" + bench_userid(i),
+                                                  password_body(i))};
+      if (result.first != status_codes::OK)
+        ++failures;
+    }
+    const auto elapsed (bench_clock::now() - start);
+    cout << "AuthTable users: " << size
+         << "  mean GetReadToken latency: "
+         << std::chrono::duration<double, std::micro>(elapsed).count() / samples << " us"
+         << "  failures: " << failures << endl;
+  }
+}
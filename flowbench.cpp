@@ -0,0 +1,136 @@
+/*
+ End-to-end latency of SignOn -> AddFriend -> UpdateStatus
+
+ Times each step of the flow, as seen by a client of UserServer,
+ for one synthetic user, and the three together. Run it once
+ against the four servers as separate processes and once against
+ the allinone binary to compare internal calls over HTTP (or
+ LocalRpc) with in-process dispatch.
+
+ Requires the servers to be running, with BasicServer on 34568 and
+ UserServer on 34572 in either case. AddFriend waits out the
+ write-behind window, so run UserServer with USER_WRITE_BEHIND_MS=0
+ to measure the calls rather than the window. UpdateStatus returns
+ once the update is journaled, so its time excludes the fan-out.
+
+ Usage: flowbench [iterations]     (default: 200)
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::to_string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::http::client::http_client;
+
+using web::json::value;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr const char* addr {"http://localhost:34568/"};
+constexpr const char* user_addr {"http://localhost:34572/"};
+
+const string update_entity_admin {"UpdateEntityAdmin"};
+const string flow_userid {"flow-bench-user"};
+const string flow_password {"flow-bench-password"};
+const string flow_partition {"Bench"};
+
+status_code do_request (const method& http_method, const string& uri_string,
+                        const value& req_body = value {}) {
+  http_request request {http_method};
+  if (req_body != value {}) {
+    request.headers().add("Content-Type", "application/json");
+    request.set_body(req_body);
+  }
+  http_client client {uri_string};
+  http_response response {client.request(request).get()};
+  response.content_ready().wait();
+  return response.status_code();
+}
+
+value props (const vector<pair<string,string>>& properties) {
+  value result {value::object()};
+  for (const auto& p : properties)
+    result[p.first] = value::string(p.second);
+  return result;
+}
+
+/*
+  Microseconds per call, as mean, median, and 99th percentile
+ */
+void report (const string& name, vector<double>& us) {
+  std::sort(us.begin(), us.end());
+  double total {0};
+  for (double u : us)
+    total += u;
+  cout << name << ": mean " << total / us.size()
+       << " us, p50 " << us[us.size() / 2]
+       << " us, p99 " << us[us.size() * 99 / 100] << " us" << endl;
+}
+
+int main (int argc, const char* argv[]) {
+  const long iterations {argc > 1 ? std::atol(argv[1]) : 200L};
+
+  do_request(methods::PUT, string(addr) + update_entity_admin + "/AuthTable/Userid/" + flow_userid,
+             props({{"Password", flow_password},
+                    {"DataPartition", flow_partition},
+                    {"DataRow", flow_userid}}));
+  do_request(methods::PUT, string(addr) + update_entity_admin + "/DataTable/" + flow_partition + "/" + flow_userid,
+             props({{"Friends", ""}, {"Status", ""}, {"Updates", ""}}));
+
+  vector<double> sign_on_us {};
+  vector<double> add_friend_us {};
+  vector<double> update_status_us {};
+  vector<double> flow_us {};
+  long failures {0};
+  for (long i {0}; i < iterations; ++i) {
+    const auto start (bench_clock::now());
+    const status_code signed_on {do_request(methods::POST, string(user_addr) + "SignOn/" + flow_userid,
+                                            props({{"Password", flow_password}}))};
+    const auto after_sign_on (bench_clock::now());
+    const status_code added {do_request(methods::PUT, string(user_addr) + "AddFriend/" + flow_userid +
+                                        "/Bench/friend-" + to_string(i % 50))};
+    const auto after_add (bench_clock::now());
+    const status_code updated {do_request(methods::PUT, string(user_addr) + "UpdateStatus/" + flow_userid +
+                                          "/status-" + to_string(i))};
+    const auto end (bench_clock::now());
+    do_request(methods::POST, string(user_addr) + "SignOff/" + flow_userid);
+
+    if (signed_on != status_codes::OK || added != status_codes::OK || updated != status_codes::Accepted)
+      ++failures;
+    using us = std::chrono::duration<double, std::micro>;
+    sign_on_us.push_back (us(after_sign_on - start).count());
+    add_friend_us.push_back (us(after_add - after_sign_on).count());
+    update_status_us.push_back (us(end - after_add).count());
+    flow_us.push_back (us(end - start).count());
+  }
+
+  cout << "Iterations: " << iterations << "  failures: " << failures << endl;
+  report("SignOn      ", sign_on_us);
+  report("AddFriend   ", add_friend_us);
+  report("UpdateStatus", update_status_us);
+  report("Flow        ", flow_us);
+}
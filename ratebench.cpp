@@ -0,0 +1,81 @@
+/*
+ Per-request overhead of rate limiting in AuthServer and UserServer
+
+ Times RateLimiter::acquire, the check each limited request makes
+ once per limiter, over a set of client keys from a growing number
+ of threads, and client_address for a request that came through a
+ trusted proxy. The limits are set high enough that nothing is
+ throttled, so the times are those of the common case.
+
+ Usage: ratebench [keys] [operations per thread] [max threads]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RateLimiter.h"
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::to_string;
+using std::vector;
+
+using bench_clock = std::chrono::steady_clock;
+
+/*
+  Mean nanoseconds per acquire over all threads; each thread walks
+  the keys with its own stride
+ */
+double ns_per_acquire (RateLimiter& limiter, const vector<string>& keys, int threads, long ops) {
+  vector<std::thread> workers {};
+  const auto start (bench_clock::now());
+  for (int t {0}; t < threads; ++t) {
+    workers.emplace_back ([&limiter, &keys, t, ops] ()
+    {
+      size_t i {static_cast<size_t>(t) * 7919};
+      for (long n {0}; n < ops; ++n) {
+        i = (i + 104729) % keys.size();
+        limiter.acquire (keys[i]);
+      }
+    });
+  }
+  for (std::thread& w : workers)
+    w.join ();
+  const auto elapsed (bench_clock::now() - start);
+  return std::chrono::duration<double,std::nano>(elapsed).count() / ops;
+}
+
+int main (int argc, const char* argv[]) {
+  const long key_count {argc > 1 ? std::atol(argv[1]) : 10000L};
+  const long ops {argc > 2 ? std::atol(argv[2]) : 1000000L};
+  const int max_threads {argc > 3 ? std::atoi(argv[3])
+                         : static_cast<int>(std::thread::hardware_concurrency())};
+
+  vector<string> keys {};
+  for (long i {0}; i < key_count; ++i)
+    keys.push_back ("10.1." + to_string(i / 256 % 256) + "." + to_string(i % 256));
+
+  RateLimiter limiter {static_cast<size_t>(key_count) * 2, 1e6, 1e4};
+  cout << "Keys: " << key_count << endl;
+  cout << "threads  acquire (ns, wall time / ops per thread)" << endl;
+  for (int threads {1}; threads <= max_threads; threads *= 2)
+    cout << threads << "  " << ns_per_acquire(limiter, keys, threads, ops) << endl;
+
+  const vector<string> proxies {parse_address_list("127.0.0.1,::1")};
+  size_t total {0};
+  const auto start (bench_clock::now());
+  for (long n {0}; n < ops; ++n)
+    total += client_address("127.0.0.1", keys[static_cast<size_t>(n) % keys.size()], proxies).size();
+  const auto elapsed (bench_clock::now() - start);
+  cout << "client_address (ns): "
+       << std::chrono::duration<double,std::nano>(elapsed).count() / ops
+       << "  (" << total << " bytes)" << endl;
+  cout << "Throttled: " << limiter.throttled_count() << endl;
+}
@@ -0,0 +1,93 @@
+/*
+ Microbenchmark of per-request routing cost
+
+ Compares the original handler prologue (decode the whole path,
+ split it into a vector of strings, compare the operation against
+ each name in turn) with path_segments and route_table, which split
+ in place and decode only the operands a handler uses.
+
+ Usage: routerbench [iterations]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cpprest/base_uri.h>
+
+#include "Router.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using web::http::uri;
+
+using bench_clock = std::chrono::steady_clock;
+
+enum class op { sign_on, sign_off, read_friend_list, add_friend, un_friend, update_status, unknown };
+
+const vector<string> op_names {
+  "SignOn", "SignOff", "ReadFriendList", "AddFriend", "UnFriend", "UpdateStatus"};
+
+const route_table<op> routes {
+  {{"SignOn", op::sign_on},
+   {"SignOff", op::sign_off},
+   {"ReadFriendList", op::read_friend_list},
+   {"AddFriend", op::add_friend},
+   {"UnFriend", op::un_friend},
+   {"UpdateStatus", op::update_status}},
+  op::unknown};
+
+const vector<string> sample_paths {
+  "/AddFriend/user/Canada/Edwards%2CKathleen",
+  "/UnFriend/user/USA/Franklin%2CAretha",
+  "/ReadFriendList/user",
+  "/UpdateStatus/user/Listening%20to%20RESPECT",
+  "/SignOn/user"};
+
+/*
+  Original prologue: returns the operation index and the
+  decoded length of the last operand, so that the work is not
+  optimized away.
+ */
+std::size_t split_and_compare (const string& raw) {
+  const string path {uri::decode(raw)};
+  const vector<string> paths {uri::split_path(path)};
+  std::size_t i {0};
+  while (i < op_names.size() && paths[0] != op_names[i])
+    ++i;
+  return i + paths.back().size();
+}
+
+std::size_t route_in_place (const string& raw) {
+  const path_segments paths {raw};
+  const op operation {routes.lookup(paths[0])};
+  return static_cast<std::size_t>(operation) + paths.decoded(paths.size() - 1).size();
+}
+
+template <typename F>
+double ns_per_request (F route, long iterations, std::size_t& sink) {
+  const auto start (bench_clock::now());
+  for (long i {0}; i < iterations; ++i) {
+    sink += route(sample_paths[i % sample_paths.size()]);
+  }
+  const auto elapsed (bench_clock::now() - start);
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main (int argc, const char* argv[]) {
+  const long iterations {argc > 1 ? std::atol(argv[1]) : 1000000L};
+  std::size_t sink {0};
+
+  const double old_ns {ns_per_request(split_and_compare, iterations, sink)};
+  const double new_ns {ns_per_request(route_in_place, iterations, sink)};
+
+  cout << "Iterations:                  " << iterations << endl;
+  cout << "decode + split_path + compare: " << old_ns << " ns/request" << endl;
+  cout << "path_segments + route_table:   " << new_ns << " ns/request" << endl;
+  cout << "(checksum " << sink << ")" << endl;
+}
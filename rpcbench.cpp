@@ -0,0 +1,117 @@
+/*
+ Latency of an internal call over HTTP and over LocalRpc
+
+ Serves one handler, shaped like a ReadEntityAdmin reply, both from
+ an http_listener on localhost and from a LocalRpcServer, then times
+ sequential round trips from a client in the same process:
+
+   http      http_client to the listener, as do_request did
+   rpc       send_request over the Unix socket, with the same
+             http_request and http_response objects at each end
+   rpc-raw   LocalRpcClient::call, with no http_request or
+             http_response on the calling side
+
+ Usage: rpcbench [iterations] [socket path]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include "LocalRpc.h"
+#include "LocalRpcHttp.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::methods;
+using web::http::status_codes;
+using web::http::experimental::listener::http_listener;
+using web::json::value;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr const char* bench_url {"http://localhost:34580/"};
+
+void handle_get (http_request message) {
+  value entity {value::object()};
+  entity["Friends"] = value::string("USA;Franklin,Aretha|Canada;Edwards,Kathleen");
+  entity["Status"] = value::string("Listening to Natural Woman");
+  entity["Path"] = value::string(message.relative_uri().path());
+  message.reply(status_codes::OK, entity);
+}
+
+/*
+  Microseconds per call, as mean, median, and 99th percentile
+ */
+void report (const string& name, vector<double>& us) {
+  std::sort(us.begin(), us.end());
+  double total {0};
+  for (double u : us)
+    total += u;
+  cout << name << ": mean " << total / us.size()
+       << " us, p50 " << us[us.size() / 2]
+       << " us, p99 " << us[us.size() * 99 / 100] << " us" << endl;
+}
+
+vector<double> time_calls (long iterations, const std::function<void ()>& call) {
+  vector<double> us {};
+  us.reserve (iterations);
+  for (long i {0}; i < iterations; ++i) {
+    const auto start (bench_clock::now());
+    call();
+    us.push_back (std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+  }
+  return us;
+}
+
+int main (int argc, const char* argv[]) {
+  const long iterations {argc > 1 ? std::atol(argv[1]) : 10000L};
+  const string socket_path {argc > 2 ? argv[2] : "/tmp/rpcbench.sock"};
+  const string uri {string(bench_url) + "ReadEntityAdmin/DataTable/USA/Franklin,Aretha"};
+
+  http_listener listener {bench_url};
+  listener.support(methods::GET, &handle_get);
+  listener.open().wait();
+  LocalRpcServer rpc_server {socket_path,
+    http_rpc_handler(&handle_get, http_handler {}, http_handler {}, http_handler {})};
+
+  vector<double> http_us {time_calls(iterations, [&uri] () {
+    web::http::client::http_client client {uri};
+    client.request(http_request {methods::GET}).get().extract_json().get();
+  })};
+
+  setenv("RPCBENCH_SOCKET", socket_path.c_str(), 1);
+  route_local_rpc(bench_url, "RPCBENCH_SOCKET");
+  vector<double> rpc_us {time_calls(iterations, [&uri] () {
+    send_request(uri, http_request {methods::GET}).get().extract_json().get();
+  })};
+
+  LocalRpcClient client {socket_path};
+  const rpc_request raw_request {"GET", "/ReadEntityAdmin/DataTable/USA/Franklin,Aretha",
+                                 rpc_headers {}, string {}};
+  vector<double> raw_us {time_calls(iterations, [&client, &raw_request] () {
+    rpc_response response {};
+    client.call(raw_request, response);
+  })};
+
+  cout << "Iterations: " << iterations << endl;
+  report("http   ", http_us);
+  report("rpc    ", rpc_us);
+  report("rpc-raw", raw_us);
+
+  rpc_server.close();
+  listener.close().wait();
+}
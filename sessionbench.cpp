@@ -0,0 +1,60 @@
+/*
+ Microbenchmark of session token verification
+
+ Measures the cost of SessionSigner::verify for a valid token and
+ for a forged one, which is the whole per-request authorization
+ cost once UserServer and BasicServer check session tokens locally
+ instead of looking the user up.
+
+ Usage: sessionbench [iterations]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "SessionToken.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+
+using bench_clock = std::chrono::steady_clock;
+
+template <typename F>
+double ns_per_call (F call, long iterations, long& sink) {
+  const auto start (bench_clock::now());
+  for (long i {0}; i < iterations; ++i) {
+    sink += call();
+  }
+  const auto elapsed (bench_clock::now() - start);
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main (int argc, const char* argv[]) {
+  const long iterations {argc > 1 ? std::atol(argv[1]) : 1000000L};
+  const SessionSigner signer {"sessionbench signing key"};
+  const session_claims claims {"Edwards,Kathleen", "Canada", "Edwards,Kathleen",
+                               session_now() + 3600, true};
+  const string token {signer.sign(claims)};
+  string forged {token};
+  forged[forged.size() - 1] = forged[forged.size() - 1] == 'A' ? 'B' : 'A';
+
+  long sink {0};
+  const double sign_ns {ns_per_call([&] () {
+        return static_cast<long>(signer.sign(claims).size()); }, iterations, sink)};
+  const double valid_ns {ns_per_call([&] () {
+        session_claims c {};
+        return static_cast<long>(signer.verify(token, c)); }, iterations, sink)};
+  const double forged_ns {ns_per_call([&] () {
+        session_claims c {};
+        return static_cast<long>(signer.verify(forged, c)); }, iterations, sink)};
+
+  cout << "Iterations:    " << iterations << endl;
+  cout << "Token length:  " << token.size() << " bytes" << endl;
+  cout << "sign:          " << sign_ns << " ns/token" << endl;
+  cout << "verify valid:  " << valid_ns << " ns/token" << endl;
+  cout << "verify forged: " << forged_ns << " ns/token" << endl;
+  cout << "(checksum " << sink << ")" << endl;
+}
@@ -0,0 +1,122 @@
+/*
+ Multithreaded benchmark of the UserServer session store
+
+ Signs on the requested number of users, then runs a mix of
+ lookups (the check every request makes), sign-ons and sign-offs
+ from a growing number of threads. SessionStore is compared with
+ a single unordered_map behind one lock, the smallest change that
+ would have made the old SignedOn map safe.
+
+ Usage: sessionstorebench [users] [operations per thread] [max threads]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "SessionStore.h"
+
+using pplx::extensibility::critical_section_t;
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
+using bench_clock = std::chrono::steady_clock;
+
+class SingleLockStore {
+private:
+  unordered_map<string,user_session> sessions;
+  critical_section_t lock;
+
+public:
+  bool find (const string& userid, user_session& session) {
+    scoped_critical_section_t l {lock};
+    auto e (sessions.find(userid));
+    if (e == sessions.end())
+      return false;
+    session = e->second;
+    return true;
+  }
+  void insert (const string& userid, const user_session& session) {
+    scoped_critical_section_t l {lock};
+    sessions[userid] = session;
+  }
+  bool erase (const string& userid) {
+    scoped_critical_section_t l {lock};
+    return sessions.erase(userid) == 1;
+  }
+};
+
+/*
+  Operations per second over all threads. Each thread walks the
+  userids with its own stride; one operation in ten signs a user
+  off and back on, the rest look the user up.
+ */
+template <typename Store>
+double ops_per_second (Store& store, const vector<string>& userids, int threads, long ops) {
+  const user_session session {"token", "Canada", "row"};
+  vector<std::thread> workers {};
+  const auto start (bench_clock::now());
+  for (int t {0}; t < threads; ++t) {
+    workers.emplace_back ([&store, &userids, &session, t, ops] ()
+    {
+      user_session found {};
+      size_t i {static_cast<size_t>(t) * 7919};
+      for (long n {0}; n < ops; ++n) {
+        i = (i + 104729) % userids.size();
+        if (n % 10 == 0) {
+          store.erase (userids[i]);
+          store.insert (userids[i], session);
+        }
+        else {
+          store.find (userids[i], found);
+        }
+      }
+    });
+  }
+  for (std::thread& w : workers)
+    w.join ();
+  const auto elapsed (bench_clock::now() - start);
+  return threads * ops / std::chrono::duration<double>(elapsed).count();
+}
+
+int main (int argc, const char* argv[]) {
+  const long users {argc > 1 ? std::atol(argv[1]) : 300000L};
+  const long ops {argc > 2 ? std::atol(argv[2]) : 1000000L};
+  const int max_threads {argc > 3 ? std::atoi(argv[3])
+                         : static_cast<int>(std::thread::hardware_concurrency())};
+
+  vector<string> userids {};
+  for (long i {0}; i < users; ++i)
+    userids.push_back ("user-" + to_string(i));
+
+  SessionStore sharded {std::chrono::seconds {30 * 60},
+                       std::chrono::seconds {24 * 60 * 60},
+                       static_cast<size_t>(users)};
+  SingleLockStore single {};
+  for (const string& u : userids) {
+    sharded.insert (u, user_session {"token", "Canada", u});
+    single.insert (u, user_session {"token", "Canada", u});
+  }
+
+  cout << "Signed-on users: " << sharded.size() << endl;
+  cout << "threads  single lock (ops/s)  SessionStore (ops/s)" << endl;
+  for (int threads {1}; threads <= max_threads; threads *= 2) {
+    const double single_rate {ops_per_second(single, userids, threads, ops)};
+    const double sharded_rate {ops_per_second(sharded, userids, threads, ops)};
+    cout << threads << "  " << single_rate << "  " << sharded_rate << endl;
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ Benchmark of UserServer session snapshots
+
+ Signs on the requested number of users, writes a snapshot, and
+ times loading it into an empty store, as UserServer does when it
+ restarts.
+
+ Usage: snapshotbench [users] [snapshot path]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "SessionSnapshot.h"
+#include "SessionStore.h"
+
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::to_string;
+
+using bench_clock = std::chrono::steady_clock;
+
+double ms_since (bench_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+int main (int argc, const char* argv[]) {
+  const long users {argc > 1 ? std::atol(argv[1]) : 300000L};
+  const string path {argc > 2 ? argv[2] : "snapshotbench.snap"};
+  const std::chrono::seconds idle {30 * 60};
+  const std::chrono::seconds absolute {24 * 60 * 60};
+
+  SessionStore before {idle, absolute, static_cast<size_t>(users)};
+  const string token (160, 't');
+  for (long i {0}; i < users; ++i) {
+    const string userid {"user-" + to_string(i)};
+    before.insert (userid, user_session {token, "Canada", userid});
+  }
+
+  auto start (bench_clock::now());
+  if ( ! save_session_snapshot(before, path)) {
+    cout << "Cannot write " << path << endl;
+    return 1;
+  }
+  const double save_ms {ms_since(start)};
+
+  SessionStore after {idle, absolute, static_cast<size_t>(users)};
+  start = bench_clock::now();
+  const long restored {load_session_snapshot(after, path)};
+  const double load_ms {ms_since(start)};
+
+  cout << "Sessions:  " << users << endl;
+  cout << "save:      " << save_ms << " ms" << endl;
+  cout << "load:      " << load_ms << " ms (" << restored << " restored)" << endl;
+  std::remove (path.c_str());
+}
@@ -3,9 +3,15 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <exception>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -16,6 +22,25 @@
 
 #include <UnitTest++/UnitTest++.h>
 
+#include "CredentialCache.h"
+#include "FanOut.h"
+#include "FriendCache.h"
+#include "FriendIndex.h"
+#include "FriendSet.h"
+#include "LocalRpc.h"
+#include "PushBatch.h"
+#include "RateLimiter.h"
+#include "Router.h"
+#include "ServerUtils.h"
+#include "SessionSnapshot.h"
+#include "SessionStore.h"
+#include "SessionToken.h"
+#include "ShardedTtlCache.h"
+#include "StatusQueue.h"
+#include "TokenCache.h"
+#include "UseridFilter.h"
+#include "WriteBehind.h"
+
 
 using std::cerr;
 using std::cout;
@@ -2088,6 +2113,129 @@ SUITE(GET_TOKEN){
 }
 
 
+SUITE(AUTH_CACHE){
+    /*
+     A second token request for the same user is served from
+     AuthServer's credential cache, and invalidation always succeeds.
+     */
+    TEST_FIXTURE(AuthFixture, CachedSignOn){
+        pair<status_code,value> before {do_request (methods::GET, string(AuthFixture::auth_addr) + "MetricsAdmin")};
+        CHECK_EQUAL(status_codes::OK, before.first);
+
+        CHECK_EQUAL(status_codes::OK, get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+        CHECK_EQUAL(status_codes::OK, get_read_token(AuthFixture::auth_addr, AuthFixture::userid, AuthFixture::user_pwd).first);
+
+        pair<status_code,value> after {do_request (methods::GET, string(AuthFixture::auth_addr) + "MetricsAdmin")};
+        CHECK_EQUAL(status_codes::OK, after.first);
+        CHECK(after.second["CredentialCacheHits"].as_number().to_uint64() >
+              before.second["CredentialCacheHits"].as_number().to_uint64());
+
+        pair<status_code,value> result {do_request (methods::DEL,
+                                                    string(AuthFixture::auth_addr) + "InvalidateUserAdmin/" + AuthFixture::userid)};
+        CHECK_EQUAL(status_codes::OK, result.first);
+    }
+
+    /*
+     A second request for a userid not in AuthTable is answered from
+     AuthServer's negative cache.
+     */
+    TEST_FIXTURE(AuthFixture, UnknownUseridNegativeHit){
+        const string unknown {"no-such-user-negative-cache"};
+        pair<status_code,value> before {do_request (methods::GET, string(AuthFixture::auth_addr) + "MetricsAdmin")};
+        CHECK_EQUAL(status_codes::OK, before.first);
+
+        CHECK_EQUAL(status_codes::NotFound, get_read_token(AuthFixture::auth_addr, unknown, AuthFixture::user_pwd).first);
+        CHECK_EQUAL(status_codes::NotFound, get_read_token(AuthFixture::auth_addr, unknown, AuthFixture::user_pwd).first);
+
+        pair<status_code,value> after {do_request (methods::GET, string(AuthFixture::auth_addr) + "MetricsAdmin")};
+        CHECK_EQUAL(status_codes::OK, after.first);
+        CHECK(after.second["NegativeCacheHits"].as_number().to_uint64() >
+              before.second["NegativeCacheHits"].as_number().to_uint64());
+    }
+
+    TEST(TokenReuseExpires){
+        TokenCache tokens {0.01, 100};
+        string token {};
+        tokens.insert("USA", "Franklin,Aretha", 1, "sig", std::chrono::seconds {1});
+        CHECK(tokens.lookup("USA", "Franklin,Aretha", 1, token));
+        CHECK_EQUAL(string("sig"), token);
+        // Another permission is another scope
+        CHECK(!tokens.lookup("USA", "Franklin,Aretha", 2, token));
+        // 1% of a second is the reuse window
+        std::this_thread::sleep_for(std::chrono::milliseconds {30});
+        CHECK(!tokens.lookup("USA", "Franklin,Aretha", 1, token));
+        CHECK_EQUAL(1ul, tokens.hit_count());
+        CHECK_EQUAL(2ul, tokens.miss_count());
+    }
+
+    TEST(NegativeCacheUnknownUserid){
+        UseridFilter filter {std::chrono::milliseconds {60000}, 100};
+        CHECK(!filter.known_absent("nobody"));
+        filter.add_missing("nobody");
+        CHECK(filter.known_absent("nobody"));
+        CHECK(!filter.known_absent("somebody"));
+        CHECK_EQUAL(1ul, filter.negative_hit_count());
+        // Creating the user ends the negative entry at once
+        filter.add_known("nobody");
+        CHECK(!filter.known_absent("nobody"));
+    }
+
+    TEST(CredentialsExpire){
+        CredentialCache credentials {std::chrono::seconds {0}, 100};
+        user_credentials creds {};
+        credentials.insert("user", user_credentials {"pwd", "USA", "Franklin,Aretha"});
+        CHECK(!credentials.lookup("user", creds));
+        CHECK_EQUAL(1ul, credentials.miss_count());
+    }
+}
+
+SUITE(TTL_CACHE){
+    // Every key in shard 0, in buckets as std::hash spreads them
+    struct one_shard {
+        std::size_t operator() (const string& key) const { return std::hash<string> {}(key) * 16; }
+    };
+
+    TEST(ExpiryAndRenew){
+        ShardedTtlCache<string,int> cache {100};
+        int found {0};
+        bool fresh {false};
+        cache.insert("a", 1, std::chrono::milliseconds {20});
+        CHECK(cache.find("a", found));
+        CHECK_EQUAL(1, found);
+        std::this_thread::sleep_for(std::chrono::milliseconds {40});
+        CHECK(!cache.find("a", found));
+        // Still held for revalidation
+        CHECK(cache.find_any("a", found, fresh));
+        CHECK(!fresh);
+        CHECK(!cache.renew("a", std::chrono::minutes {1}, [] (int v) { return v == 2; }));
+        CHECK(cache.renew("a", std::chrono::minutes {1}, [] (int v) { return v == 1; }));
+        CHECK(cache.find("a", found));
+        CHECK(cache.erase("a"));
+        CHECK(!cache.find_any("a", found, fresh));
+    }
+
+    TEST(EvictsOneVictim){
+        // 4 entries per shard
+        ShardedTtlCache<string,int,one_shard> cache {48};
+        cache.insert("expired", 0, -std::chrono::seconds {1});
+        cache.insert("k1", 1, std::chrono::minutes {1});
+        cache.insert("k2", 2, std::chrono::minutes {2});
+        cache.insert("k3", 3, std::chrono::minutes {3});
+        CHECK_EQUAL(4u, cache.size());
+        cache.insert("k4", 4, std::chrono::minutes {4});
+        CHECK_EQUAL(4u, cache.size());
+        int found {0};
+        bool fresh {false};
+        CHECK(!cache.find_any("expired", found, fresh));
+        CHECK(cache.find("k1", found) && cache.find("k2", found) &&
+              cache.find("k3", found) && cache.find("k4", found));
+        // Of live entries, the one expiring soonest goes
+        cache.insert("k5", 5, std::chrono::minutes {5});
+        CHECK(!cache.find("k1", found));
+        CHECK(cache.find("k2", found));
+    }
+}
+
 class UserFixture {
 public:
     static constexpr const char* addr {"http://localhost:34568/"};
@@ -2189,3 +2337,544 @@ SUITE(AddFriend){
     }
 
 }
+
+SUITE(ROUTER){
+    TEST(SplitInPlace){
+        string path {"/AddFriend//user/USA/Franklin%2CAretha"};
+        path_segments paths {path};
+        CHECK_EQUAL(4u, paths.size());
+        CHECK(paths[0] == string("AddFriend"));
+        CHECK_EQUAL(string("USA"), paths.decoded(2));
+        CHECK_EQUAL(string("Franklin,Aretha"), paths.decoded(3));
+        CHECK_EQUAL(0u, paths[7].size);
+    }
+
+    TEST(RouteLookup){
+        enum class op { read, update, unknown };
+        route_table<op> routes {
+            {{get_read_token_op, op::read},
+             {get_update_token_op, op::update}},
+            op::unknown};
+        string path {"/GetUpdateToken/user"};
+        path_segments paths {path};
+        CHECK(routes.lookup(paths[0]) == op::update);
+        CHECK(routes.lookup(paths[1]) == op::unknown);
+    }
+}
+
+SUITE(SESSION){
+    TEST(SignAndVerify){
+        SessionSigner signer {"tester key"};
+        session_claims claims {"Edwards,Kathleen", "Canada", "Edwards,Kathleen", session_now() + 60, true};
+        string token {signer.sign(claims)};
+        session_claims verified {};
+        CHECK(signer.verify(token, verified));
+        CHECK_EQUAL(claims.userid, verified.userid);
+        CHECK_EQUAL(claims.partition, verified.partition);
+        CHECK_EQUAL(claims.row, verified.row);
+        CHECK(verified.update);
+    }
+
+    TEST(RejectForgedAndExpired){
+        SessionSigner signer {"tester key"};
+        session_claims claims {"user", "USA", "user", session_now() + 60, false};
+        string token {signer.sign(claims)};
+        session_claims verified {};
+        CHECK(!SessionSigner {"other key"}.verify(token, verified));
+        CHECK(!signer.verify(token, claims.expiry, verified));
+        token[0] = token[0] == 'A' ? 'B' : 'A';
+        CHECK(!signer.verify(token, verified));
+        CHECK_EQUAL(string {}, bearer_token("Basic abc"));
+    }
+}
+
+SUITE(SESSION_STORE){
+    TEST(InsertFindErase){
+        SessionStore store {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        store.insert("user", user_session {"token", "USA", "user"});
+        store.insert("user", user_session {"newer", "USA", "user"});
+        user_session found {};
+        CHECK(store.find("user", found));
+        CHECK_EQUAL(string("newer"), found.token);
+        CHECK_EQUAL(1u, store.size());
+        CHECK(store.erase("user"));
+        CHECK(!store.erase("user"));
+        CHECK(!store.find("user", found));
+    }
+
+    TEST(EndedSessionNotFound){
+        SessionStore store {std::chrono::seconds {0}, std::chrono::seconds {3600}};
+        store.insert("user", user_session {"token", "USA", "user"});
+        user_session found {};
+        CHECK(!store.find("user", found));
+    }
+
+    TEST(SnapshotRoundTrip){
+        const string path {"tester.snap"};
+        SessionStore before {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        before.insert("user", user_session {"token", "USA", "user"});
+        CHECK(save_session_snapshot(before, path));
+        SessionStore after {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        CHECK_EQUAL(1, load_session_snapshot(after, path));
+        user_session found {};
+        CHECK(after.find("user", found));
+        CHECK_EQUAL(string("token"), found.token);
+        std::remove(path.c_str());
+    }
+
+    TEST(SignOffSurvivesRestart){
+        const string path {"tester.snap"};
+        SessionStore before {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        before.insert("gone", user_session {"old", "USA", "gone"});
+        before.insert("stays", user_session {"kept", "USA", "stays"});
+        CHECK(save_session_snapshot(before, path));
+        user_session ended {};
+        CHECK(before.erase("gone", ended));
+        CHECK_EQUAL(string("old"), ended.token);
+        CHECK(journal_sign_off(path, ended));
+        // A crash now, before the next snapshot, must not restore "gone"
+        SessionStore after {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        CHECK_EQUAL(1, load_session_snapshot(after, path));
+        user_session found {};
+        CHECK(!after.find("gone", found));
+        CHECK(after.find("stays", found));
+        // A later sign-on of the same user is not ended by the journal
+        before.insert("gone", user_session {"new", "USA", "gone"});
+        CHECK(save_session_snapshot(before, path));
+        SessionStore again {std::chrono::seconds {60}, std::chrono::seconds {3600}};
+        CHECK_EQUAL(2, load_session_snapshot(again, path));
+        CHECK(again.find("gone", found));
+        CHECK_EQUAL(string("new"), found.token);
+        std::remove(path.c_str());
+        std::remove((path + ".signoff").c_str());
+        std::remove((path + ".signoff.old").c_str());
+    }
+}
+
+SUITE(FRIEND_SET){
+    TEST(ParseAndSerialize){
+        FriendSet friends {FriendSet::parse("USA;Franklin,Aretha|Canada;Edwards,Kathleen|USA;Franklin,Aretha", 7)};
+        CHECK_EQUAL(2u, friends.size());
+        CHECK_EQUAL(7u, friends.version());
+        CHECK_EQUAL(string("Canada;Edwards,Kathleen|USA;Franklin,Aretha"), friends.serialize());
+        CHECK_EQUAL(string(""), FriendSet::parse("").serialize());
+    }
+
+    TEST(AddAndRemove){
+        FriendSet friends {};
+        CHECK(friends.add(friend_id {"USA", "Franklin,Aretha"}));
+        CHECK(!friends.add(friend_id {"USA", "Franklin,Aretha"}));
+        CHECK(friends.contains(friend_id {"USA", "Franklin,Aretha"}));
+        CHECK(friends.remove(friend_id {"USA", "Franklin,Aretha"}));
+        CHECK(!friends.remove(friend_id {"USA", "Franklin,Aretha"}));
+        CHECK_EQUAL(2u, friends.version());
+    }
+
+    TEST(Page){
+        const string list {"Canada;Edwards,Kathleen|USA;Franklin,Aretha|USA;Holiday,Billie"};
+        std::size_t total {0};
+        CHECK_EQUAL(string("USA;Franklin,Aretha|USA;Holiday,Billie"), FriendSet::page(list, 1, 5, total));
+        CHECK_EQUAL(3u, total);
+        CHECK_EQUAL(string("Canada;Edwards,Kathleen"), FriendSet::page(list, 0, 1, total));
+        CHECK_EQUAL(string(""), FriendSet::page(list, 3, 1, total));
+    }
+
+    TEST(BulkApply){
+        FriendSet friends {FriendSet::parse("USA;Franklin,Aretha|USA;Holiday,Billie")};
+        vector<friend_change> results {};
+        CHECK(friends.apply("Canada;Edwards,Kathleen|USA;Franklin,Aretha|nobody|USA;Simone,Nina",
+                            "USA;Holiday,Billie|USA;Simone,Nina|USA;Davis,Miles", results));
+        CHECK_EQUAL(7u, results.size());
+        CHECK(results[0].outcome == friend_outcome::added);
+        CHECK(results[1].outcome == friend_outcome::already_friend);
+        CHECK(results[2].outcome == friend_outcome::invalid);
+        CHECK(results[3].outcome == friend_outcome::conflict);
+        CHECK(results[4].outcome == friend_outcome::removed);
+        CHECK(results[5].outcome == friend_outcome::conflict);
+        CHECK(results[6].outcome == friend_outcome::not_friend);
+        CHECK_EQUAL(string("Canada;Edwards,Kathleen|USA;Franklin,Aretha"), friends.serialize());
+        // Applied again, nothing changes
+        CHECK(!friends.apply("Canada;Edwards,Kathleen", "USA;Holiday,Billie", results));
+        CHECK(results[0].outcome == friend_outcome::already_friend);
+        CHECK(results[1].outcome == friend_outcome::not_friend);
+    }
+
+    TEST(BulkApplyDuplicates){
+        FriendSet friends {FriendSet::parse("USA;Holiday,Billie")};
+        vector<friend_change> results {};
+        CHECK(friends.apply("USA;Simone,Nina|USA;Simone,Nina", "USA;Holiday,Billie|USA;Holiday,Billie", results));
+        CHECK_EQUAL(4u, results.size());
+        // The repeat does not report AlreadyFriend over Added
+        CHECK(results[0].outcome == friend_outcome::added);
+        CHECK(results[1].outcome == friend_outcome::added);
+        CHECK(results[2].outcome == friend_outcome::removed);
+        CHECK(results[3].outcome == friend_outcome::removed);
+        CHECK_EQUAL(2u, friends.version());
+        CHECK_EQUAL(string("USA;Simone,Nina"), friends.serialize());
+    }
+}
+
+SUITE(FRIEND_CACHE){
+    TEST(FreshStaleAndConfirm){
+        FriendCache cache {std::chrono::milliseconds {0}, 100};
+        bool fresh {true};
+        CHECK(!cache.lookup("user", fresh));
+        CHECK(!fresh);
+        cache.store("user", FriendSet::parse("USA;Franklin,Aretha"), "etag1");
+        friend_snapshot_ptr cached {cache.lookup("user", fresh)};
+        CHECK(cached);
+        CHECK(!fresh);
+        CHECK_EQUAL(string("USA;Franklin,Aretha"), cached->serialized);
+        CHECK_EQUAL(string("etag1"), cached->etag);
+        cache.drop("user");
+        CHECK(!cache.lookup("user", fresh));
+        CHECK_EQUAL(2u, cache.miss_count());
+        CHECK_EQUAL(1u, cache.stale_hit_count());
+    }
+
+    TEST(ListEtagFollowsList){
+        FriendCache cache {std::chrono::milliseconds {0}, 100};
+        const string first {cache.store("user", FriendSet::parse("USA;Franklin,Aretha", 1), "etag1")->list_etag};
+        CHECK_EQUAL(first, cache.store("user", FriendSet::parse("USA;Franklin,Aretha", 1), "etag2")->list_etag);
+        CHECK(first != cache.store("user", FriendSet::parse("USA;Holiday,Billie", 2), "etag3")->list_etag);
+    }
+
+    TEST(FreshEntryNeedsNoRevalidation){
+        FriendCache cache {std::chrono::milliseconds {60000}, 100};
+        cache.store("user", FriendSet {}, "etag1");
+        bool fresh {false};
+        CHECK(cache.lookup("user", fresh));
+        CHECK(fresh);
+        CHECK_EQUAL(1u, cache.fresh_hit_count());
+    }
+}
+
+SUITE(FRIEND_INDEX){
+    TEST(IntersectSorted){
+        const FriendIndex::node_list a {1, 3, 5, 7, 9};
+        FriendIndex::node_list b {};
+        for (FriendIndex::node n {0}; n < 1000; n += 3)
+            b.push_back(n);
+        FriendIndex::node_list both {};
+        intersect_sorted(a, b, both);
+        CHECK(both == (FriendIndex::node_list {3, 9}));
+        both.clear();
+        intersect_sorted(a, FriendIndex::node_list {2, 3, 4, 5}, both);
+        CHECK(both == (FriendIndex::node_list {3, 5}));
+    }
+
+    TEST(MutualAndSuggest){
+        FriendIndex index {};
+        index.load(friend_id {"USA", "Jo"}, FriendSet::parse("USA;Al|USA;Bo|USA;Cy"));
+        index.load(friend_id {"USA", "Al"}, FriendSet::parse("USA;Bo|USA;Di|USA;Ed"));
+        index.load(friend_id {"USA", "Bo"}, FriendSet::parse("USA;Di|USA;Jo"));
+        index.set(friend_id {"USA", "Ed"}, FriendSet::parse("USA;Bo|USA;Cy"));
+        // A mutation is newer than the scan
+        index.load(friend_id {"USA", "Ed"}, FriendSet::parse(""));
+
+        const vector<friend_id> mutual {index.mutual(friend_id {"USA", "Jo"}, friend_id {"USA", "Ed"})};
+        CHECK_EQUAL(2u, mutual.size());
+        CHECK_EQUAL(string("Bo"), mutual[0].name);
+        CHECK_EQUAL(string("Cy"), mutual[1].name);
+
+        const vector<pair<friend_id,std::size_t>> suggested {index.suggest(friend_id {"USA", "Jo"}, 10)};
+        CHECK_EQUAL(2u, suggested.size());
+        CHECK_EQUAL(string("Di"), suggested[0].first.name);
+        CHECK_EQUAL(2u, suggested[0].second);
+        CHECK_EQUAL(string("Ed"), suggested[1].first.name);
+    }
+}
+
+SUITE(WRITE_BEHIND){
+    TEST(BurstCoalesced){
+        std::atomic<int> writes {0};
+        std::atomic<int> acks {0};
+        FriendSet stored {};
+        {
+            WriteBehind buffer {std::chrono::milliseconds {50}, 100, 2,
+                [&writes, &stored] (const string&, const user_session&, const vector<friend_mutation>& mutations) {
+                    ++writes;
+                    // The burst gathers while a write is in flight
+                    std::this_thread::sleep_for(std::chrono::milliseconds {5});
+                    for (const friend_mutation& m : mutations)
+                        m.add ? stored.add(m.id) : stored.remove(m.id);
+                    return status_codes::OK;
+                }};
+            for (int i {0}; i < 500; ++i) {
+                buffer.submit("user", user_session {}, friend_mutation {true, friend_id {"USA", std::to_string(i)}},
+                              [&acks] (status_code status) { if (status == status_codes::OK) ++acks; });
+            }
+            buffer.submit("user", user_session {}, friend_mutation {false, friend_id {"USA", "0"}}, nullptr);
+            buffer.flush("user");
+            CHECK_EQUAL(0u, buffer.pending());
+        }
+        CHECK_EQUAL(500, acks.load());
+        CHECK_EQUAL(499u, stored.size());
+        CHECK(writes <= 10);
+    }
+
+    TEST(LoneMutationNotDelayed){
+        std::atomic<int> acks {0};
+        WriteBehind buffer {std::chrono::seconds {10}, 100, 1,
+            [] (const string&, const user_session&, const vector<friend_mutation>&) {
+                return status_codes::OK;
+            }};
+        buffer.submit("user", user_session {}, friend_mutation {true, friend_id {"USA", "Franklin,Aretha"}},
+                      [&acks] (status_code) { ++acks; });
+        for (int i {0}; i < 100 && acks == 0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds {10});
+        CHECK_EQUAL(1, acks.load());
+    }
+}
+
+SUITE(FAN_OUT){
+    TEST(BoundedAndComplete){
+        std::atomic<int> running {0};
+        std::atomic<int> peak {0};
+        vector<int> calls (50, 0);
+        fan_out(calls.size(), 8, [&running, &peak, &calls] (std::size_t i) {
+            const int now {++running};
+            int seen {peak};
+            while (now > seen && !peak.compare_exchange_weak(seen, now)) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds {2});
+            --running;
+            ++calls[i];
+        });
+        CHECK(std::all_of(calls.begin(), calls.end(), [] (int c) { return c == 1; }));
+        CHECK(peak <= 8);
+    }
+}
+
+SUITE(STATUS_QUEUE){
+    TEST(FullQueueRejects){
+        std::mutex gate {};
+        gate.lock();
+        StatusQueue queue {string {}, 2, 1, [&gate] (const status_update&) {
+            std::lock_guard<std::mutex> wait {gate};
+            return status_codes::OK;
+        }};
+        CHECK(queue.enqueue(status_update {"user", "USA", "Smith,Jo", "Hi", "", 0}));
+        CHECK(queue.enqueue(status_update {"user", "USA", "Smith,Jo", "Hi", "", 0}));
+        CHECK(!queue.enqueue(status_update {"user", "USA", "Smith,Jo", "Hi", "", 0}));
+        CHECK_EQUAL(1u, queue.rejected_count());
+        gate.unlock();
+        queue.stop();
+        CHECK_EQUAL(2u, queue.dispatched_count());
+    }
+
+    TEST(JournalReplayed){
+        const string journal {"tester.status.journal"};
+        std::remove(journal.c_str());
+        {
+            std::mutex gate {};
+            gate.lock();
+            StatusQueue queue {journal, 10, 1, [&gate] (const status_update&) {
+                std::lock_guard<std::mutex> wait {gate};
+                return status_codes::OK;
+            }};
+            CHECK(queue.enqueue(status_update {"user", "USA", "Smith,Jo", "first", "", 0}));
+            CHECK(queue.enqueue(status_update {"user", "USA", "Smith,Jo", "second", "", 0}));
+            // Stop while "first" is being dispatched; "second" stays in the journal
+            std::thread stopper {[&queue] { queue.stop(); }};
+            std::this_thread::sleep_for(std::chrono::milliseconds {100});
+            gate.unlock();
+            stopper.join();
+            CHECK_EQUAL(1u, queue.dispatched_count());
+        }
+        vector<string> delivered {};
+        {
+            StatusQueue queue {journal, 10, 1, [&delivered] (const status_update& u) {
+                delivered.push_back(u.status);
+                return status_codes::OK;
+            }};
+            CHECK_EQUAL(1u, queue.enqueued_count());
+            while (queue.size() > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds {1});
+        }
+        CHECK_EQUAL(1u, delivered.size());
+        CHECK_EQUAL(string("second"), delivered.front());
+        std::remove(journal.c_str());
+    }
+}
+
+SUITE(LOCAL_RPC){
+    TEST(FramingRoundTrip){
+        const rpc_request request {"PUT", "/UpdateEntitySession/DataTable",
+                                   rpc_headers {{"If-Match", "W/\"1\""}}, "{\"Friends\":\"\"}"};
+        rpc_request decoded {};
+        CHECK(decode_rpc_request(encode_rpc_request(request), decoded));
+        CHECK_EQUAL(request.path, decoded.path);
+        CHECK_EQUAL(string("W/\"1\""), decoded.headers[0].second);
+        CHECK_EQUAL(request.body, decoded.body);
+        string truncated {encode_rpc_request(request)};
+        truncated.pop_back();
+        CHECK(!decode_rpc_request(truncated, decoded));
+    }
+
+    TEST(CallOverSocket){
+        const string path {"tester.sock"};
+        LocalRpcServer server {path, [] (const rpc_request& request) {
+            return rpc_response {status_codes::OK, rpc_headers {{"ETag", "e1"}}, request.method + request.path};
+        }};
+        LocalRpcClient client {path};
+        rpc_response response {};
+        CHECK(rpc_outcome::replied ==
+              client.call(rpc_request {"GET", "/ReadEntitySession/DataTable", rpc_headers {}, string {}}, response));
+        CHECK_EQUAL(status_codes::OK, response.status);
+        CHECK_EQUAL(string("GET/ReadEntitySession/DataTable"), response.body);
+        server.close();
+        CHECK(rpc_outcome::not_sent == client.call(rpc_request {"GET", "/", rpc_headers {}, string {}}, response));
+    }
+
+    TEST(PooledConnectionAfterRestart){
+        const string path {"tester.sock"};
+        const rpc_handler handler {[] (const rpc_request&) {
+            return rpc_response {status_codes::OK, rpc_headers {}, string {}};
+        }};
+        LocalRpcClient client {path};
+        rpc_response response {};
+        {
+            LocalRpcServer first {path, handler};
+            CHECK(rpc_outcome::replied == client.call(rpc_request {"POST", "/", rpc_headers {}, "a"}, response));
+        }
+        // The pooled connection was closed with the first server
+        LocalRpcServer second {path, handler};
+        CHECK(rpc_outcome::replied == client.call(rpc_request {"POST", "/", rpc_headers {}, "b"}, response));
+    }
+
+    TEST(SlowServerTimesOutWithoutResend){
+        const string path {"tester.sock"};
+        std::atomic<int> calls {0};
+        LocalRpcServer server {path, [&calls] (const rpc_request&) {
+            ++calls;
+            std::this_thread::sleep_for(std::chrono::milliseconds {300});
+            return rpc_response {status_codes::OK, rpc_headers {}, string {}};
+        }};
+        LocalRpcClient client {path, std::chrono::milliseconds {50}};
+        rpc_response response {};
+        CHECK(rpc_outcome::timed_out == client.call(rpc_request {"POST", "/", rpc_headers {}, "x"}, response));
+        server.close();
+        CHECK_EQUAL(1, calls.load());
+    }
+}
+
+SUITE(RATE_LIMITER){
+    TEST(BurstThenThrottled){
+        RateLimiter limiter {64, 5, 3};
+        CHECK_EQUAL(0u, limiter.acquire("a"));
+        CHECK_EQUAL(0u, limiter.acquire("a"));
+        CHECK_EQUAL(0u, limiter.acquire("a"));
+        const std::uint64_t wait_ms {limiter.acquire("a")};
+        CHECK(wait_ms > 0 && wait_ms <= 200);
+        // Another key has a bucket of its own
+        CHECK_EQUAL(0u, limiter.acquire("b"));
+        CHECK_EQUAL(4ul, limiter.allowed_count());
+        CHECK_EQUAL(1ul, limiter.throttled_count());
+    }
+
+    TEST(FractionalRate){
+        RateLimiter limiter {64, 0.5, 1};
+        CHECK_EQUAL(0u, limiter.acquire("a"));
+        // Half a token a second is one every 2 s, not one a second
+        const std::uint64_t wait_ms {limiter.acquire("a")};
+        CHECK(wait_ms > 1900 && wait_ms <= 2000);
+    }
+
+    TEST(ClientAddress){
+        const vector<string> proxies {parse_address_list(" 10.0.0.1 ,10.0.0.2,")};
+        CHECK_EQUAL(2u, proxies.size());
+        CHECK_EQUAL(string("10.0.0.1"), proxies[0]);
+        // A client cannot name itself
+        CHECK_EQUAL(string("192.0.2.9"), client_address("192.0.2.9", "198.51.100.1", proxies));
+        CHECK_EQUAL(string("198.51.100.1"), client_address("10.0.0.1", "198.51.100.1", proxies));
+        // Only the hops added by trusted proxies are believed
+        CHECK_EQUAL(string("198.51.100.1"),
+                    client_address("10.0.0.1", "203.0.113.7, 198.51.100.1, 10.0.0.2", proxies));
+        // Another server, over LocalRpc or in process
+        CHECK_EQUAL(string("198.51.100.1"), client_address("", "198.51.100.1", proxies));
+        CHECK_EQUAL(string(""), client_address("", "", proxies));
+    }
+}
+
+SUITE(PUSH_BATCH){
+    TEST(CountryBoundaries){
+        const vector<push_batch> batches {batch_by_country(vector<friend_id> {
+            friend_id {"Canada", "Mitchell,Joni"},
+            friend_id {"USA", "Franklin,Aretha"},
+            friend_id {"USA", "Simone,Nina"}})};
+        CHECK_EQUAL(2u, batches.size());
+        CHECK_EQUAL(string("Canada"), batches[0].country);
+        CHECK_EQUAL(1u, batches[0].names.size());
+        CHECK_EQUAL(string("USA"), batches[1].country);
+        CHECK_EQUAL(string("Simone,Nina"), batches[1].names[1]);
+        CHECK(batch_by_country(vector<friend_id> {}).empty());
+    }
+
+    TEST(BatchCap){
+        vector<friend_id> recipients {};
+        for (std::size_t i {0}; i < 2 * max_batch_size + 50; ++i)
+            recipients.push_back(friend_id {"USA", std::to_string(i)});
+        recipients.push_back(friend_id {"Zambia", "Kaunda,Kenneth"});
+        const vector<push_batch> batches {batch_by_country(recipients)};
+        CHECK_EQUAL(4u, batches.size());
+        CHECK_EQUAL(max_batch_size, batches[0].names.size());
+        CHECK_EQUAL(max_batch_size, batches[1].names.size());
+        CHECK_EQUAL(50u, batches[2].names.size());
+        CHECK_EQUAL(string("Zambia"), batches[3].country);
+    }
+
+    TEST(AppendReplyMapping){
+        const push_batch batch {"USA", vector<string> {"a", "b", "c"}};
+        value body {value::object()};
+        body["a"] = value::number(status_codes::OK);
+        body["b"] = value::number(status_codes::NotFound);
+        body["c"] = value::string("OK");
+        std::unordered_map<string,status_code> results {};
+        map_append_reply(batch, status_codes::OK, body, results);
+        CHECK_EQUAL(status_codes::OK, results["USA;a"]);
+        CHECK_EQUAL(status_codes::NotFound, results["USA;b"]);
+        // A row missing from the reply, or not a status, is an error
+        CHECK_EQUAL(status_codes::InternalError, results["USA;c"]);
+
+        results.clear();
+        map_append_reply(batch, status_codes::BadRequest, value {}, results);
+        CHECK_EQUAL(3u, results.size());
+        CHECK_EQUAL(status_codes::BadRequest, results["USA;b"]);
+    }
+}
+
+SUITE(TOKEN_SCOPE){
+    TEST(Expiry){
+        CHECK(parse_token("se=2000-01-01T00%3A00%3A00Z&sp=r").expired());
+        CHECK(!parse_token("se=2999-01-01T00%3A00%3A00Z&sp=r").expired());
+        // Without "se", expiry is up to a stored policy
+        CHECK(!parse_token("sp=r").expired());
+        // Separators still percent-encoded
+        CHECK(parse_token("se%3D2000-01-01T00%253A00%253A00Z%26sp%3Dr").expired());
+    }
+
+    TEST(PartitionRowRange){
+        const token_scope scope {parse_token("spk=B&srk=m&epk=D&erk=k&sp=r")};
+        CHECK(scope.covers("C", "a"));
+        CHECK(scope.covers("B", "m"));
+        CHECK(!scope.covers("B", "a"));
+        CHECK(scope.covers("D", "k"));
+        CHECK(!scope.covers("D", "z"));
+        CHECK(!scope.covers("A", "z"));
+        CHECK(!scope.covers("E", "a"));
+        // Missing bounds are open
+        CHECK(parse_token("spk=B&sp=r").covers("Z", "z"));
+        CHECK(!parse_token("spk=B&sp=r").covers("A", "z"));
+        CHECK(parse_token("sp=r").covers("A", "a"));
+    }
+
+    TEST(Permissions){
+        const token_scope scope {parse_token("spk=USA&epk=USA&sp=ru")};
+        CHECK(scope.allows('r'));
+        CHECK(scope.allows('u'));
+        CHECK(!scope.allows('d'));
+        CHECK(!parse_token("sp=").allows('r'));
+        // Without "sp", permissions are up to a stored policy
+        CHECK(parse_token("spk=USA&epk=USA").allows('u'));
+    }
+}